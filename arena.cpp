@@ -0,0 +1,133 @@
+/*
+ *  arena.cpp
+ *  avaspec
+ *
+ *  One contiguous, page aligned block of memory, mapped directly from
+ *  the kernel.
+ *
+ */
+
+#include "arena.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include "error.hpp"
+#include <sys/mman.h> // mmap, madvise, msync
+#include <unistd.h>   // sysconf, ftruncate, close
+#include <fcntl.h>    // open, posix_fallocate
+
+namespace
+{
+  // size of a huge page on x86 and most arm64 kernels
+  size_t const HUGE_PAGE = 2 << 20;
+
+  size_t round_up (size_t size, size_t unit)
+  {
+    return (size + unit - 1) / unit * unit;
+  }
+}
+
+arena::arena (size_t size, bool huge, char const *path)
+  : m_data (0), m_size (0), m_huge (false), m_file (path != 0)
+{
+  startfunc;
+  size_t page = ::sysconf (_SC_PAGESIZE);
+  if (size == 0)
+    size = 1;
+  if (path)
+    {
+      // never truncate a file: it may be the spool of a crashed run
+      int fd = ::open (path, O_RDWR | O_CREAT | O_EXCL, 0644);
+      if (fd < 0)
+	{
+	  shevek_error_errno ("unable to create " << path);
+	  return;
+	}
+      m_size = round_up (size, page);
+      // allocate the blocks now, so running out of disk space is noticed
+      // here and not as a SIGBUS during the shot
+#ifdef __linux__
+      int err = ::posix_fallocate (fd, 0, m_size);
+#else
+      int err = ::ftruncate (fd, m_size) < 0 ? errno : 0;
+#endif
+      void *p = err ? MAP_FAILED
+	: ::mmap (0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED && !err)
+	err = errno;
+      ::close (fd);
+      if (err)
+	{
+	  m_size = 0;
+	  errno = err;
+	  shevek_error_errno ("unable to map " << size << " bytes of "
+			      << path);
+	  return;
+	}
+      m_data = static_cast <char *> (p);
+      return;
+    }
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge)
+    {
+      // explicit huge pages need a reserved pool; often there is none
+      m_size = round_up (size, HUGE_PAGE);
+      p = ::mmap (0, m_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      m_huge = p != MAP_FAILED;
+      dbg ("huge page mapping " << (m_huge ? "succeeded" : "failed") );
+    }
+#endif
+  if (p == MAP_FAILED)
+    {
+      m_size = round_up (size, huge ? HUGE_PAGE : page);
+      p = ::mmap (0, m_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+	{
+	  m_size = 0;
+	  shevek_error_errno ("unable to map " << size << " bytes");
+	  return;
+	}
+#ifdef MADV_HUGEPAGE
+      // transparent huge pages don't need a pool, but are best effort
+      if (huge)
+	::madvise (p, m_size, MADV_HUGEPAGE);
+#endif
+    }
+  m_data = static_cast <char *> (p);
+}
+
+arena::~arena ()
+{
+  startfunc;
+  if (m_data)
+    ::munmap (m_data, m_size);
+}
+
+void arena::prefault (size_t offset, size_t size)
+{
+  startfunc;
+  if (offset >= m_size)
+    return;
+  size_t end = size < m_size - offset ? offset + size : m_size;
+  // the mapping is zero filled; writing zeros doesn't change it
+  size_t page = ::sysconf (_SC_PAGESIZE);
+  for (size_t i = offset / page * page; i < end; i += page)
+    reinterpret_cast <char volatile *> (m_data)[i] = 0;
+}
+
+void arena::release (size_t offset, size_t size)
+{
+  startfunc;
+  if (!m_file)
+    return;
+  size_t page = ::sysconf (_SC_PAGESIZE);
+  size_t begin = round_up (offset, page);
+  size_t end = (offset + size) / page * page;
+  if (end <= begin)
+    return;
+  ::msync (m_data + begin, end - begin, MS_ASYNC);
+  // for a shared file mapping, this only drops our reference; dirty pages
+  // are still written to the file
+  ::madvise (m_data + begin, end - begin, MADV_DONTNEED);
+}
@@ -0,0 +1,49 @@
+/*
+ *  arena.hpp
+ *  avaspec
+ *
+ *  One contiguous, page aligned block of memory, mapped directly from
+ *  the kernel.  It is used for storage which is allocated once and then
+ *  written at frame rate, so the allocator never runs during acquisition.
+ *
+ */
+
+#ifndef AVASPEC_ARENA_HH
+#define AVASPEC_ARENA_HH
+
+#include <stddef.h>
+
+class arena
+{
+public:
+  // map at least size bytes.  If huge, try to back them with huge pages;
+  // if that fails, normal pages are used.  If path is given, the memory
+  // is a shared mapping of that file, which is created with the full size,
+  // and huge is ignored.  The file must not exist yet.  What is written
+  // survives a crash of the process.
+  explicit arena (size_t size, bool huge = false, char const *path = 0);
+  ~arena ();
+  char *data () { return m_data; }
+  char const *data () const { return m_data; }
+  size_t size () const { return m_size; }
+  // touch every page in [offset, offset + size), so the first write at
+  // frame rate doesn't fault
+  void prefault (size_t offset = 0, size_t size = ~size_t (0) );
+  bool huge () const { return m_huge; }
+  bool file () const { return m_file; }
+  // start writing the pages in [offset, offset + size) back to the file,
+  // and drop them from memory.  Their data is read back when it is used
+  // again.  Only whole pages are released.  Does nothing for memory
+  // which is not backed by a file.
+  void release (size_t offset, size_t size);
+private:
+  // not copyable
+  arena (arena const &);
+  void operator= (arena const &);
+  char *m_data;
+  // size of the mapping, a multiple of the page size
+  size_t m_size;
+  bool m_huge, m_file;
+};
+
+#endif // defined AVASPEC_ARENA_HH
@@ -28,11 +28,18 @@
 #include <sys/types.h> // open
 #include <unistd.h>    // close
 #include <termios.h>   // setting up the serial port
-#include <errno.h>     // errno == -EINTR
+#include <errno.h>     // errno, EINTR
 #include "ieee754.h"   // float
 #include <sys/poll.h>  // poll
 #include "debug.hpp" // startfunc, dbg
 #include "error.hpp"
+#include "kernels.hpp" // decode_pixels, polynomial, linear_table
+#include "emulation.hpp"
+#include "capture.hpp"
+#include "deferred.hpp"
+#ifdef AVASPEC_USB_ASYNC
+#include "usb_async.hpp"
+#endif
 
 
 avaspec::channel &avaspec::operator[] (unsigned idx)
@@ -139,6 +146,17 @@ void avaspec::external_trigger (bool enable)
   l_readwrite (command, 0x89, 1);
 }
 
+void avaspec::send_external_trigger (bool enable)
+{
+  startfunc;
+  m_external = enable;
+  char command[2] = { 0x09, char (enable ? 1 : 0) };
+  m_hardware->write_message (command, sizeof (command) );
+  // poll_read takes the reply
+  m_command_reply = char (0x89);
+  m_command_deadline = monotonic::now () + 1000 * monotonic::MS;
+}
+
 bool avaspec::get_external_trigger () const
 {
   startfunc;
@@ -182,16 +200,43 @@ void avaspec::start_read ()
   // don't read if a reading is in progress
   if (m_saved_integration_time != shevek::relative_time () )
     return;
-  std::string command = std::string ("\003\000\000\000\000", 5);
+  // a cancel of an earlier measurement must not end this one
+  m_hardware->clear_interrupt ();
+  char command[5];
   unsigned time_ms = m_integration_time.total () * 1000
     + m_integration_time.nanoseconds () / 1000000;
   dbg (time_ms);
+  command[0] = 0x03;
   command[1] = time_ms & 0xff;
   command[2] = (time_ms >> 8) & 0xff;
   command[3] = m_average & 0xff;
   command[4] = (m_average >> 8) & 0xff;
-  m_hardware->write_message (command);
+  m_stamps.start = monotonic::now ();
+  m_hardware->write_message (command, sizeof (command) );
+  m_stamps.issued = monotonic::now ();
+  m_stamps.first = 0;
+  m_frame_ok = true;
+  trace_event ("start_read", time_ms, m_average);
+  m_end = m_stamps.issued
+    + monotonic::from (m_integration_time) * (m_average ? m_average : 1);
+  m_stamps.end = m_end;
   m_saved_integration_time = m_integration_time;
+  m_poll_channel = l_next_channel (0);
+  m_requested = l_next_channel (m_poll_channel + 1);
+  m_poll_first = true;
+  m_poll_deadline = m_end + m_latency.margin () + 1000 * monotonic::MS;
+  m_polled = 0;
+  if (m_poll_channel < m_channel.size () )
+    m_channel[m_poll_channel].begin_data ();
+}
+
+unsigned avaspec::l_next_channel (unsigned idx) const
+{
+  startfunc;
+  while (idx < m_channel.size ()
+	 && m_channel[idx].get_range_max () <= m_channel[idx].get_range_min () )
+    ++idx;
+  return idx;
 }
 
 //unsigned avaspec::send_get_first_chan(void)
@@ -225,46 +270,362 @@ void avaspec::start_read ()
 //    return true;
 //}
 //
-bool avaspec::run_read_async(void)
+bool avaspec::run_read_async(bool rearm)
 {
-    std::string command;
-    std::string data;
-    unsigned channel;
-    
-    unsigned time_ms = m_integration_time.total () * 1000
-        + m_integration_time.nanoseconds () / 1000000;
+    startfunc;
+    return l_finish_read(true, rearm);
+}
 
-    poll(0,0,time_ms - 10);
-    
-    for (channel = 0; channel < m_channel.size (); ++channel) {
-        if (m_channel[channel].get_range_max ()
-                <= m_channel[channel].get_range_min () ) continue;
-            command[1] = channel & 0xff;
-            break ;
+void avaspec::cancel_read ()
+{
+  startfunc;
+  m_cancel_read = true;
+  m_hardware->interrupt ();
+}
+
+void avaspec::abandon_read ()
+{
+  startfunc;
+  unsigned owed = m_command_reply ? 1 : 0;
+  // the device sends the first channel when the measurement is done
+  if (m_saved_integration_time != shevek::relative_time () && m_poll_first)
+    ++owed;
+  l_forget_replies (owed);
+  m_saved_integration_time = shevek::relative_time ();
+  m_poll_channel = m_channel.size ();
+  m_command_reply = 0;
+}
+
+shevek::relative_time avaspec::readout_latency () const
+{
+  startfunc;
+  return monotonic::to_relative (m_latency.estimate () );
+}
+
+monotonic::ns const avaspec::NEVER = ~0ull >> 1;
+
+bool avaspec::poll_read ()
+{
+  startfunc;
+  if (m_command_reply)
+    {
+      unsigned l;
+      do
+	l = m_hardware->try_read_message (m_reply.data (),
+					  m_reply.capacity (), 1,
+					  m_command_reply);
+      while (l_stale (l) );
+      m_polled = monotonic::now ();
+      if (l == 0 && m_polled < m_command_deadline)
+	return false;
+      // as l_readwrite: no reply, or a wrong one, is an error
+      char reply = m_command_reply;
+      m_command_reply = 0;
+      if (l == 0)
+	m_stale += m_hardware->forget_replies (1);
+      l_check_reply (m_reply, l, reply, 1);
+    }
+  while (m_poll_channel < m_channel.size () )
+    {
+      channel &c = m_channel[m_poll_channel];
+      m_hardware->set_progress (channel::l_progress, &c);
+      unsigned l;
+      try
+	{
+	  // a dropped message was decoded into the channel while it arrived
+	  while (l_stale (l = m_hardware->try_read_message
+			  (m_reply.data (), m_reply.capacity (),
+			   c.message_size (), 0x83) ) )
+	    c.begin_data ();
+	}
+      catch (...)
+	{
+	  m_hardware->set_progress (0, 0);
+	  abandon_read ();
+	  throw;
+	}
+      m_hardware->set_progress (0, 0);
+      m_polled = monotonic::now ();
+      if (l == 0)
+	{
+	  if (m_polled < m_poll_deadline || (m_poll_first && m_external) )
+	    return false;
+	  m_stats.count (m_stats.timeouts);
+	  trace_event ("timeout", m_poll_channel, 0);
+	  if (m_poll_first)
+	    {
+	      // no data at all: the device is gone
+	      unsigned late = m_poll_channel;
+	      abandon_read ();
+	      shevek_error ("timeout waiting for data of channel " << late);
+	    }
+	  // as in l_read_channels, a late channel only spoils this
+	  // measurement, and the rest of it is not read
+	  deferred::warning ("timeout waiting for data of channel %lld",
+			     m_poll_channel);
+	  m_frame_ok = false;
+	  l_forget_replies (0);
+	  m_poll_channel = m_channel.size ();
+	  break;
+	}
+      else
+	{
+	  bool ok = l_check_data (m_poll_channel, l);
+	  trace_event ("data", m_poll_channel, l);
+	  if (!m_stamps.first)
+	    m_stamps.first = m_polled;
+	  m_stamps.received = m_polled;
+	  if (m_poll_first)
+	    {
+	      // when polling, the arrival time is only when we looked
+	      if (!m_external && m_hardware->poll_fds (0, 0) != 0)
+		m_latency.sample (monotonic::now () - m_end);
+	      m_time = shevek::absolute_time ();
+	      m_poll_first = false;
+	    }
+	  else
+	    --m_outstanding;
+	  // as in l_finish_read, request before decoding
+	  l_request_ahead ();
+	  if (!ok || !c.new_data (m_reply.data (), l) )
+	    m_frame_ok = false;
+	}
+      m_poll_channel = l_next_channel (m_poll_channel + 1);
+      if (m_poll_channel < m_channel.size () )
+	{
+	  m_channel[m_poll_channel].begin_data ();
+	  m_poll_deadline = monotonic::now () + 1000 * monotonic::MS;
+	}
     }
+  if (m_saved_integration_time != shevek::relative_time () )
+    {
+      m_measured_time = m_saved_integration_time;
+      m_saved_integration_time = shevek::relative_time ();
+      l_frame_done ();
+    }
+  return true;
+}
 
-    m_hardware->write_message(command);
+monotonic::ns avaspec::read_deadline () const
+{
+  startfunc;
+  if (m_command_reply)
+    {
+      monotonic::ns next = m_polled + POLL_INTERVAL_US * 1000;
+      return m_hardware->poll_fds (0, 0) == 0 && next < m_command_deadline
+	? next : m_command_deadline;
+    }
+  if (m_poll_channel >= m_channel.size () )
+    return NEVER;
+  if (m_hardware->poll_fds (0, 0) == 0)
+    {
+      // nothing tells us when data arrives: look when the integration
+      // ends, and then regularly
+      monotonic::ns expected = m_poll_first ? m_end : 0;
+      monotonic::ns next = m_polled + POLL_INTERVAL_US * 1000;
+      return expected > next ? expected : next;
+    }
+  if (m_poll_first && m_external)
+    return NEVER;
+  return m_poll_deadline;
+}
 
-    do {
-        // read message (timeout_ms,replylen,reply)
-        data = m_hardware->read_message(20,0,0x83);
-    } while ((data.size()==0)&&(m_cancel_read==false));
-    
-    if (m_cancel_read) return false;
-    
-    m_channel[channel].new_data(data);
-    
-    for (++channel; channel < m_channel.size(); ++channel) {
-        if (m_channel[channel].get_range_max ()
-            <= m_channel[channel].get_range_min () ) continue;
-        command = std::string("\004\000",2);
-        data = l_readwrite(command, 0x83, 0, 0);
-        m_channel[channel].new_data(data);
+unsigned avaspec::poll_fds (struct pollfd *fds, unsigned max) const
+{
+  startfunc;
+  return m_hardware->poll_fds (fds, max);
+}
+
+bool avaspec::polls () const
+{
+  startfunc;
+  return m_hardware->polls ();
+}
+
+bool avaspec::l_finish_read (bool cancellable, bool rearm)
+{
+  startfunc;
+  // whatever happens, the measurement is over: start_read must not think
+  // it is still running
+  bool done;
+  try
+    {
+      done = l_read_channels (cancellable);
+    }
+  catch (...)
+    {
+      abandon_read ();
+      throw;
+    }
+  if (!done)
+    {
+      abandon_read ();
+      return false;
+    }
+  m_measured_time = m_saved_integration_time;
+  m_saved_integration_time = shevek::relative_time ();
+  m_poll_channel = m_channel.size ();
+  // The data is in the channels now, and the device is idle.  Start the
+  // next measurement before anybody looks at this one.
+  if (rearm)
+    start_read ();
+  return true;
+}
+
+bool avaspec::l_read_channels (bool cancellable)
+{
+  startfunc;
+  unsigned channel = l_next_channel (0);
+  if (channel < m_channel.size () )
+    {
+      // The device sends the first channel by itself when the
+      // measurement is done.  Wait for it until it is clearly late: the
+      // learned margin covers the normal jitter, on top of that it gets
+      // the usual reply timeout.
+      monotonic::ns deadline = m_end + m_latency.margin ()
+	+ 1000 * monotonic::MS;
+      read_result result = l_read_data (channel, deadline, cancellable);
+      if (result == CANCELLED)
+	return false;
+      // no data at all: the device is gone
+      if (result == TIMEOUT)
+	shevek_error ("timeout waiting for data of channel " << channel);
+      // the arrival time is meaningless if the device waited for a
+      // trigger
+      if (!m_external)
+	m_latency.sample (monotonic::now () - m_end);
+      m_time = shevek::absolute_time ();
+      m_poll_first = false;
+      while (true)
+	{
+	  // ask for the next channels before decoding this one, so they
+	  // are on their way while we decode
+	  l_request_ahead ();
+	  // a bad message only spoils this measurement; the other channels
+	  // are still read.  The measurement is counted as a bad frame.
+	  if (result != DATA
+	      || !m_channel[channel].new_data (m_reply.data (),
+					       m_reply.size () ) )
+	    m_frame_ok = false;
+	  channel = l_next_channel (channel + 1);
+	  if (channel >= m_channel.size () )
+	    break;
+	  result = l_read_data (channel,
+				monotonic::now () + 1000 * monotonic::MS,
+				false);
+	  if (result == TIMEOUT)
+	    {
+	      // a late one too, but its reply may still come, and those to
+	      // the other requests after it.  They are dropped when they
+	      // do; the rest of this measurement is not read.
+	      deferred::warning ("timeout waiting for data of channel %lld",
+				 channel);
+	      m_frame_ok = false;
+	      l_forget_replies (0);
+	      break;
+	    }
+	  --m_outstanding;
+	}
+      l_frame_done ();
     }
-    return true;
+  return true;
+}
+
+void avaspec::l_frame_done ()
+{
+  startfunc;
+  m_stamps.decoded = monotonic::now ();
+  m_stats.latency[acquisition_stats::ISSUE]
+    .record (m_stamps.issued - m_stamps.start);
+  m_stats.latency[acquisition_stats::WAIT]
+    .record (m_stamps.first - m_stamps.end);
+  m_stats.latency[acquisition_stats::TRANSFER]
+    .record (m_stamps.received - m_stamps.first);
+  m_stats.latency[acquisition_stats::DECODE]
+    .record (m_stamps.decoded - m_stamps.received);
+  m_stats.count (m_stats.frames);
+  if (!m_frame_ok)
+    m_stats.count (m_stats.bad_frames);
+  m_last_ok = m_frame_ok;
+  trace_event ("frame_done", m_stats.frames.load (std::memory_order_relaxed),
+	       m_stamps.decoded - m_stamps.start);
+  // a rearm overwrites m_stamps before the data is published
+  m_done = m_stamps;
+}
+
+acquisition_stats const &avaspec::stats () const
+{
+  startfunc;
+  return m_stats;
+}
+
+bool avaspec::frame_ok () const
+{
+  startfunc;
+  return m_last_ok;
 }
 
+void avaspec::reset_stats ()
+{
+  startfunc;
+  m_stats.reset ();
+}
+
+void avaspec::published ()
+{
+  startfunc;
+  // once per measurement
+  if (!m_done.decoded)
+    return;
+  monotonic::ns now = monotonic::now ();
+  m_stats.latency[acquisition_stats::PUBLISH].record (now - m_done.decoded);
+  m_stats.latency[acquisition_stats::TOTAL].record (now - m_done.start);
+  trace_event ("published", now - m_done.decoded, now - m_done.start);
+  m_done.decoded = 0;
+}
+
+void avaspec::saturated (unsigned pixels)
+{
+  startfunc;
+  if (!pixels)
+    return;
+  m_stats.count (m_stats.saturated_frames);
+  m_stats.saturated_pixels.fetch_add (pixels, std::memory_order_relaxed);
+}
+
+void avaspec::l_forget_replies (unsigned owed)
+{
+  startfunc;
+  owed += m_outstanding;
+  m_outstanding = 0;
+  m_requested = m_channel.size ();
+  if (owed)
+    m_stale += m_hardware->forget_replies (owed);
+}
+
+bool avaspec::l_stale (unsigned l)
+{
+  startfunc;
+  if (l == 0 || m_stale == 0)
+    return false;
+  --m_stale;
+  m_stats.count (m_stats.retries);
+  trace_event ("stale", l, m_stale);
+  return true;
+}
 
+void avaspec::l_request_ahead ()
+{
+  startfunc;
+  while (m_requested < m_channel.size ()
+	 && m_outstanding < m_hardware->queue_depth () )
+    {
+      char command[2] = { 0x04, char (m_requested & 0xff) };
+      m_hardware->write_message (command, sizeof (command) );
+      ++m_outstanding;
+      m_requested = l_next_channel (m_requested + 1);
+    }
+}
 
 static void * async_read_thread_wrapper(void * p)
 {
@@ -295,7 +656,7 @@ bool avaspec::cancel_read_async()
     
     if (!m_thread_running) return false;
     
-    m_cancel_read = true;
+    cancel_read();
     
     pthread_join(m_thread, reinterpret_cast<void **>(&result_p));
     
@@ -307,27 +668,7 @@ bool avaspec::cancel_read_async()
 void avaspec::end_read ()
 {
   startfunc;
-  bool first = true;
-  std::string command; // start with empty command: only read
-  unsigned pausetime = m_saved_integration_time.total () * 1000
-    + m_saved_integration_time.nanoseconds () / 1000000;
-  for (unsigned channel = 0; channel < m_channel.size (); ++channel)
-    {
-      if (m_channel[channel].get_range_max ()
-	  <= m_channel[channel].get_range_min () ) continue;
-      if (!first)
-	command[1] = channel & 0xff;
-      std::string data = l_readwrite (command, 0x83, 0, pausetime);
-      // record the time
-      if (first)
-	m_time = shevek::absolute_time ();
-      m_channel[channel].new_data (data);
-      command = std::string ("\004\000", 2);
-      first = false;
-      pausetime = 0;
-    }
-  m_measured_time = m_saved_integration_time;
-  m_saved_integration_time = shevek::relative_time ();
+  l_finish_read (false, false);
 }
 
 void avaspec::write_eeprom (std::string const &password)
@@ -428,6 +769,7 @@ void avaspec::init (std::string const &config)
 	  return;
 	}
     }
+  m_reply.reserve (MAX_MESSAGE);
   std::string status = l_readwrite (std::string ("\001", 1), 0x81, 327);
   //0x40 bytes version
   m_eeprom.version = std::string (&status[0x01], 0x40);
@@ -479,6 +821,7 @@ void avaspec::init (std::string const &config)
       //use ijking
       std::vector <float> ijkvector;
       shevek::relative_time ijktime;
+      unsigned ijkstart = 0;
       std::vector <float> nl;
       if (configfile) do
 	{
@@ -513,20 +856,27 @@ void avaspec::init (std::string const &config)
 	      ijkvector[i - start] = ijking;
 	    }
 	  ijkvector.resize (i - start);
+	  ijkstart = start;
 	} while (0);
       //setup the channel structure with all the info
       if (i < numchannels)
-	m_channel[i].setup (this, i, ijkvector, ijktime, nl);
+	m_channel[i].setup (this, i, ijkvector, ijktime, ijkstart, nl);
     }
   // disable external trigger
   l_readwrite (std::string ("\011\000", 2), 0x89, 1);
   m_thread_running = false;
+  m_poll_channel = m_channel.size ();
+  m_command_reply = 0;
+  m_frame_ok = m_last_ok = true;
 }
 
-avaspec::avaspec (std::string const &config, std::string const &device)
+void avaspec::l_create (std::string const &config, hardware *device)
 {
   startfunc;
-  m_hardware = new serial (device);
+  m_hardware = device;
+  m_stamps = m_done = stamps ();
+  m_outstanding = m_stale = 0;
+  m_hardware->count_retries (&m_stats.retries);
   try
     {
       init (config);
@@ -538,35 +888,123 @@ avaspec::avaspec (std::string const &config, std::string const &device)
     }
 }
 
+avaspec::avaspec (std::string const &config, std::string const &device)
+{
+  startfunc;
+  l_create (config, new serial (device) );
+}
+
 avaspec::avaspec (std::string const &config,
 		  unsigned vendor, unsigned product, unsigned skip)
 {
   startfunc;
-  m_hardware = new usb (vendor, product, skip);
-  try
+#ifdef AVASPEC_USB_ASYNC
+  l_create (config, new usb_async (vendor, product, skip) );
+#else
+  l_create (config, new usb (vendor, product, skip) );
+#endif
+}
+
+avaspec::avaspec (std::string const &config)
+{
+  startfunc;
+  l_create (config, new emulation (source () ) );
+}
+
+avaspec::source::source (type_t t)
+  : type (t), vendor (0), product (0), skip (0), realtime (true),
+    template_ms (100),
+    readout_ms (1), rate (1.2e6), trigger_hz (0), noise (1)
+{
+  startfunc;
+}
+
+bool avaspec::source::parse (std::string const &descr)
+{
+  startfunc;
+  if (descr == "usb")
     {
-      init (config);
+      type = USB;
+      return true;
     }
-  catch (...)
+  if (descr.compare (0, 7, "serial:") == 0)
     {
-      delete m_hardware;
-      throw;
+      type = SERIAL;
+      device = descr.substr (7);
+      return true;
     }
+  if (descr.compare (0, 7, "replay:") == 0
+      || descr.compare (0, 12, "replay-fast:") == 0)
+    {
+      type = REPLAY;
+      realtime = descr[6] == ':';
+      device = descr.substr (descr.find (':') + 1);
+      return true;
+    }
+  if (descr.compare (0, 9, "emulation") != 0
+      || (descr.size () > 9 && descr[9] != ':') )
+    return false;
+  type = EMULATION;
+  std::string::size_type pos = 10;
+  while (pos < descr.size () )
+    {
+      std::string::size_type end = descr.find (',', pos);
+      if (end == std::string::npos)
+	end = descr.size ();
+      std::string item = descr.substr (pos, end - pos);
+      pos = end + 1;
+      std::string::size_type eq = item.find ('=');
+      if (eq == std::string::npos)
+	return false;
+      std::string key = item.substr (0, eq), value = item.substr (eq + 1);
+      if (key == "spectrum")
+	{
+	  spectrum = value;
+	  continue;
+	}
+      char *rest;
+      double v = ::strtod (value.c_str (), &rest);
+      if (value.empty () || *rest || v < 0)
+	return false;
+      if (key == "template_ms") template_ms = v;
+      else if (key == "readout_ms") readout_ms = v;
+      else if (key == "rate") rate = v;
+      else if (key == "trigger_hz") trigger_hz = v;
+      else if (key == "noise") noise = v;
+      else return false;
+    }
+  return true;
 }
 
-avaspec::avaspec (std::string const &config)
+avaspec::avaspec (std::string const &config, source const &where)
 {
   startfunc;
-  m_hardware = new emulation ();
-  try
-    {
-      init (config);
-    }
-  catch (...)
+  hardware *device;
+  switch (where.type)
     {
-      delete m_hardware;
-      throw;
+    case source::USB:
+#ifdef AVASPEC_USB_ASYNC
+      device = new usb_async (where.vendor, where.product, where.skip);
+#else
+      device = new usb (where.vendor, where.product, where.skip);
+#endif
+      break;
+    case source::SERIAL:
+      device = new serial (where.device);
+      break;
+    case source::EMULATION:
+      device = new emulation (where);
+      break;
+    case source::REPLAY:
+      device = new replay (where.device, where.realtime);
+      break;
+    default:
+      shevek_error ("invalid device source " << where.type);
+      return;
     }
+  if (!where.record.empty () )
+    device = new recorder (device, where.record);
+  l_create (config, device);
 }
 
 avaspec::~avaspec ()
@@ -585,6 +1023,9 @@ void avaspec::set_calibration (unsigned channel, unsigned which, float value)
       return;
     }
   m_eeprom.channel[channel].calibration[which] = value;
+  // gain and offset are not part of the wavelength polynomial
+  if (which < 5 && channel < m_channel.size () )
+    m_channel[channel].l_update_wavelengths ();
 }
 
 float avaspec::get_calibration (unsigned channel, unsigned which) const
@@ -643,41 +1084,154 @@ unsigned avaspec::get_stop (unsigned channel) const
   return m_eeprom.channel[channel].stop;
 }
 
-std::string avaspec::l_readwrite (std::string const &message, char reply,
-				  unsigned replysize, unsigned pausetime)
+unsigned avaspec::l_readwrite (char const *message, unsigned size,
+			       aligned_buffer &target, char reply,
+			       unsigned replysize)
 {
   startfunc;
-  std::string result;
-  if (!message.empty () ) m_hardware->write_message (message);
-  if (pausetime)
-    poll (0, 0, pausetime);
-  result = m_hardware->read_message (1000, replysize, reply);
-  if (result.size () == 0)
+  if (size) m_hardware->write_message (message, size);
+  unsigned l;
+  do
+    l = m_hardware->read_message (target.data (), target.capacity (),
+				  1000, replysize, reply);
+  while (l_stale (l) );
+  // a late reply must not be taken for the reply to the next command
+  if (l == 0)
+    m_stale += m_hardware->forget_replies (1);
+  l_check_reply (target, l, reply, replysize);
+  return l;
+}
+
+void avaspec::l_check_reply (aligned_buffer &target, unsigned l, char reply,
+			     unsigned replysize)
+{
+  startfunc;
+  target.resize (l);
+  if (l == 0)
     {
       shevek_error ("empty reply");
-      return std::string ();
+      return;
     }
-  if ( (replysize && replysize != result.size () )
-      && (result.size () != 2 || result[0] != 0) )
+  if ( (replysize && replysize != l)
+      && (l != 2 || target[0] != 0) )
     {
-      shevek_error ("incorrect reply size (" << result.size () << " != "
+      shevek_error ("incorrect reply size (" << l << " != "
 		    << replysize << ")");
-      return std::string ();
+      return;
     }
-  if (result[0] == 0)
+  if (target[0] == 0)
     {
-      shevek_error ("device returned error: " << unsigned (result[1]) );
-      return std::string ();
+      shevek_error ("device returned error: " << unsigned (target[1]) );
+      return;
     }
-  if (result[0] != reply)
+  if (target[0] != reply)
     {
       shevek_warning ("expected " << unsigned (reply & 0xff) << ", got "
-		      << unsigned (result[0] & 0xff) );
+		      << unsigned (target[0] & 0xff) );
       // this must be a throw, not a shevek_error, to make it catchable for
       // incorrect passwords.  The message must also be the same as there.
       throw "incorrect reply";
     }
-  return result;
+}
+
+std::string avaspec::l_readwrite (std::string const &message, char reply,
+				  unsigned replysize)
+{
+  startfunc;
+  unsigned l = l_readwrite (message.data (), message.size (), m_reply, reply,
+			    replysize);
+  return std::string (m_reply.data (), l);
+}
+
+avaspec::read_result avaspec::l_read_data (unsigned idx,
+					   monotonic::ns deadline,
+					   bool cancellable)
+{
+  startfunc;
+  channel &c = m_channel[idx];
+  // a backend which can't be woken up must return regularly to see
+  // m_cancel_read
+  unsigned limit = cancellable && !m_hardware->interruptible ()
+    ? unsigned (CANCEL_SLICE_MS) : ~0u;
+  // let the channel decode while the message is arriving
+  c.begin_data ();
+  m_hardware->set_progress (channel::l_progress, &c);
+  m_hardware->allow_interrupt (cancellable);
+  unsigned l = 0;
+  try
+    {
+      while (!(cancellable && m_cancel_read) )
+	{
+	  bool late = monotonic::now () >= deadline;
+	  if (late && !(cancellable && m_external) )
+	    break;
+	  // with external trigger, only the cancel ends the wait
+	  l = m_hardware->read_message
+	    (m_reply.data (), m_reply.capacity (),
+	     late ? limit : monotonic::ms_until (deadline, limit),
+	     c.message_size (), 0x83);
+	  if (l_stale (l) )
+	    {
+	      // it was decoded into the channel while it arrived
+	      c.begin_data ();
+	      l = 0;
+	    }
+	  else if (l)
+	    break;
+	}
+    }
+  catch (...)
+    {
+      m_hardware->set_progress (0, 0);
+      m_hardware->allow_interrupt (false);
+      throw;
+    }
+  m_hardware->set_progress (0, 0);
+  m_hardware->allow_interrupt (false);
+  if (l == 0 && cancellable && m_cancel_read)
+    {
+      m_stats.count (m_stats.cancels);
+      trace_event ("cancel", idx, 0);
+      return CANCELLED;
+    }
+  if (l == 0)
+    {
+      m_stats.count (m_stats.timeouts);
+      trace_event ("timeout", idx, 0);
+      return TIMEOUT;
+    }
+  bool ok = l_check_data (idx, l);
+  trace_event ("data", idx, l);
+  m_stamps.received = monotonic::now ();
+  // without progress reports, this is the first we hear of the data
+  if (!m_stamps.first)
+    m_stamps.first = m_stamps.received;
+  return ok ? DATA : BAD_DATA;
+}
+
+bool avaspec::l_check_data (unsigned idx, unsigned l)
+{
+  startfunc;
+  m_reply.resize (l);
+  if (l >= 2 && m_reply[0] == 0)
+    {
+      deferred::warning ("device returned error %lld for channel %lld",
+			 m_reply[1] & 0xff, idx);
+      return false;
+    }
+  if (m_reply[0] != char (0x83) )
+    {
+      deferred::warning ("expected data for channel %lld, got reply %lld",
+			 idx, m_reply[0] & 0xff);
+      return false;
+    }
+  if (l != m_channel[idx].message_size () )
+    {
+      deferred::warning ("incorrect data size for channel %lld (%lld bytes)",
+			 idx, l);
+      return false;
+    }
+  return true;
 }
 
 bool avaspec::usb::l_find_device (unsigned vendor, unsigned product,
@@ -791,21 +1345,21 @@ avaspec::usb::~usb ()
   usb_close (m_handle);
 }
 
-void avaspec::usb::write_message (std::string const &message)
+void avaspec::usb::write_message (char const *message, unsigned size)
 {
   startfunc;
   unsigned done = 0;
   while (true)
     {
-      if (message.size () == done)
+      if (size == done)
 	return;
       int l = usb_bulk_write (m_handle, m_out_ep,
 			      // I hate const casts, but the library wants
 			      // a char *, not a char const *.  I don't
 			      // expect it to change the data at all,
 			      // though.
-			      const_cast <char *> (message.data () ) + done,
-			      message.size () - done, 1000);
+			      const_cast <char *> (message) + done,
+			      size - done, 1000);
       if (l < 0)
 	{
 	  shevek_error_errno ("unable to write message to usb device");
@@ -815,28 +1369,40 @@ void avaspec::usb::write_message (std::string const &message)
     }
 }
 
-std::string avaspec::usb::read_message (unsigned timeout, unsigned, char)
+unsigned avaspec::usb::read_message (char *buffer, unsigned capacity,
+				     unsigned timeout, unsigned, char)
 {
   startfunc;
-  char buffer[6000];
-  int l = usb_bulk_read (m_handle, m_in_ep, buffer, sizeof (buffer), timeout);
+  // read straight into the caller's buffer
+  int l = usb_bulk_read (m_handle, m_in_ep, buffer, capacity, timeout);
   if (l <= 0)
     {
 //      shevek_error ("unable to read from usb device: " << usb_strerror());
-      return std::string ();
+      return 0;
     }
-  return std::string (buffer, l);
+  return l;
 }
 
-unsigned avaspec::serial::m_id = 0;
-
 avaspec::serial::serial (std::string const &device_file)
+  : m_deframer (MAX_MESSAGE + HEADER),
+    m_frame (dle_max_frame (MAX_MESSAGE + HEADER) )
 {
   startfunc;
-  m_buffer_size = 0;
+  m_id = 0;
+  m_pending = 0;
+  m_allow_interrupt = false;
+  if (::pipe (m_wake) < 0)
+    {
+      shevek_error_errno ("unable to create wakeup pipe");
+      return;
+    }
+  ::fcntl (m_wake[0], F_SETFL, O_NONBLOCK);
+  ::fcntl (m_wake[1], F_SETFL, O_NONBLOCK);
   m_fd = ::open (device_file.c_str(), O_RDWR | O_NOCTTY);
   if (m_fd < 0)
     {
+      ::close (m_wake[0]);
+      ::close (m_wake[1]);
       shevek_error_errno ("unable to open device file");
       return;
     }
@@ -858,42 +1424,81 @@ avaspec::serial::~serial ()
 {
   startfunc;
   ::close (m_fd);
+  ::close (m_wake[0]);
+  ::close (m_wake[1]);
+}
+
+unsigned avaspec::serial::try_read_message (char *buffer, unsigned capacity,
+					    unsigned replysize, char reply)
+{
+  startfunc;
+  // with a timeout of 0, poll doesn't wait
+  return read_message (buffer, capacity, 0, replysize, reply);
+}
+
+unsigned avaspec::serial::poll_fds (struct pollfd *fds, unsigned max) const
+{
+  startfunc;
+  if (max >= 1)
+    {
+      fds[0].fd = m_fd;
+      fds[0].events = POLLIN;
+    }
+  return 1;
 }
 
-void avaspec::serial::write_message (std::string const &message)
+unsigned avaspec::serial::forget_replies (unsigned)
 {
   startfunc;
-  std::string data;
-  // duplicate all 0x10's in the message
-  std::string::size_type done = 0, found;
-  while ( (found = message.find (0x10, done) ) != std::string::npos) 
+  // only requests which are written after this are answered
+  m_pending = 0;
+  return 0;
+}
+
+void avaspec::serial::interrupt ()
+{
+  startfunc;
+  // if the pipe is full, a wakeup is pending already
+  char c = 0;
+  if (::write (m_wake[1], &c, 1) < 0 && errno != EAGAIN)
+    shevek_warning ("unable to wake up serial reader");
+}
+
+void avaspec::serial::clear_interrupt ()
+{
+  startfunc;
+  char c[16];
+  while (::read (m_wake[0], c, sizeof (c) ) > 0)
     {
-      data += message.substr (done, found - done);
-      data += std::string ("\020\020", 2);
-      done = found + 1;
     }
-  data += message.substr (done);
-  // add header and footer
-  unsigned len = data.size ();
-  data = std::string ("\020\002\000\000\000\000", 6) + data
-    + std::string ("\020\003", 2);
-  data[2] = m_id++ & 0xff;
-  data[3] = 0; // node number, not used
-  data[4] = len & 0xff;
-  data[5] = (len >> 8) & 0xff;
-  if (len >> 16)
+}
+
+void avaspec::serial::write_message (char const *raw, unsigned size)
+{
+  startfunc;
+  if (size >> 16)
     {
-      shevek_error ("message too long (" << len << " >= 1 << 16)");
+      shevek_error ("message too long (" << size << " >= 1 << 16)");
       return;
     }
-  // write it to serial port
-  done = 0;
-  while (done < data.size () )
+  char header[HEADER];
+  header[0] = m_id++ & 0xff;
+  header[1] = 0; // node number, not used
+  header[2] = size & 0xff;
+  header[3] = (size >> 8) & 0xff;
+  ++m_pending;
+  // m_frame has room for the largest message since construction, so this
+  // doesn't allocate
+  m_frame.reserve (dle_max_frame (HEADER + size) );
+  unsigned total = dle_encode (header, HEADER, raw, size, m_frame.data () );
+  // write it to serial port, normally in one go
+  unsigned done = 0;
+  while (done < total)
     {
-      int l = ::write (m_fd, data.data () + done, data.size () - done);
+      int l = ::write (m_fd, m_frame.data () + done, total - done);
       if (l < 0)
 	{
-	  if (errno == -EINTR) continue;
+	  if (errno == EINTR) continue;
 	  shevek_error_errno ("error writing to serial device");
 	  return;
 	}
@@ -901,257 +1506,258 @@ void avaspec::serial::write_message (std::string const &message)
     }
 }
 
-std::string avaspec::serial::read_message (unsigned timeout, unsigned, char)
+unsigned avaspec::serial::read_message (char *buffer, unsigned capacity,
+					unsigned timeout, unsigned, char)
 {
   startfunc;
-  std::string message;
+  char header[HEADER];
+  unsigned size;
+  monotonic::ns deadline = monotonic::now ()
+    + timeout * monotonic::ns (monotonic::MS);
   while (true)
     {
       dbg ("reading message");
-      message = l_read_message (timeout);
-      if (unsigned (message[0] & 0xff) == ( (m_id - 1) & 0xff) ) break;
+      size = l_read_message (header, buffer, capacity, deadline);
+      if (size == TIMEOUT)
+	return 0;
+      // replies come in the order of the requests, so anything within the
+      // last m_pending ids is an answer.  The requests after it are still
+      // pending.  Replies to forgotten requests are older.
+      unsigned age = (m_id - 1 - unsigned (header[0] & 0xff) ) & 0xff;
+      if (age < m_pending)
+	{
+	  m_pending = age;
+	  break;
+	}
       dbg ("invalid id, trying to read next message");
+      retried ();
     }
-  unsigned len = (message[2] & 0xff) + ( (message[3] & 0xff) << 8);
-  if (len == 0) // error message
+  unsigned len = (header[2] & 0xff) + ( (header[3] & 0xff) << 8);
+  if (len == 0 && size == 1 && capacity >= 2) // error message
     {
-      if (message.size () != 5)
-	shevek_error ("invalid length for error message (" << message.size ()
-		      << " != 5)");
-      else
-        shevek_error ("error received from device: "
-		      << unsigned (message[4] & 0xff) );
-      return std::string ();
-    }
-  if (len != message.size () - 4)
-    {
-      shevek_error ("incorrect message length (" << len << " != "
-		    << (message.size () - 4) << ")");
-      return std::string ();
+      // pass it on like the usb device sends it; the caller decides if
+      // it is fatal
+      buffer[1] = buffer[0];
+      buffer[0] = 0;
+      return 2;
     }
-  return message.substr (4);
+  // a damaged reply is still the reply to its request; the caller sees
+  // that its size is wrong
+  if (len != size)
+    deferred::warning ("incorrect message length (%lld != %lld)", len, size);
+  return size;
 }
 
-std::string avaspec::serial::l_read_message (unsigned timeout)
+unsigned avaspec::serial::l_read_message (char *header, char *buffer,
+					  unsigned capacity,
+					  monotonic::ns deadline)
 {
   startfunc;
-  // read the data
   while (true)
     {
-      struct pollfd pfd;
-      pfd.fd = m_fd;
-      pfd.events = POLLIN;
+      // a frame may be complete already, from an earlier read
+      switch (m_deframer.next () )
+	{
+	case dle_deframer::FRAME:
+	  {
+	    unsigned size = m_deframer.frame_size ();
+	    // a frame without a header can't be matched to a request; it is
+	    // skipped
+	    if (size < HEADER)
+	      {
+		deferred::warning ("frame too short (%lld bytes), skipped",
+				   size);
+		retried ();
+		continue;
+	      }
+	    // keep what fits; read_message sees that the length is wrong
+	    if (size - HEADER > capacity)
+	      {
+		deferred::warning ("message too long for buffer (%lld > %lld)",
+				   size - HEADER, capacity);
+		size = capacity + HEADER;
+	      }
+	    ::memcpy (header, m_deframer.frame (), HEADER);
+	    ::memcpy (buffer, m_deframer.frame () + HEADER, size - HEADER);
+	    return size - HEADER;
+	  }
+	case dle_deframer::TOO_LONG:
+	  // the deframer has dropped it and looks for the next frame
+	  deferred::warning ("frame too long for the deframer, skipped");
+	  retried ();
+	  continue;
+	case dle_deframer::MORE:
+	  break;
+	}
+      struct pollfd pfd[2];
+      pfd[0].fd = m_fd;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = m_wake[0];
+      pfd[1].events = POLLIN;
       int t;
-      while (1 != (t = ::poll (&pfd, 1, timeout) ) )
+      // the timeout is recomputed from the deadline after every signal.
+      // The wakeup pipe is only watched by reads which may be interrupted.
+      while (0 >= (t = ::poll (pfd, m_allow_interrupt ? 2 : 1,
+			       monotonic::now () >= deadline ? 0
+			       : monotonic::ms_until (deadline, ~0u >> 1) ) ) )
 	{
-	  if (t == 0)
-	    {
-	      shevek_error ("timeout on serial device");
-	      return std::string ();
-	    }
-	  if (errno != -EINTR)
+	  if (t == 0 && monotonic::now () >= deadline)
+	    return TIMEOUT;
+	  if (t < 0 && errno != EINTR)
 	    {
 	      shevek_error_errno ("poll returned error");
-	      return std::string ();
+	      return 0;
 	    }
-	  // FIXME: timeout should be updated
 	}
-      if (!(pfd.revents & POLLIN) )
+      // the byte stays in the pipe until clear_interrupt
+      if (m_allow_interrupt && (pfd[1].revents & POLLIN) )
+	return TIMEOUT;
+      if (!(pfd[0].revents & POLLIN) )
 	{
 	  shevek_error ("error on socket");
-	  return std::string ();
+	  return 0;
 	}
-      int l = ::read (m_fd, &m_buffer[m_buffer_size],
-		      BUFFERSIZE - m_buffer_size);
+      unsigned room;
+      char *space = m_deframer.space (room);
+      int l = ::read (m_fd, space, room);
+      trace_event ("serial_read", l, room);
       if (l <= 0)
 	{
-	  if (errno == -EINTR) continue;
+	  if (l < 0 && errno == EINTR) continue;
 	  shevek_error ("read error");
-	  return std::string ();
-	}
-      m_buffer_size += l;
-      while (true)
-	{
-	  char *p = reinterpret_cast <char *> (memchr (m_buffer, 0x10,
-						       m_buffer_size) );
-	  if (p != m_buffer)
-	    {
-	      if (p == 0)
-		{
-		  m_buffer_size = 0;
-		  dbg ("no 0x10 in buffer");
-		  break; // read more
-		}
-	      memmove (m_buffer, p, m_buffer_size - (p - m_buffer) );
-	      m_buffer_size -= p - m_buffer;
-	    }
-	  if (m_buffer_size < 2) break; // read more
-	  if (m_buffer[1] != 0x02) // this is not a message head after all
-	    {
-	      m_buffer[0] = 0;
-	      dbg ("not a message head, retrying");
-	      continue; // retry parsing
-	    }
-	  std::string data;
-	  for (unsigned i = 2; i < m_buffer_size; ++i)
-	    {
-	      if (m_buffer[i] == 0x10)
-		{
-		  if (i + 1 == m_buffer_size) break; // read more
-		  switch (m_buffer[i + 1])
-		    {
-		    case 0x10: // escaped 0x10, insert only one in data
-		      data += 0x10;
-		      ++i;
-		      break;
-		    case 0x03: // end of message
-		      if (i + 1 != m_buffer_size)
-			memmove (m_buffer, &m_buffer[i + 2],
-				 m_buffer_size - (i + 1) );
-		      m_buffer_size -= i + 1;
-		      return data;
-		    default: // weird message
-		      m_buffer[0] = 0; // break header, look for next one
-		      continue;
-		    }
-		}
-	      else
-		{
-		  data += m_buffer[i];
-		}
-	    }
-	  // this exit means the message did not yet finish, but we saw the
-	  // whole buffer: read more
-	  break;
+	  return 0;
 	}
+      m_deframer.commit (l);
     }
 }
 
-avaspec::emulation::emulation ()
+bool avaspec::channel::new_data (char const *message, unsigned size)
 {
   startfunc;
+  if (size < 6)
+    {
+      deferred::warning ("data message too short (%lld < %lld)", size, 6);
+      return false;
+    }
+  m_mindata = (message[2] & 0xff) + ( (message[3] & 0xff) << 8);
+  m_maxdata = (message[4] & 0xff) + ( (message[5] & 0xff) << 8) + 1;
+  if (m_mindata != m_min || m_maxdata != m_max)
+    {
+      deferred::warning ("consistency check failed for data range: "
+			 "got [%lld, %lld)", m_mindata, m_maxdata);
+      return false;
+    }
+  // the extra pixels come first, directly followed by the data, so both
+  // are decoded in one pass.
+  unsigned count = m_parent->m_extra_pixels + m_maxdata - m_mindata;
+  if (size < 6 + 2 * count)
+    {
+      deferred::warning ("data message too short (%lld < %lld)", size,
+			 6 + 2 * count);
+      return false;
+    }
+  // partial_data may already have done the first part
+  unsigned done = m_decoded;
+  bool bad = m_bad;
+  m_decoded = 0;
+  m_bad = false;
+  // Contrary to the documentation, the numbers should be divided by 4.
+  // A consistancy check is added, remove the division if it fails.
+  if (!kernels::decode_pixels (message + 6 + 2 * done, &m_pixels[done],
+			       count - done) || bad)
+    {
+      deferred::warning ("raw data of channel %lld is not a multiple of 4",
+			 m_id);
+      return false;
+    }
+  return true;
 }
 
-avaspec::emulation::~emulation ()
+unsigned avaspec::channel::message_size () const
 {
   startfunc;
+  return 6 + 2 * (m_parent->m_extra_pixels + m_max - m_min);
 }
 
-void avaspec::emulation::write_message (std::string const &message)
+void avaspec::channel::begin_data ()
 {
   startfunc;
+  m_decoded = 0;
+  m_bad = false;
 }
 
-std::string avaspec::emulation::read_message (unsigned timeout,
-					      unsigned replysize, char reply)
+void avaspec::channel::partial_data (char const *message, unsigned size)
 {
   startfunc;
-  std::string result;
-  if ( (reply & 0xff) == 0x81)
-    {
-      if (replysize != 327)
-        {
-	  shevek_error ("unable to return status: "
-			"incorrect reply length (bug)");
-	  return std::string ();
-	}
-      result = std::string ("\201" // reply
-			    "emulation device                "
-			    "                                " // 0x40B version
-			    "\000\000" //0x02B device id
-			    "\002" //0x01B number of channels in this device
-			    "\000\010" //0x02B number of pixels per channel
-			    "\000" //0x01B sensor (?)
-			    , 0x47);
-      std::string channel ("\001\000\000\000" // calibration
-			   "\000\000\000\000" // calibration
-			   "\000\000\000\000" // calibration
-			   "\000\000\000\000" // calibration
-			   "\000\000\000\000" // calibration
-			   "\000\000\000\000" // calibration (gain)
-			   "\000\000\000\000" // calibration (offset)
-			   "\000\000" //0x02 bytes start pixel
-			   "\361\007" //0x02 bytes stop pixel+1(incl. endpoint)
-			   , 0x20);
-      for (unsigned i = 0; i < 8; ++i)
-	result += channel;
-    }
-  else if (replysize == 0)
-    {
-      result.resize (0x800 * 2 + 6);
-      result[0] = reply;
-      result[2] = 0;
-      result[3] = 0;
-      result[4] = 0xf1;
-      result[5] = 0x07;
-    }
-  else
-    {
-      result.resize (replysize);
-      result[0] = reply;
-    }
-  return result;
+  if (size < 6)
+    return;
+  // leave messages which don't match to new_data, which complains about them
+  unsigned min = (message[2] & 0xff) + ( (message[3] & 0xff) << 8);
+  unsigned max = (message[4] & 0xff) + ( (message[5] & 0xff) << 8) + 1;
+  if (min != m_min || max != m_max)
+    return;
+  unsigned count = m_parent->m_extra_pixels + m_max - m_min;
+  unsigned avail = (size - 6) / 2;
+  if (avail > count)
+    avail = count;
+  if (avail <= m_decoded)
+    return;
+  if (!kernels::decode_pixels (message + 6 + 2 * m_decoded,
+			       &m_pixels[m_decoded], avail - m_decoded) )
+    m_bad = true;
+  m_decoded = avail;
 }
 
-void avaspec::channel::new_data (std::string const &message)
+void avaspec::channel::l_progress (void *self, char const *message,
+				   unsigned size)
 {
-  startfunc;
-  m_mindata = (message[2] & 0xff) + ( (message[3] & 0xff) << 8);
-  m_maxdata = (message[4] & 0xff) + ( (message[5] & 0xff) << 8) + 1;
-  if (m_mindata != m_min || m_maxdata != m_max)
-    {
-      shevek_error ("consistency check failed for data range: min = " << m_min
-		    << ", mindata = " << m_mindata << ", max = " << m_max
-		    << ", maxdata = " << m_maxdata);
-      return;
-    }
-  unsigned offset = 6 + m_parent->m_extra_pixels;
-  for (unsigned i = m_mindata; i < m_maxdata; ++i)
-    {
-      int value = (message[offset + 2 * (i - m_mindata)] & 0xff)
-	+ ( (message[offset + 2 * (i - m_mindata) + 1] & 0xff) << 8);
-      // Contrary to the documentation, this number should be divided by 4.
-      // A consistancy check is added, remove the division if it fails.
-      if ( (value & 3) != 0)
-        {
-	  shevek_error ("Raw data is not a multiple of 4.  Change the source.");
-	  return;
-	}
-      value >>= 2;
-      m_data[i] = value;
-    }
-  offset = 6;
-  for (unsigned i = 0; i < m_parent->m_extra_pixels; ++i)
-    {
-      int value = (message[offset + 2 * i] & 0xff)
-	+ ( (message[offset + 2 * i + 1] & 0xff) << 8);
-      // Contrary to the documentation, this number should be divided by 4.
-      // A consistancy check is added, remove the division if it fails.
-      if ( (value & 3) != 0)
-        {
-	  shevek_error ("Raw data is not a multiple of 4.  Change the source.");
-	  return;
-	}
-      value >>= 2;
-      m_extra[i] = value;
-    }
+  channel *c = static_cast <channel *> (self);
+  // the first byte of the measurement
+  if (!c->m_parent->m_stamps.first)
+    c->m_parent->m_stamps.first = monotonic::now ();
+  c->partial_data (message, size);
 }
 
 void avaspec::channel::setup (avaspec *parent, unsigned id,
 			      std::vector <float> const &ijkvector,
-			      shevek::relative_time ijktime,
+			      shevek::relative_time ijktime, unsigned ijkstart,
 			      std::vector <float> const &nonlinear)
 {
   startfunc;
   m_parent = parent;
   m_mindata = 1;
   m_maxdata = 1;
-  m_data.resize (m_parent->m_numpixels);
-  m_extra.resize (m_parent->m_extra_pixels);
+  m_pixels.resize (m_parent->m_extra_pixels + m_parent->m_numpixels);
+  m_decoded = 0;
+  m_bad = false;
   m_id = id;
   m_ijk = ijkvector;
   m_ijktime = ijktime;
+  m_ijkstart = ijkstart;
+  m_flat.resize (0);
+  if (!m_ijk.empty () )
+    {
+      unsigned n = m_parent->m_numpixels;
+      m_flat.reserve (n * sizeof (float) );
+      m_flat.resize (n * sizeof (float) );
+      float *gain = reinterpret_cast <float *> (m_flat.data () );
+      for (unsigned i = 0; i < n; ++i)
+	{
+	  float r = i >= m_ijkstart && i - m_ijkstart < m_ijk.size ()
+	    ? m_ijk[i - m_ijkstart] : 0;
+	  gain[i] = r != 0 ? 1 / r : 0;
+	}
+    }
   m_nonlinear = nonlinear;
+  m_min = m_max = 0;
+  m_linear.clear ();
+  if (!m_nonlinear.empty () )
+    {
+      std::vector <double> coef (m_nonlinear.begin (), m_nonlinear.end () );
+      m_linear.resize (kernels::LINEAR_SIZE + 1);
+      kernels::linear_table (&coef[0], coef.size (), &m_linear[0]);
+    }
+  l_update_wavelengths ();
   set_range (m_parent->m_eeprom.channel[id].start,
 	     m_parent->m_eeprom.channel[id].stop);
 }
@@ -1174,8 +1780,23 @@ void avaspec::channel::set_range (unsigned min, unsigned max)
   message[4] = (max - 1) & 0xff;
   message[5] = ( (max - 1) >> 8) & 0xff;
   m_parent->l_readwrite (message, 0x88, 1);
+  bool changed = min != m_min || max != m_max;
+  bool was_empty = m_max <= m_min;
+  unsigned before = message_size ();
   m_min = min;
   m_max = max;
+  // The readout latency is learned from the first channel, and depends
+  // on the size of its message.  It is learned again from the next frame
+  // on; until then, assume it scales with the size, so readout_latency
+  // is not the one of the old range.  Without an old range (from setup),
+  // the initial guess is kept.
+  if (changed && m_parent->l_next_channel (0) == m_id)
+    {
+      monotonic::ns seed = m_parent->m_latency.estimate ();
+      if (!was_empty)
+	seed = seed * monotonic::ns (message_size () ) / before;
+      m_parent->m_latency = latency_estimator (seed);
+    }
   m_parent->set_start (m_id, min);
   m_parent->set_stop (m_id, max);
 }
@@ -1200,7 +1821,7 @@ unsigned avaspec::channel::operator[] (unsigned idx) const
       shevek_error ("index out of range");
       return unsigned ();
     }
-  return m_data[idx];
+  return m_pixels[m_parent->m_extra_pixels + idx - m_mindata];
 }
 
 unsigned avaspec::channel::extra (unsigned idx) const
@@ -1211,7 +1832,19 @@ unsigned avaspec::channel::extra (unsigned idx) const
       shevek_error ("extra index out of range");
       return unsigned ();
     }
-  return m_extra[idx];
+  return m_pixels[idx];
+}
+
+unsigned short const *avaspec::channel::data () const
+{
+  startfunc;
+  return &m_pixels[m_parent->m_extra_pixels];
+}
+
+unsigned short const *avaspec::channel::extra_data () const
+{
+  startfunc;
+  return &m_pixels[0];
 }
 
 std::vector <float> const &avaspec::channel::nonlinear () const
@@ -1219,6 +1852,11 @@ std::vector <float> const &avaspec::channel::nonlinear () const
 	return m_nonlinear;
 }
 
+unsigned short const *avaspec::channel::linear_table () const
+{
+  return m_linear.empty () ? 0 : &m_linear[0];
+}
+
 std::vector <float> const &avaspec::channel::ijking () const
 {
 	return m_ijk;
@@ -1229,6 +1867,35 @@ shevek::relative_time avaspec::channel::ijktime () const
 	return m_ijktime;
 }
 
+unsigned avaspec::channel::ijkstart () const
+{
+  return m_ijkstart;
+}
+
+float const *avaspec::channel::flat_field () const
+{
+  return m_flat.size () ? reinterpret_cast <float const *> (m_flat.data () )
+    : 0;
+}
+
+std::vector <float> const &avaspec::channel::wavelengths () const
+{
+  return m_wavelengths;
+}
+
+void avaspec::channel::l_update_wavelengths ()
+{
+  startfunc;
+  double coef[5];
+  for (unsigned i = 0; i < 5; ++i)
+    coef[i] = m_parent->m_eeprom.channel[m_id].calibration[i];
+  // the size only changes on setup, so references to the vector which
+  // readers hold stay valid
+  m_wavelengths.resize (m_parent->m_numpixels);
+  if (!m_wavelengths.empty () )
+    kernels::polynomial (coef, 5, m_wavelengths.size (), &m_wavelengths[0]);
+}
+
 shevek::absolute_time avaspec::time () const
 {
   startfunc;
@@ -25,8 +25,14 @@
 #include <string>
 #include <vector>
 #include "time.hpp"
+#include "clock.hpp"
+#include "buffer.hpp"
+#include "dle.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 #include <usb.h>
 #include <pthread.h>
+#include <poll.h>
 
 class avaspec
 {
@@ -53,12 +59,64 @@ public:
   unsigned get_strobe () const;
   // do a measurement.  The measurement is started with start_read.  When the
   // integration time has (almost) passed, end_read should be called.  It will
-  // block until the data is fully received.
+  // block until the data is fully received.  It may also be called earlier;
+  // it waits for the data without using cpu time.
   void start_read ();
   void end_read ();
   void end_read_async();
   bool cancel_read_async();
-  bool run_read_async(void);
+  // like end_read, but it can be cancelled.  If rearm is true, the next
+  // measurement is started as soon as the data is received, so the
+  // caller can process it while the device is already integrating.
+  bool run_read_async(bool rearm = false);
+  // make a running run_read_async return false as soon as possible.  This
+  // may be called from another thread.
+  void cancel_read ();
+  // forget the running measurement without reading its data, so the
+  // next start_read starts a new one.  l_finish_read and poll_read do
+  // this themselves when they are cancelled or fail; an event loop which
+  // stops polling calls it.  Not while another thread reads.  The
+  // replies which the device still owes are dropped when they arrive.
+  void abandon_read ();
+  // how long after the end of the integration the data usually arrives,
+  // learned from previous measurements
+  shevek::relative_time readout_latency () const;
+  // end_read split up for event loops, which must not block.  After
+  // start_read, call poll_read whenever one of the poll_fds is ready or
+  // read_deadline has passed.  It returns true when the data of all
+  // channels is in (or if no measurement was running).
+  bool poll_read ();
+  // external_trigger for event loops: the command is sent, and poll_read
+  // takes the reply.  poll_read returns true once the reply is in, and
+  // start_read may be called.
+  void send_external_trigger (bool enable);
+  // monotonic time at which poll_read must be called even if no fd is
+  // ready, or NEVER
+  monotonic::ns read_deadline () const;
+  static monotonic::ns const NEVER;
+  // file descriptors which become ready when data may have arrived.  At
+  // most max are stored in fds; the number is returned.  Emulated and
+  // libusb-0.1 devices have none, read_deadline then polls.
+  unsigned poll_fds (struct pollfd *fds, unsigned max) const;
+  // whether poll_read returns without waiting for the device.  Only then
+  // may an event loop drive it; libusb-0.1 can't read without a timeout.
+  bool polls () const;
+  // where the time of the measurements goes, and what went wrong.  It
+  // may be read and reset from any thread while measuring.
+  acquisition_stats const &stats () const;
+  void reset_stats ();
+  // tell the statistics that the last measurement has been passed on
+  // (stored, displayed, ...), for the PUBLISH stage
+  void published ();
+  // tell the statistics that a spectrum of the last measurement had
+  // pixels saturated pixels at full scale
+  void saturated (unsigned pixels);
+  // whether the data of the last completed measurement is good.  A bad
+  // message from the device, or a channel after the first which is late,
+  // doesn't throw; the measurement is counted in stats ().bad_frames, and
+  // its data should be skipped.  Only problems which end the acquisition
+  // (no data at all, a lost device) throw.
+  bool frame_ok () const;
   // write current data to eeprom.  Not advised to do often
   // (although the windows driver does it on every change)
   void write_eeprom (std::string const &password);
@@ -72,6 +130,34 @@ public:
   avaspec (std::string const &config,
 	   unsigned product, unsigned vendor, unsigned skip); // usb
   avaspec (std::string const &config); // emulation
+  // where the device is, for code which doesn't care which it is
+  struct source
+  {
+    enum type_t { USB, SERIAL, EMULATION, REPLAY } type;
+    unsigned vendor, product, skip; // for USB
+    std::string device; // for SERIAL; for REPLAY the capture file
+    // for REPLAY: play with the recorded timing, or as fast as possible
+    bool realtime;
+    // if not empty, all traffic with the device is recorded to this
+    // capture file (see capture.hpp)
+    std::string record;
+    // for EMULATION: spectrum is a file as written by the test program
+    // (like glow.csv), measured with template_ms integration time; if it
+    // is empty, a few lines are made up.  After the integration, every
+    // channel takes readout_ms, and its data goes over the bus at rate
+    // bytes per second.  With external trigger, triggers come at
+    // trigger_hz, or immediately if it is 0.  noise scales the variance of
+    // the shot noise; 0 gives clean spectra.
+    std::string spectrum;
+    double template_ms, readout_ms, rate, trigger_hz, noise;
+    source (type_t t = EMULATION);
+    // set the fields from a description: "usb", "serial:<device>",
+    // "emulation[:<key>=<value>,...]", where the keys are the names of
+    // the emulation fields, "replay:<capture>" or "replay-fast:<capture>".
+    // Returns false if it is not valid.
+    bool parse (std::string const &descr);
+  };
+  avaspec (std::string const &config, source const &where);
   ~avaspec ();
   // read and change calibration values.  They are not written back at
   // the device until avaspec::write_eeprom is called.  It doesn't do anything
@@ -85,6 +171,8 @@ public:
   // get time of measurement (stored by end_read)
   shevek::absolute_time time () const;
   enum { MAX_DIGITAL = 10 };
+  // largest message the device sends
+  enum { MAX_MESSAGE = 6000 };
 protected:
       bool m_cancel_read;
 private:
@@ -106,15 +194,92 @@ private:
   // internal functions
   // write a command, and wait for the reply, of which the first
   // character and size must match the given ones.  Size is not
-  // checked if replysize == 0
+  // checked if replysize == 0.  The reply is read into target, its size
+  // is returned.  An empty message only reads.
+  unsigned l_readwrite (char const *message, unsigned size,
+			aligned_buffer &target, char reply,
+			unsigned replysize);
+  // the same, for commands which are not time critical
   std::string l_readwrite (std::string const &message, char reply,
-			   unsigned replysize, unsigned pausetime = 0);
+			   unsigned replysize);
+  // check a reply of l bytes in target, as described for l_readwrite
+  void l_check_reply (aligned_buffer &target, unsigned l, char reply,
+		      unsigned replysize);
+  // wait until the data message of a channel is in m_reply, or the
+  // monotonic clock reaches deadline.  It is decoded into the channel
+  // while it arrives, but new_data must still be called.  If cancellable,
+  // m_cancel_read stops the wait, and with external trigger there is no
+  // deadline.  Returns CANCELLED if it was cancelled, BAD_DATA if the
+  // message is not valid data for the channel, and TIMEOUT, counted in
+  // the stats, if it didn't arrive in time.  It doesn't throw for any of
+  // these; the caller decides what is fatal.
+  enum read_result { DATA, BAD_DATA, TIMEOUT, CANCELLED };
+  read_result l_read_data (unsigned channel, monotonic::ns deadline,
+			   bool cancellable);
+  // check a data message of l bytes in m_reply, like l_check_reply, but
+  // without throwing: a bad message gets a deferred warning, and false
+  // is returned
+  bool l_check_data (unsigned channel, unsigned l);
+  // no bad message was received for the running measurement, and for the
+  // last completed one
+  bool m_frame_ok, m_last_ok;
+  // send "\004" requests for the channels after the first, until
+  // hardware::queue_depth of them are unanswered.  m_requested is the next
+  // channel to request, m_outstanding the number of unanswered requests.
+  void l_request_ahead ();
+  unsigned m_requested, m_outstanding;
+  // replies which the device still owes for requests that were given up
+  // on: a late channel, an abandoned measurement or command.  Replies
+  // come in the order of the requests, so the next m_stale messages are
+  // dropped (and counted as retries) before anything else is read.
+  unsigned m_stale;
+  // give up on the m_outstanding requests and owed more replies, and
+  // request no more channels for this measurement
+  void l_forget_replies (unsigned owed);
+  // whether a message of size l is one of m_stale; if so it is dropped
+  bool l_stale (unsigned l);
+  // read the data of all channels, after start_read.  Returns false if
+  // it was cancelled.  On every way out, the measurement is no longer
+  // running.
+  bool l_finish_read (bool cancellable, bool rearm);
+  // the reading part of l_finish_read
+  bool l_read_channels (bool cancellable);
+  // first channel from idx on which has data, or m_channel.size ()
+  unsigned l_next_channel (unsigned idx) const;
+  // poll_read state: the channel which is being waited for, or
+  // m_channel.size () if none, whether the first one of the measurement
+  // is still to come (l_read_channels keeps this too), when it is late,
+  // and when poll_read last looked
+  unsigned m_poll_channel;
+  bool m_poll_first;
+  monotonic::ns m_poll_deadline, m_polled;
+  // reply which poll_read waits for before the data, after
+  // send_external_trigger, or 0; and until when
+  char m_command_reply;
+  monotonic::ns m_command_deadline;
+  // interval for polling devices without file descriptors
+  enum { POLL_INTERVAL_US = 1000 };
+  // longest wait for a backend which cannot be interrupted, before
+  // m_cancel_read is checked again
+  enum { CANCEL_SLICE_MS = 100 };
   // the actual constructor code
   void init (std::string const &config);
   // data members
   shevek::relative_time m_integration_time, m_saved_integration_time,
     m_measured_time;
   shevek::absolute_time m_time; // last measuremnt
+  // monotonic time when the running measurement should finish integrating
+  monotonic::ns m_end;
+  latency_estimator m_latency;
+  // when the stages of a measurement ended, see acquisition_stats; for
+  // the running measurement, and the last completed one
+  struct stamps
+  {
+    monotonic::ns start, issued, end, first, received, decoded;
+  } m_stamps, m_done;
+  acquisition_stats m_stats;
+  // record the stages of a measurement of which all data is in
+  void l_frame_done ();
   unsigned m_average;
   unsigned m_numpixels, m_extra_pixels;
   bool m_digital[MAX_DIGITAL];
@@ -124,13 +289,23 @@ private:
   bool m_thread_running;
   unsigned m_strobe;
   std::vector <channel> m_channel;
+  // reply buffer, reused for every message
+  aligned_buffer m_reply;
   // hardware is a virtual class.  usb, serial and emulation inherit from it.
   // m_hardware does the hardware-specific parts.
   class hardware;
   class usb;
+  // native libusb-1.0 version of usb, with queued transfers.  Only
+  // available when built with AVASPEC_USB_ASYNC, see usb_async.hpp.
+  class usb_async;
   class serial;
   class emulation;
+  // recording and replaying traffic, see capture.hpp
+  class recorder;
+  class replay;
   hardware *m_hardware;
+  // the shared part of the constructors
+  void l_create (std::string const &config, hardware *device);
 };
 
 // this class is where all channel specific features are accessed.
@@ -144,9 +319,28 @@ public:
   // read the measured data (taken when avaspec::read was called)
   unsigned operator[] (unsigned idx) const;
   unsigned extra (unsigned idx) const;
+  // direct access to the decoded pixels: data () points at pixel
+  // get_range_min (), extra_data () at the first extra pixel.
+  unsigned short const *data () const;
+  unsigned short const *extra_data () const;
   std::vector <float> const &nonlinear () const;
+  // the nonlinearity correction of nonlinear () for every count, for
+  // kernels::subtract_dark.  It is built when the device is opened; 0 if
+  // there are no coefficients.
+  unsigned short const *linear_table () const;
+  // the detector response from the ijking file, for pixels from
+  // ijkstart () on, measured with integration time ijktime ()
   std::vector <float> const &ijking () const;
   shevek::relative_time ijktime () const;
+  unsigned ijkstart () const;
+  // 1 / response for every pixel in [0, num_pixels ()), 0 where there is
+  // none, for kernels::flat_field.  It is built when the device is
+  // opened, cache line aligned; 0 if there is no ijking file.
+  float const *flat_field () const;
+  // wavelength of every pixel in [0, num_pixels ()), from the
+  // calibration polynomial.  It is computed when the device is opened and
+  // when avaspec::set_calibration changes the polynomial, not on read.
+  std::vector <float> const &wavelengths () const;
 private:
   // settings
   unsigned m_min, m_max, m_id;
@@ -154,23 +348,46 @@ private:
   unsigned m_mindata, m_maxdata;
   // parent, to access m_hardware
   avaspec *m_parent;
-  // measured spectrum
-  std::vector <unsigned> m_data;
-  std::vector <unsigned> m_extra;
+  // measured spectrum: the extra pixels, followed by the pixels in
+  // [m_mindata, m_maxdata), in the same order as the device sends them
+  std::vector <unsigned short> m_pixels;
   // ijking data
   std::vector <float> m_ijk;
   shevek::relative_time m_ijktime;
+  unsigned m_ijkstart;
+  aligned_buffer m_flat;
   std::vector <float> m_nonlinear;
-  // function called by parent to load new data to m_data
-  void new_data (std::string const &message);
-  friend void avaspec::end_read ();
-  friend bool avaspec::run_read_async();
+  std::vector <unsigned short> m_linear;
+  // cached wavelength axis
+  std::vector <float> m_wavelengths;
+  void l_update_wavelengths ();
+  // number of pixel words in m_pixels which are decoded from the current
+  // message, and whether any of them failed the consistency check
+  unsigned m_decoded;
+  bool m_bad;
+  // function called by parent to load new data to m_pixels.  Returns
+  // false, with a deferred warning, if the message is not valid.
+  bool new_data (char const *message, unsigned size);
+  // size of the data message for the current range
+  unsigned message_size () const;
+  // decode the part of a data message which has arrived so far.
+  // new_data must still be called with the complete message.
+  void begin_data ();
+  void partial_data (char const *message, unsigned size);
+  static void l_progress (void *self, char const *message, unsigned size);
+  friend avaspec::read_result avaspec::l_read_data (unsigned, monotonic::ns,
+						   bool);
+  friend bool avaspec::l_read_channels (bool);
+  friend bool avaspec::l_check_data (unsigned, unsigned);
+  friend void avaspec::start_read ();
+  friend bool avaspec::poll_read ();
   // because setup is not done in constructor, objects can be used in a vector
   void setup (avaspec *parent, unsigned id,
 	      std::vector <float> const &ijkvector,
-	      shevek::relative_time ijktime,
+	      shevek::relative_time ijktime, unsigned ijkstart,
 	      std::vector <float> const &nonlinear);
   friend void avaspec::init (std::string const &config);
+  friend void avaspec::set_calibration (unsigned, unsigned, float);
 };
 
 class avaspec::hardware
@@ -179,11 +396,72 @@ class avaspec::hardware
   hardware (hardware const &);
   void operator= (hardware const &);
 public:
-  hardware () {}
+  hardware () : m_progress (0), m_progress_arg (0), m_retries (0) {}
   virtual ~hardware () {}
-  virtual void write_message (std::string const &message) = 0;
-  virtual std::string read_message (unsigned timeout, unsigned replysize,
-				    char reply) = 0;
+  // send a message of size bytes to the device
+  virtual void write_message (char const *message, unsigned size) = 0;
+  // read one message into buffer, which has room for capacity bytes.
+  // replysize is the expected size of the message, or 0 if unknown.
+  // Returns the size of the message, or 0 if nothing arrived in time.
+  // It returns as soon as the message is complete, not when the timeout
+  // expires.
+  virtual unsigned read_message (char *buffer, unsigned capacity,
+				 unsigned timeout, unsigned replysize,
+				 char reply) = 0;
+  // make a read_message which is waiting in another thread return 0 now.
+  // Only reads while allow_interrupt (true) is in effect see it; the
+  // replies to commands are read to the end.  The interrupt stays pending
+  // until clear_interrupt, so it is not lost if it comes between two
+  // reads.  Backends which can do this return true from interruptible;
+  // for the others the caller must use short timeouts if it wants to
+  // cancel.
+  virtual void interrupt () {}
+  virtual void clear_interrupt () {}
+  virtual void allow_interrupt (bool) {}
+  virtual bool interruptible () const { return false; }
+  // read_message which doesn't wait: it returns 0 if no complete message
+  // is there yet.  The default waits for at most a millisecond, which an
+  // event loop must not; backends which really don't wait return true
+  // from polls.
+  virtual unsigned try_read_message (char *buffer, unsigned capacity,
+				     unsigned replysize, char reply)
+  { return read_message (buffer, capacity, 1, replysize, reply); }
+  virtual bool polls () const { return false; }
+  // see avaspec::poll_fds
+  virtual unsigned poll_fds (struct pollfd *, unsigned) const { return 0; }
+  // the replies to the last count requests will not be read.  Returns
+  // how many of them the caller must still drop when they arrive; a
+  // backend which can tell them from new replies drops them itself.
+  virtual unsigned forget_replies (unsigned count) { return count; }
+  // how many requests may be sent before the reply to the first one is
+  // read.  A synchronous backend can't receive while it writes, so it
+  // only allows one.
+  virtual unsigned queue_depth () const { return 1; }
+  // backends which receive a message in pieces call fn after every
+  // piece, with the part of the message received so far.  This lets the
+  // caller start decoding before the message is complete.  The pointer is
+  // only valid during the call; the complete message is still returned
+  // by read_message.
+  typedef void (*progress_fn) (void *arg, char const *message,
+			       unsigned size);
+  void set_progress (progress_fn fn, void *arg)
+  { m_progress = fn; m_progress_arg = arg; }
+  // backends which receive a message again, or throw away a reply, count
+  // it here
+  virtual void count_retries (std::atomic <uint64_t> *counter)
+  { m_retries = counter; }
+protected:
+  void progress (char const *message, unsigned size)
+  { if (m_progress) m_progress (m_progress_arg, message, size); }
+  void retried ()
+  {
+    trace_event ("retry", 0, 0);
+    if (m_retries) m_retries->fetch_add (1, std::memory_order_relaxed);
+  }
+private:
+  progress_fn m_progress;
+  void *m_progress_arg;
+  std::atomic <uint64_t> *m_retries;
 };
 
 class avaspec::usb : public avaspec::hardware
@@ -195,40 +473,55 @@ class avaspec::usb : public avaspec::hardware
 public:
   usb (unsigned vendor, unsigned product, unsigned skip);
   virtual ~usb ();
-  virtual void write_message (std::string const &message);
-  virtual std::string read_message (unsigned timeout, unsigned replysize,
-				    char reply);
+  virtual void write_message (char const *message, unsigned size);
+  virtual unsigned read_message (char *buffer, unsigned capacity,
+				 unsigned timeout, unsigned replysize,
+				 char reply);
 };
 
 class avaspec::serial : public avaspec::hardware
 {
   int m_fd;
   // id of next message
-  static unsigned m_id;
-  // buffer where the message is read into
-  enum { BUFFERSIZE = 20000 };
-  char m_buffer[BUFFERSIZE];
-  // actual buffer size
-  unsigned m_buffer_size;
-  // function reading the device and replacing escape codes.
-  // It returns the message without header and footer
-  std::string l_read_message (unsigned timeout);
+  unsigned m_id;
+  // number of messages which were written and are not answered yet
+  unsigned m_pending;
+  // received bytes, and the frames in them
+  dle_deframer m_deframer;
+  // outgoing frame, reused for every message
+  aligned_buffer m_frame;
+  // pipe which is written to by interrupt, to wake up poll, and whether
+  // the current read looks at it
+  int m_wake[2];
+  bool m_allow_interrupt;
+  // function reading the device and replacing escape codes.  The first
+  // HEADER bytes (id, node, length) go to header, the rest to buffer.
+  // It returns the size of the data in buffer, without header and footer,
+  // or TIMEOUT if the deadline passed or it was interrupted.
+  enum { HEADER = 4 };
+  static unsigned const TIMEOUT = ~0u;
+  unsigned l_read_message (char *header, char *buffer, unsigned capacity,
+			   monotonic::ns deadline);
 public:
   serial (std::string const &device_file);
   virtual ~serial ();
-  virtual void write_message (std::string const &message);
-  virtual std::string read_message (unsigned timeout, unsigned replysize,
-				    char reply);
-};
-
-class avaspec::emulation : public avaspec::hardware
-{
-public:
-  emulation ();
-  virtual ~emulation ();
-  virtual void write_message (std::string const &message);
-  virtual std::string read_message (unsigned timeout, unsigned replysize,
-				    char reply);
+  virtual void write_message (char const *message, unsigned size);
+  virtual unsigned read_message (char *buffer, unsigned capacity,
+				 unsigned timeout, unsigned replysize,
+				 char reply);
+  virtual void interrupt ();
+  virtual void clear_interrupt ();
+  virtual void allow_interrupt (bool allow) { m_allow_interrupt = allow; }
+  virtual bool interruptible () const { return true; }
+  virtual unsigned try_read_message (char *buffer, unsigned capacity,
+				     unsigned replysize, char reply);
+  virtual bool polls () const { return true; }
+  virtual unsigned poll_fds (struct pollfd *fds, unsigned max) const;
+  // replies are matched to requests by id, so the forgotten ones are
+  // skipped here
+  virtual unsigned forget_replies (unsigned count);
+  // and the line has hardware flow control
+  virtual unsigned queue_depth () const { return 8; }
 };
 
 #endif // defined AVASPEC_HH
@@ -0,0 +1,296 @@
+/*
+ *  avaspec_bench.cpp
+ *  avaspec
+ *
+ *  Microbenchmarks of the hot paths of the driver.  Every benchmark prints
+ *  one JSON object per line, so runs of two builds can be compared with
+ *  any JSON tool.  Heap allocations are counted by replacing operator new.
+ *
+ *  usage: avaspec_bench [filter [seconds [spectrum.csv]]]
+ *  Only benchmarks whose name contains filter are run; each runs for about
+ *  seconds (default 0.2) per repetition.
+ *
+ */
+
+#include "multispec.hpp"
+#include "libavaspec.h"
+#include "kernels.hpp"
+#include "dle.hpp"
+#include <atomic>
+#include <new>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // usleep
+
+#ifndef AVASPEC_DATA_DIR
+#define AVASPEC_DATA_DIR "."
+#endif
+
+// allocation counting; the library's allocations come here as well
+static std::atomic<unsigned long long> g_allocs(0), g_alloc_bytes(0);
+
+void *operator new(std::size_t size)
+{
+    ++g_allocs;
+    g_alloc_bytes += size;
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    free(p);
+}
+
+static char const *g_filter = "";
+static double g_seconds = 0.2;
+
+// Run fn until it has taken g_seconds, five times, and report the best
+// and the median time per call.  bytes is the amount of data one call
+// handles, for a throughput figure (0: none).
+template <typename F>
+static void bench(char const *name, double bytes, F fn)
+{
+    if (!strstr(name, g_filter)) return;
+    // find a number of iterations which takes long enough to measure,
+    // then scale it to g_seconds
+    unsigned long long n = 1;
+    monotonic::ns took;
+    while (true) {
+        monotonic::ns t = monotonic::now();
+        for (unsigned long long i = 0; i < n; ++i) fn();
+        took = monotonic::now() - t;
+        if (took > g_seconds * 1e8 || n >= 1ull << 40) break;
+        n *= 2;
+    }
+    n = std::max(1ull, (unsigned long long)(n * g_seconds * 1e9 / took));
+    enum { REPEAT = 5 };
+    double per_op[REPEAT];
+    unsigned long long allocs = g_allocs, alloc_bytes = g_alloc_bytes;
+    for (int r = 0; r < REPEAT; ++r) {
+        monotonic::ns t = monotonic::now();
+        for (unsigned long long i = 0; i < n; ++i) fn();
+        per_op[r] = double(monotonic::now() - t) / n;
+    }
+    allocs = g_allocs - allocs;
+    alloc_bytes = g_alloc_bytes - alloc_bytes;
+    std::sort(per_op, per_op + REPEAT);
+    printf("{\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f, "
+           "\"ns_per_op_median\": %.1f, \"allocs_per_op\": %.3f, "
+           "\"alloc_bytes_per_op\": %.1f",
+           name, n, per_op[0], per_op[REPEAT / 2],
+           double(allocs) / (REPEAT * n),
+           double(alloc_bytes) / (REPEAT * n));
+    if (bytes > 0)
+        printf(", \"mb_per_s\": %.1f", bytes / per_op[0] * 1e3);
+    printf("}\n");
+    fflush(stdout);
+}
+
+// keep the compiler from dropping a result
+static volatile unsigned g_sink;
+
+// the counts of a spectrum as written by the test program (glow.csv), or
+// a ramp if the file is not there
+static std::vector<unsigned short> load_spectrum(char const *path, unsigned pixels)
+{
+    std::vector<unsigned short> counts;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line) && counts.size() < pixels) {
+        float wavelength, value;
+        if (sscanf(line.c_str(), "%f , %f", &wavelength, &value) == 2)
+            counts.push_back(value < 0 ? 0 : value > 16383 ? 16383 : value);
+    }
+    if (counts.empty())
+        fprintf(stderr, "unable to read %s, using a ramp\n", path);
+    for (unsigned i = counts.size(); i < pixels; ++i)
+        counts.push_back(i * 8 & 0x3fff);
+    return counts;
+}
+
+// a data message as the device sends it: header, then every count times
+// four, little endian
+static std::vector<char> make_message(std::vector<unsigned short> const &counts)
+{
+    std::vector<char> message(6 + 2 * counts.size());
+    message[0] = char(0x83);
+    message[4] = char((counts.size() - 15) & 0xff);
+    message[5] = char((counts.size() - 15) >> 8);
+    for (unsigned i = 0; i < counts.size(); ++i) {
+        unsigned raw = counts[i] << 2;
+        message[6 + 2 * i] = raw & 0xff;
+        message[7 + 2 * i] = raw >> 8;
+    }
+    return message;
+}
+
+static void bench_decode(std::vector<char> const &message)
+{
+    unsigned count = (message.size() - 6) / 2;
+    std::vector<unsigned short> pixels(count);
+    bench("decode_pixels", message.size(), [&] {
+        g_sink = kernels::decode_pixels(&message[6], &pixels[0], count);
+    });
+    // the per-frame correction with a typical nonlinearity table; the
+    // first 14 pixels stand in for the dark ones
+    double const nl[8] = { 0.98, 2.1e-6, -1.5e-10, 3e-15, 0, 0, 0, 0 };
+    std::vector<unsigned short> table(kernels::LINEAR_SIZE + 1);
+    kernels::linear_table(nl, 8, &table[0]);
+    std::vector<short> y(count);
+    bench("subtract_dark_nonlinear", 2 * count, [&] {
+        g_sink = kernels::subtract_dark(&pixels[0], count, &pixels[0], 14,
+                                        &table[0], multispec::kSaturated,
+                                        &y[0]);
+    });
+    // and the flat field of it into floats
+    aligned_buffer gain(count * sizeof(float));
+    float *g = reinterpret_cast<float *>(gain.data());
+    for (unsigned i = 0; i < count; ++i) g[i] = 1 / (0.5f + i * 1e-3f);
+    std::vector<float> flat(count);
+    bench("flat_field", 2 * count, [&] {
+        kernels::flat_field(&y[0], g, count, 0.5f, &flat[0]);
+    });
+    // adding one frame to a co-added group
+    std::vector<int32_t> sum(count);
+    bench("accumulate", 2 * count, [&] {
+        kernels::accumulate(&y[0], count, &sum[0]);
+    });
+}
+
+static void bench_framing(std::vector<char> const &message)
+{
+    char header[4] = { 1, 0, char(message.size() & 0xff),
+                       char(message.size() >> 8) };
+    std::vector<char> frame(dle_max_frame(4 + message.size()));
+    unsigned size = 0;
+    bench("dle_encode", message.size(), [&] {
+        size = dle_encode(header, 4, &message[0], message.size(), &frame[0]);
+        g_sink = size;
+    });
+    dle_deframer deframer(avaspec::MAX_MESSAGE + 4);
+    // feed it in pieces of what a serial read typically returns
+    enum { READ = 4095 };
+    bench("dle_deframe", message.size(), [&] {
+        for (unsigned done = 0; done < size; ) {
+            unsigned room;
+            char *space = deframer.space(room);
+            room = std::min(room, std::min<unsigned>(READ, size - done));
+            memcpy(space, &frame[done], room);
+            deframer.commit(room);
+            done += room;
+            while (deframer.next() != dle_deframer::MORE)
+                g_sink = deframer.frame_size();
+        }
+    });
+}
+
+static void bench_time()
+{
+    shevek::absolute_time t(1000, 0), t0(1000, 0);
+    shevek::relative_time step(0, 1234567);
+    bench("absolute_time_add", 0, [&] {
+        t += step;
+        g_sink = t > t0;
+    });
+    bench("absolute_time_diff", 0, [&] {
+        shevek::relative_time d = t - t0;
+        g_sink = d.nanoseconds();
+    });
+}
+
+// an emulated device which is as fast as possible
+static char const *const FAST = "emulation:readout_ms=0,rate=0,noise=0";
+
+static void bench_read()
+{
+    avaspec::source where;
+    where.parse(FAST);
+    avaspec device("", where);
+    device.set_integration_time(shevek::relative_time(0, 0));
+    bench("read_frame", 0, [&] {
+        device.start_read();
+        device.end_read();
+    });
+    // the same with the trace on, which must cost next to nothing
+    trace::set_level(trace::EVENTS);
+    bench("read_frame_traced", 0, [&] {
+        device.start_read();
+        device.end_read();
+    });
+    trace::set_level(trace::OFF);
+}
+
+static void bench_multispec()
+{
+    init_options options;
+    options.where.parse(FAST);
+    enum { SPECTRA = 16 };
+    multispec spec(0, 0.001, 1, 0, SPECTRA, options);
+    for (int i = 0; i < 1000 && spec.m_spectra.available() < SPECTRA; ++i)
+        usleep(1000);
+    spec.stop_dacq();
+    spec.m_dynamic_dark = true;
+    std::vector<short> y(spec.num_pixels());
+    bench("get_spectrum", 2 * y.size(), [&] {
+        spec.get_spectrum(0, &y[0]);
+    });
+    // the emulation has no calibration; use one like a real device's
+    float const cal[5] = { 335.85, 0.138515, -6.14672e-06, -7.41674e-10, 0 };
+    for (unsigned i = 0; i < 5; ++i) spec.set_calibration(0, i, cal[i]);
+    // readers get the cached axis; what costs is computing it again
+    bench("wavelength_axis", 4 * y.size(), [&] {
+        spec.set_calibration(0, 0, cal[0]);
+        g_sink = spec.get_wavelengths(0).size();
+    });
+}
+
+static void bench_read_spectra()
+{
+    enum { SPECTRA = 64 };
+    int trigs[5] = { 0, 0, 0, 0, 0 };
+    Source(0, FAST);
+    Init(0, 0.001, (char *)"", trigs, 1, 0, SPECTRA);
+    for (int i = 0; i < 2000 && NumSpectra(0) < SPECTRA; ++i)
+        usleep(1000);
+    Stop(0);
+    std::vector<short> data(SPECTRA * NumWavelengths(0));
+    bench("read_spectra", 2 * data.size(), [&] {
+        ReadSpectra(0, 0, &data[0]);
+    });
+    Destroy(0);
+}
+
+int main(int argc, char *const argv[])
+{
+    std::string csv = AVASPEC_DATA_DIR "/glow.csv";
+    if (argc >= 2) g_filter = argv[1];
+    if (argc >= 3) g_seconds = atof(argv[2]);
+    if (argc >= 4) csv = argv[3];
+
+    printf("{\"isa\": \"%s\", \"seconds\": %g}\n", kernels::isa(), g_seconds);
+    // 14 dark pixels and 2034 data pixels, like an AvaSpec-2048
+    std::vector<unsigned short> counts(14, 600);
+    std::vector<unsigned short> spectrum = load_spectrum(csv.c_str(), 2034);
+    counts.insert(counts.end(), spectrum.begin(), spectrum.end());
+    std::vector<char> message = make_message(counts);
+
+    bench_decode(message);
+    bench_framing(message);
+    bench_time();
+    bench_read();
+    bench_multispec();
+    bench_read_spectra();
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ *  avaspec_scale.cpp
+ *  avaspec
+ *
+ *  Runs 1, 2, 4, ... emulated devices at once, with a thread per device
+ *  and with the shared event loop, and reports how much cpu time each
+ *  device costs.  With the event loop it should stay flat as the number
+ *  of devices grows.
+ *
+ */
+
+#include "libavaspec.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>       // usleep
+#include <sys/time.h>
+#include <sys/resource.h> // getrusage
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+int main(int argc, char *const argv[])
+{
+    int max_devices = 16;
+    float seconds = 2;
+    float int_time = .002;
+    int trigs[5] = {0,0,0,0,0};
+
+    if (argc >= 2)
+        max_devices = atoi(argv[1]);
+    if (argc >= 3)
+        seconds = atof(argv[2]);
+    if (argc >= 4)
+        int_time = atof(argv[3]);
+
+    // room for every frame of the run, so none is dropped
+    unsigned max_spectra = unsigned(seconds / int_time * 1.5) + 10;
+
+    printf("# %g s per run, integration time %g ms\n", seconds, int_time * 1e3);
+    printf("# mode     devices  frames/s  cpu%%/device  us cpu/frame\n");
+    for (int event_loop = 0; event_loop < 2; ++event_loop) {
+        for (int n = 1; n <= max_devices; n *= 2) {
+            for (int i = 0; i < n; ++i) {
+                Source(i, "emulation");
+                EventLoop(i, event_loop);
+                Init(i, int_time, (char *)"", trigs, 1, 0, max_spectra);
+            }
+            // let the dark spectra and the first frames pass
+            usleep(100000);
+            int frames = 0;
+            for (int i = 0; i < n; ++i) frames -= NumSpectra(i);
+            double cpu = cpu_seconds();
+            usleep(useconds_t(seconds * 1e6));
+            cpu = cpu_seconds() - cpu;
+            for (int i = 0; i < n; ++i) frames += NumSpectra(i);
+            for (int i = 0; i < n; ++i) {
+                Stop(i);
+                Destroy(i);
+            }
+            printf("%-10s %7d  %8.0f  %11.2f  %12.1f\n",
+                   event_loop ? "eventloop" : "threads", n,
+                   frames / seconds, 100 * cpu / seconds / n,
+                   frames ? 1e6 * cpu / frames : 0.);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ *  avaspec_trace.cpp
+ *  avaspec
+ *
+ *  Prints a trace dump (see trace.hpp, DumpTrace) as a timeline: the
+ *  records of all threads merged by time, one per line, with the time
+ *  since the first record and since the previous record of the same
+ *  thread, both in microseconds.
+ *
+ *  usage: avaspec_trace dump-file
+ *
+ */
+
+#include "trace.hpp"
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+struct entry {
+    trace::file_record record;
+    unsigned thread;
+    bool operator<(entry const &other) const
+    { return record.time < other.record.time; }
+};
+
+static bool read(FILE *f, void *target, size_t size)
+{
+    return size == 0 || fread(target, size, 1, f) == 1;
+}
+
+int main(int argc, char *const argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s dump-file\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    trace::file_header header;
+    if (!read(f, &header, sizeof(header))
+        || memcmp(header.magic, "AVATRACE", 8) != 0
+        || header.version != trace::file_header::VERSION) {
+        fprintf(stderr, "%s is not a trace dump\n", argv[1]);
+        return 1;
+    }
+    std::vector<entry> entries;
+    bool complete = true;
+    for (unsigned r = 0; complete && r < header.rings; ++r) {
+        trace::file_ring ring;
+        complete = read(f, &ring, sizeof(ring));
+        for (unsigned i = 0; complete && i < ring.count; ++i) {
+            entry e;
+            complete = read(f, &e.record, sizeof(e.record));
+            e.thread = ring.thread;
+            if (complete) entries.push_back(e);
+        }
+    }
+    std::map<uint64_t, std::string> strings;
+    for (unsigned s = 0; complete && s < header.strings; ++s) {
+        trace::file_string fs;
+        complete = read(f, &fs, sizeof(fs));
+        if (!complete) break;
+        std::string text(fs.size, '\0');
+        complete = read(f, &text[0], fs.size);
+        if (complete) strings[fs.what] = text;
+    }
+    fclose(f);
+    if (!complete)
+        fprintf(stderr, "warning: %s is cut off\n", argv[1]);
+
+    // a ring is in time order, but the rings are not
+    std::stable_sort(entries.begin(), entries.end());
+    std::map<unsigned, long long> last;
+    long long start = entries.empty() ? 0 : entries[0].record.time;
+    printf("%12s %10s %6s  %s\n", "time_us", "delta_us", "thread", "what a b");
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entry const &e = entries[i];
+        std::map<unsigned, long long>::iterator l = last.find(e.thread);
+        double delta = l == last.end() ? 0 : (e.record.time - l->second) * 1e-3;
+        last[e.thread] = e.record.time;
+        std::map<uint64_t, std::string>::const_iterator s
+            = strings.find(e.record.what);
+        printf("%12.3f %10.3f %6u  %s %lld %lld\n",
+               (e.record.time - start) * 1e-3, delta, e.thread,
+               s == strings.end() ? "?" : s->second.c_str(),
+               (long long)e.record.a, (long long)e.record.b);
+    }
+    return 0;
+}
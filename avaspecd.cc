@@ -78,8 +78,9 @@ void serverdata::start_read ()
 	{
 		t = done_read + inttime;
 	}
-	// Start reading out 10 ms before measurement finishes.
-	t -= shevek::relative_time (0, 0, 0, 0, 10000000);
+	// end_read waits for the data itself.  Call it when the data
+	// usually arrives, so it doesn't block the main loop for long.
+	t += device->readout_latency ();
 	device->start_read ();
 	read_handle
 		= t.schedule (sigc::mem_fun (*this, &serverdata::end_read) );
@@ -415,18 +416,38 @@ int main (int argc, char **argv)
 {
 	std::string port ("/tmp/drivers/avaspec");
 	std::string config;
+	std::string emulate;
+	std::string record;
 	shevek::args::option opts[] = {
 		shevek::args::option (0, "config", "configuration file", true,
 				config),
 		shevek::args::option (0, "port", "port to listen on", true,
-				port)
+				port),
+		shevek::args::option (0, "emulate", "use an emulated device "
+				"instead of usb, as in \"emulation:"
+				"spectrum=glow.csv\", or replay a capture, as in "
+				"\"replay:shot.cap\"", true, emulate),
+		shevek::args::option (0, "record", "record all traffic with "
+				"the device to this capture file", true, record)
 	};
 	shevek::args args (argc, argv, opts, 0, 0, "Server for avaspec",
 			"2005");
 	Glib::RefPtr <shevek::server <client, serverdata> > s;
 	s = shevek::server <client, serverdata>::create ();
 	s->data ().parent = s;
-	s->data ().device = new avaspec (config, 0x471, 0x666, 0);
+	avaspec::source where (avaspec::source::USB);
+	where.vendor = 0x471;
+	where.product = 0x666;
+	if (!emulate.empty ()
+	    && (!where.parse (emulate)
+		|| (where.type != avaspec::source::EMULATION
+		    && where.type != avaspec::source::REPLAY)))
+	{
+		shevek_error ("invalid emulation: " << emulate);
+		return 1;
+	}
+	where.record = record;
+	s->data ().device = new avaspec (config, where);
 	s->open (port, 0);
 	shevek::loop ();
 	return 0;
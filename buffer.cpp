@@ -0,0 +1,71 @@
+/*
+ *  buffer.cpp
+ *  avaspec
+ *
+ *  Reusable, cache line aligned storage for device messages.
+ *
+ */
+
+#include "buffer.hpp"
+#include "error.hpp"
+#include <stdlib.h> // posix_memalign
+#include <string.h> // memcpy
+
+aligned_buffer::aligned_buffer (unsigned capacity)
+  : m_data (0), m_capacity (0), m_size (0)
+{
+  reserve (capacity);
+}
+
+aligned_buffer::aligned_buffer (aligned_buffer const &that)
+  : m_data (0), m_capacity (0), m_size (0)
+{
+  *this = that;
+}
+
+aligned_buffer &aligned_buffer::operator= (aligned_buffer const &that)
+{
+  if (this == &that)
+    return *this;
+  reserve (that.m_capacity);
+  if (that.m_size)
+    ::memcpy (m_data, that.m_data, that.m_size);
+  m_size = that.m_size;
+  return *this;
+}
+
+aligned_buffer::~aligned_buffer ()
+{
+  ::free (m_data);
+}
+
+void aligned_buffer::reserve (unsigned capacity)
+{
+  if (capacity <= m_capacity)
+    return;
+  // round up to whole cache lines, so vector code may read past the end
+  // of the data without leaving the allocation
+  capacity = (capacity + ALIGNMENT - 1) & ~unsigned (ALIGNMENT - 1);
+  void *p;
+  if (::posix_memalign (&p, ALIGNMENT, capacity) )
+    {
+      shevek_error ("unable to allocate buffer of " << capacity << " bytes");
+      return;
+    }
+  if (m_size)
+    ::memcpy (p, m_data, m_size);
+  ::free (m_data);
+  m_data = static_cast <char *> (p);
+  m_capacity = capacity;
+}
+
+void aligned_buffer::resize (unsigned size)
+{
+  if (size > m_capacity)
+    {
+      shevek_error ("buffer size out of range (" << size << " > "
+		    << m_capacity << ")");
+      return;
+    }
+  m_size = size;
+}
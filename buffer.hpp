@@ -0,0 +1,37 @@
+/*
+ *  buffer.hpp
+ *  avaspec
+ *
+ *  Reusable, cache line aligned storage for device messages.  Buffers are
+ *  allocated once and then passed to the transport as pointer plus length,
+ *  so reading a message does not allocate.
+ *
+ */
+
+#ifndef AVASPEC_BUFFER_HH
+#define AVASPEC_BUFFER_HH
+
+class aligned_buffer
+{
+public:
+  enum { ALIGNMENT = 64 };
+  explicit aligned_buffer (unsigned capacity = 0);
+  aligned_buffer (aligned_buffer const &that);
+  aligned_buffer &operator= (aligned_buffer const &that);
+  ~aligned_buffer ();
+  // make room for at least capacity bytes.  Existing data is kept.
+  void reserve (unsigned capacity);
+  unsigned capacity () const { return m_capacity; }
+  // number of valid bytes, set by whoever filled the buffer
+  unsigned size () const { return m_size; }
+  void resize (unsigned size);
+  char *data () { return m_data; }
+  char const *data () const { return m_data; }
+  char &operator[] (unsigned idx) { return m_data[idx]; }
+  char operator[] (unsigned idx) const { return m_data[idx]; }
+private:
+  char *m_data;
+  unsigned m_capacity, m_size;
+};
+
+#endif // defined AVASPEC_BUFFER_HH
@@ -0,0 +1,294 @@
+/*
+ *  capture.cpp
+ *  avaspec
+ *
+ *  Recording and replaying the traffic with a device.
+ *
+ */
+
+#include "capture.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include "error.hpp"
+#include <string.h> // memcpy, memcmp
+
+namespace
+{
+  char const MAGIC[8] = { 'A', 'V', 'A', 'C', 'A', 'P', 'T', 0 };
+}
+
+avaspec::recorder::recorder (hardware *device, std::string const &file)
+  : m_device (device), m_file (0), m_start (monotonic::now () )
+{
+  startfunc;
+  m_file = ::fopen (file.c_str (), "wb");
+  if (!m_file)
+    {
+      delete m_device;
+      shevek_error_errno ("unable to create capture file " << file);
+      return;
+    }
+  // messages are small; let stdio collect them
+  ::setvbuf (m_file, 0, _IOFBF, 1 << 16);
+  capture_header header;
+  ::memcpy (header.magic, MAGIC, sizeof (header.magic) );
+  header.version = capture_header::VERSION;
+  header.queue_depth = m_device->queue_depth ();
+  ::fwrite (&header, sizeof (header), 1, m_file);
+  m_device->set_progress (l_progress, this);
+}
+
+avaspec::recorder::~recorder ()
+{
+  startfunc;
+  if (::fclose (m_file) != 0)
+    shevek_warning_errno ("unable to write capture file");
+  delete m_device;
+}
+
+void avaspec::recorder::l_record (capture_record::kind_t kind, char reply,
+				  char const *message, unsigned size,
+				  unsigned reserved)
+{
+  startfunc;
+  capture_record record;
+  record.size = size;
+  record.kind = kind;
+  record.reply = reply;
+  record.reserved = reserved;
+  record.time = monotonic::now () - m_start;
+  if (::fwrite (&record, sizeof (record), 1, m_file) != 1
+      || ::fwrite (message, 1, size, m_file) != size)
+    shevek_warning ("unable to write capture file");
+}
+
+void avaspec::recorder::l_progress (void *self, char const *message,
+				    unsigned size)
+{
+  static_cast <recorder *> (self)->progress (message, size);
+}
+
+void avaspec::recorder::write_message (char const *message, unsigned size)
+{
+  startfunc;
+  l_record (capture_record::WRITE, 0, message, size);
+  m_device->write_message (message, size);
+}
+
+unsigned avaspec::recorder::read_message (char *buffer, unsigned capacity,
+					  unsigned timeout,
+					  unsigned replysize, char reply)
+{
+  startfunc;
+  unsigned size = m_device->read_message (buffer, capacity, timeout,
+					  replysize, reply);
+  // a timeout says nothing about the device
+  if (size)
+    l_record (capture_record::READ, reply, buffer, size);
+  return size;
+}
+
+void avaspec::recorder::interrupt ()
+{
+  startfunc;
+  m_device->interrupt ();
+}
+
+void avaspec::recorder::clear_interrupt ()
+{
+  startfunc;
+  m_device->clear_interrupt ();
+}
+
+void avaspec::recorder::allow_interrupt (bool allow)
+{
+  startfunc;
+  m_device->allow_interrupt (allow);
+}
+
+bool avaspec::recorder::interruptible () const
+{
+  startfunc;
+  return m_device->interruptible ();
+}
+
+unsigned avaspec::recorder::try_read_message (char *buffer,
+					      unsigned capacity,
+					      unsigned replysize, char reply)
+{
+  startfunc;
+  unsigned size = m_device->try_read_message (buffer, capacity, replysize,
+					      reply);
+  if (size)
+    l_record (capture_record::READ, reply, buffer, size);
+  return size;
+}
+
+bool avaspec::recorder::polls () const
+{
+  startfunc;
+  return m_device->polls ();
+}
+
+unsigned avaspec::recorder::poll_fds (struct pollfd *fds,
+				      unsigned max) const
+{
+  startfunc;
+  return m_device->poll_fds (fds, max);
+}
+
+unsigned avaspec::recorder::forget_replies (unsigned count)
+{
+  startfunc;
+  unsigned stale = m_device->forget_replies (count);
+  l_record (capture_record::FORGET, 0, 0, 0, stale);
+  return stale;
+}
+
+unsigned avaspec::recorder::queue_depth () const
+{
+  startfunc;
+  return m_device->queue_depth ();
+}
+
+void avaspec::recorder::count_retries (std::atomic <uint64_t> *counter)
+{
+  startfunc;
+  m_device->count_retries (counter);
+}
+
+avaspec::replay::replay (std::string const &file, bool realtime)
+  : m_realtime (realtime), m_queue_depth (1), m_write (0), m_read (0),
+    m_forget (0), m_offset (monotonic::now () ), m_diverged (false), m_ended (false)
+{
+  startfunc;
+  FILE *f = ::fopen (file.c_str (), "rb");
+  if (!f)
+    {
+      shevek_error_errno ("unable to open capture file " << file);
+      return;
+    }
+  char buffer[1 << 16];
+  size_t l;
+  while ( (l = ::fread (buffer, 1, sizeof (buffer), f) ) > 0)
+    m_data.insert (m_data.end (), buffer, buffer + l);
+  ::fclose (f);
+  capture_header header;
+  if (m_data.size () < sizeof (header) )
+    {
+      shevek_error ("capture file " << file << " is too short");
+      return;
+    }
+  ::memcpy (&header, &m_data[0], sizeof (header) );
+  if (::memcmp (header.magic, MAGIC, sizeof (header.magic) )
+      || header.version != capture_header::VERSION)
+    {
+      shevek_error (file << " is not a capture file");
+      return;
+    }
+  m_queue_depth = header.queue_depth ? header.queue_depth : 1;
+  m_write = m_read = m_forget = sizeof (header);
+}
+
+avaspec::replay::~replay ()
+{
+  startfunc;
+}
+
+bool avaspec::replay::l_next (size_t &pos, capture_record::kind_t kind,
+			      capture_record &record)
+{
+  startfunc;
+  while (pos + sizeof (record) <= m_data.size () )
+    {
+      ::memcpy (&record, &m_data[pos], sizeof (record) );
+      if (pos + sizeof (record) + record.size > m_data.size () )
+	break; // cut off while recording
+      if (record.kind == kind)
+	return true;
+      pos += sizeof (record) + record.size;
+    }
+  pos = m_data.size ();
+  return false;
+}
+
+void avaspec::replay::write_message (char const *message, unsigned size)
+{
+  startfunc;
+  capture_record record;
+  if (!l_next (m_write, capture_record::WRITE, record) )
+    return;
+  if (!m_diverged && (record.size != size
+		      || ::memcmp (&m_data[m_write + sizeof (record)],
+				   message, size) ) )
+    {
+      shevek_warning ("driver sends other commands than in the capture,"
+		      " replies may not match");
+      m_diverged = true;
+    }
+  m_write += sizeof (record) + record.size;
+  // the replies are timed from the last command, as the device did
+  m_offset = monotonic::now () - record.time;
+}
+
+unsigned avaspec::replay::read_message (char *buffer, unsigned capacity,
+					unsigned timeout, unsigned,
+					char reply)
+{
+  startfunc;
+  monotonic::ns deadline = monotonic::now ()
+    + timeout * monotonic::ns (monotonic::MS);
+  capture_record record;
+  if (!l_next (m_read, capture_record::READ, record) )
+    {
+      if (!m_ended)
+	shevek_warning ("end of capture");
+      m_ended = true;
+      monotonic::sleep_until (deadline);
+      return 0;
+    }
+  if (m_realtime)
+    {
+      monotonic::ns ready = record.time + m_offset;
+      monotonic::sleep_until (ready < deadline ? ready : deadline);
+      if (monotonic::now () < ready)
+	return 0;
+    }
+  if (record.reply != reply && !m_diverged)
+    {
+      shevek_warning ("capture has reply " << unsigned (record.reply & 0xff)
+		      << " where " << unsigned (reply & 0xff)
+		      << " is expected");
+      m_diverged = true;
+    }
+  if (record.size > capacity)
+    {
+      shevek_error ("recorded reply does not fit in buffer ("
+		    << record.size << " > " << capacity << ")");
+      return 0;
+    }
+  ::memcpy (buffer, &m_data[m_read + sizeof (record)], record.size);
+  m_read += sizeof (record) + record.size;
+  return record.size;
+}
+
+unsigned avaspec::replay::try_read_message (char *buffer, unsigned capacity,
+					    unsigned replysize, char reply)
+{
+  startfunc;
+  capture_record record;
+  if (!l_next (m_read, capture_record::READ, record)
+      || (m_realtime && monotonic::now () < record.time + m_offset) )
+    return 0;
+  return read_message (buffer, capacity, 0, replysize, reply);
+}
+
+unsigned avaspec::replay::forget_replies (unsigned count)
+{
+  startfunc;
+  // older captures have no forget records
+  capture_record record;
+  if (!l_next (m_forget, capture_record::FORGET, record) )
+    return count;
+  m_forget += sizeof (record) + record.size;
+  return record.reserved;
+}
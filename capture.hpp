@@ -0,0 +1,112 @@
+/*
+ *  capture.hpp
+ *  avaspec
+ *
+ *  Recording and replaying the traffic with a device.  The recorder sits
+ *  between avaspec and the real backend and writes every message which
+ *  goes either way to a capture file, with its time.  The replay backend
+ *  plays such a file back instead of a device, with the original timing
+ *  or as fast as the driver asks.  Only included by the files which
+ *  implement the driver.
+ *
+ *  A capture file is a capture_header followed by records, each a
+ *  capture_record followed by its size bytes of message.  Numbers are in
+ *  host byte order.
+ *
+ */
+
+#ifndef AVASPEC_CAPTURE_HH
+#define AVASPEC_CAPTURE_HH
+
+#include "avaspec.hpp"
+#include <stdio.h>
+#include <stdint.h>
+
+struct capture_header
+{
+  enum { VERSION = 1 };
+  char magic[8]; // "AVACAPT\0"
+  uint32_t version;
+  // queue_depth of the recorded backend, so the replay asks in the same
+  // order
+  uint32_t queue_depth;
+};
+
+struct capture_record
+{
+  enum kind_t { WRITE = 1, READ = 2, FORGET = 3 };
+  uint32_t size;
+  uint8_t kind;
+  // for READ, the reply code which was asked for
+  char reply;
+  // for FORGET, what forget_replies returned; there is no message
+  uint16_t reserved;
+  // monotonic ns since the recording started
+  int64_t time;
+};
+
+class avaspec::recorder : public avaspec::hardware
+{
+public:
+  // takes ownership of device
+  recorder (hardware *device, std::string const &file);
+  virtual ~recorder ();
+  virtual void write_message (char const *message, unsigned size);
+  virtual unsigned read_message (char *buffer, unsigned capacity,
+				 unsigned timeout, unsigned replysize,
+				 char reply);
+  virtual void interrupt ();
+  virtual void clear_interrupt ();
+  virtual void allow_interrupt (bool allow);
+  virtual bool interruptible () const;
+  virtual unsigned try_read_message (char *buffer, unsigned capacity,
+				     unsigned replysize, char reply);
+  virtual bool polls () const;
+  virtual unsigned poll_fds (struct pollfd *fds, unsigned max) const;
+  virtual unsigned forget_replies (unsigned count);
+  virtual unsigned queue_depth () const;
+  virtual void count_retries (std::atomic <uint64_t> *counter);
+private:
+  hardware *m_device;
+  FILE *m_file;
+  monotonic::ns m_start;
+  void l_record (capture_record::kind_t kind, char reply,
+		 char const *message, unsigned size, unsigned reserved = 0);
+  static void l_progress (void *self, char const *message, unsigned size);
+};
+
+class avaspec::replay : public avaspec::hardware
+{
+public:
+  // if realtime, replies come as long after the request as they did when
+  // they were recorded; otherwise as soon as they are asked for
+  replay (std::string const &file, bool realtime);
+  virtual ~replay ();
+  virtual void write_message (char const *message, unsigned size);
+  virtual unsigned read_message (char *buffer, unsigned capacity,
+				 unsigned timeout, unsigned replysize,
+				 char reply);
+  virtual unsigned try_read_message (char *buffer, unsigned capacity,
+				     unsigned replysize, char reply);
+  virtual bool polls () const { return true; }
+  // as the recorded backend did
+  virtual unsigned forget_replies (unsigned count);
+  virtual unsigned queue_depth () const { return m_queue_depth; }
+private:
+  bool m_realtime;
+  unsigned m_queue_depth;
+  // the whole file
+  std::vector <char> m_data;
+  // offsets of the next write, read and forget records to play
+  size_t m_write, m_read, m_forget;
+  // added to a recorded time to get the time on our clock
+  monotonic::ns m_offset;
+  // to complain only once
+  bool m_diverged, m_ended;
+  // move pos to the next record of kind, and copy it to record.  Returns
+  // false at the end of the file.
+  bool l_next (size_t &pos, capture_record::kind_t kind,
+	       capture_record &record);
+};
+
+#endif // defined AVASPEC_CAPTURE_HH
@@ -0,0 +1,119 @@
+/*
+ *  clock.hpp
+ *  avaspec
+ *
+ *  Monotonic time for deadlines and latency measurements.  Unlike
+ *  shevek::absolute_time, this clock does not jump when the system time
+ *  is set, so it is safe to compute timeouts from it.
+ *
+ */
+
+#ifndef AVASPEC_CLOCK_HH
+#define AVASPEC_CLOCK_HH
+
+#include "time.hpp"
+#include <time.h>
+#include <errno.h>
+
+namespace monotonic
+{
+  // nanoseconds on the monotonic clock
+  typedef long long ns;
+  enum { MS = 1000000 };
+
+  inline ns now ()
+  {
+    struct timespec ts;
+    ::clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ns (ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  inline ns from (shevek::relative_time t)
+  {
+    ns value = ns (t.total () ) * 1000000000 + t.nanoseconds ();
+    return t.isnegative () ? -value : value;
+  }
+
+  inline shevek::relative_time to_relative (ns t)
+  {
+    if (t < 0)
+      return -to_relative (-t);
+    return shevek::relative_time (shevek::timetype (t / 1000000000),
+				  unsigned (t % 1000000000) );
+  }
+
+  // milliseconds from now until deadline, rounded up, at least 1 (0 means
+  // "forever" for most timeouts) and at most limit.
+  inline unsigned ms_until (ns deadline, unsigned limit)
+  {
+    ns left = (deadline - now () + MS - 1) / MS;
+    if (left < 1)
+      return 1;
+    if (left > limit)
+      return limit;
+    return unsigned (left);
+  }
+
+  // sleep until the clock reaches deadline
+  inline void sleep_until (ns deadline)
+  {
+#ifdef __APPLE__
+    // no clock_nanosleep; a relative sleep is good enough here
+    ns left;
+    while ( (left = deadline - now () ) > 0)
+      {
+	struct timespec ts;
+	ts.tv_sec = left / 1000000000;
+	ts.tv_nsec = left % 1000000000;
+	::nanosleep (&ts, 0);
+      }
+#else
+    // the system call costs tens of microseconds even when it has nothing
+    // to wait for
+    if (deadline <= now () )
+      return;
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while (::clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0)
+	   == EINTR)
+      {
+      }
+#endif
+  }
+}
+
+// Learns how long after the end of the integration the data of a
+// device arrives.  It keeps a running mean and mean deviation, the way tcp
+// estimates round trip times.
+class latency_estimator
+{
+public:
+  // until the first sample, assume the 10 ms the driver always used
+  explicit latency_estimator (monotonic::ns initial = 10 * monotonic::MS)
+    : m_mean (initial), m_deviation (initial), m_samples (0) {}
+  void sample (monotonic::ns value)
+  {
+    if (value < 0)
+      value = 0;
+    if (m_samples++ == 0)
+      {
+	m_mean = value;
+	m_deviation = value / 2;
+	return;
+      }
+    monotonic::ns error = value - m_mean;
+    m_mean += error / 8;
+    m_deviation += ( (error < 0 ? -error : error) - m_deviation) / 4;
+  }
+  // expected latency
+  monotonic::ns estimate () const { return m_mean; }
+  // latency which is very unlikely to be exceeded
+  monotonic::ns margin () const { return m_mean + 4 * m_deviation; }
+  unsigned samples () const { return m_samples; }
+private:
+  monotonic::ns m_mean, m_deviation;
+  unsigned m_samples;
+};
+
+#endif // defined AVASPEC_CLOCK_HH
@@ -0,0 +1,124 @@
+/*
+ *  coadd.cpp
+ *  avaspec
+ *
+ *  Summing the frames of a group, and the averages with and without
+ *  outlier rejection.
+ *
+ */
+
+#include "coadd.hpp"
+#include "kernels.hpp" // accumulate
+#include "debug.hpp" // startfunc, dbg
+#include <math.h> // lrint
+#include <stdint.h>
+#include <string.h> // memset
+
+coadder::coadder ()
+  : m_frames (1), m_pixels (0), m_count (0), m_clip (0)
+{
+  startfunc;
+}
+
+void coadder::setup (unsigned frames, unsigned pixels, float clip)
+{
+  startfunc;
+  m_frames = frames ? frames : 1;
+  m_pixels = pixels;
+  m_clip = clip > 0 ? clip : 0;
+  m_sum.reserve (pixels * sizeof (int32_t) );
+  m_sum.resize (pixels * sizeof (int32_t) );
+  clear ();
+  unsigned kept = m_clip ? m_frames : 1;
+  m_group.reserve (kept * pixels * sizeof (short) );
+  m_group.resize (kept * pixels * sizeof (short) );
+  if (m_clip)
+    {
+      m_scratch.reserve (4 * pixels * sizeof (float) );
+      m_scratch.resize (4 * pixels * sizeof (float) );
+    }
+}
+
+short *coadder::next ()
+{
+  short *group = reinterpret_cast <short *> (m_group.data () );
+  return m_clip ? group + m_count * m_pixels : group;
+}
+
+bool coadder::add ()
+{
+  kernels::accumulate (next (), m_pixels,
+		       reinterpret_cast <int32_t *> (m_sum.data () ) );
+  return ++m_count == m_frames;
+}
+
+void coadder::result (short *target)
+{
+  startfunc;
+  int32_t *sum = reinterpret_cast <int32_t *> (m_sum.data () );
+  if (m_count == 0)
+    ::memset (target, 0, m_pixels * sizeof (short) );
+  else if (m_clip && m_count > 2)
+    l_clip (target);
+  else
+    for (unsigned i = 0; i < m_pixels; ++i)
+      target[i] = short (::lrint (double (sum[i]) / m_count) );
+  clear ();
+}
+
+void coadder::clear ()
+{
+  if (m_pixels)
+    ::memset (m_sum.data (), 0, m_pixels * sizeof (int32_t) );
+  m_count = 0;
+}
+
+// The loops run over the pixels, with the frames outside, so the compiler
+// can vectorize them; once per group that is fast enough.
+void coadder::l_clip (short *target)
+{
+  startfunc;
+  int32_t const *sum = reinterpret_cast <int32_t const *> (m_sum.data () );
+  short const *group = reinterpret_cast <short const *> (m_group.data () );
+  float *mean = reinterpret_cast <float *> (m_scratch.data () );
+  float *limit = mean + m_pixels;
+  int32_t *kept = reinterpret_cast <int32_t *> (limit + m_pixels);
+  int32_t *used = kept + m_pixels;
+  for (unsigned i = 0; i < m_pixels; ++i)
+    {
+      mean[i] = float (sum[i]) / m_count;
+      limit[i] = 0;
+      kept[i] = 0;
+      used[i] = 0;
+    }
+  // limit is the sum of squared distances from the mean first
+  for (unsigned f = 0; f < m_count; ++f)
+    {
+      short const *x = group + f * m_pixels;
+      for (unsigned i = 0; i < m_pixels; ++i)
+	{
+	  float d = x[i] - mean[i];
+	  limit[i] += d * d;
+	}
+    }
+  // A value is compared with the mean and deviation of the other frames:
+  // with itself included, an outlier in a group of n is never more than
+  // (n - 1) / sqrt (n) deviations away.  Taking a value at distance d out
+  // moves the mean by d / (n - 1) and lowers the sum of squares by
+  // d^2 * n / (n - 1), so both follow from the sums of the whole group.
+  float n = m_count, k = n / (n - 1), c2 = m_clip * m_clip / (n - 1);
+  for (unsigned f = 0; f < m_count; ++f)
+    {
+      short const *x = group + f * m_pixels;
+      for (unsigned i = 0; i < m_pixels; ++i)
+	{
+	  float d = x[i] - mean[i], dd = d * d * k;
+	  int32_t in = dd * k <= c2 * (limit[i] - dd);
+	  kept[i] += in * x[i];
+	  used[i] += in;
+	}
+    }
+  for (unsigned i = 0; i < m_pixels; ++i)
+    target[i] = used[i] ? short (::lrint (double (kept[i]) / used[i]) )
+      : short (::lrint (mean[i]) );
+}
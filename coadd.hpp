@@ -0,0 +1,53 @@
+/*
+ *  coadd.hpp
+ *  avaspec
+ *
+ *  Co-adding of spectra on the host: every group of consecutive frames
+ *  becomes one averaged spectrum.  Unlike the averaging of the device
+ *  (avaspec::set_average), every frame is still read out, so the time
+ *  resolution can be chosen after the fact; only what is stored shrinks.
+ *
+ */
+
+#ifndef AVASPEC_COADD_HH
+#define AVASPEC_COADD_HH
+
+#include "buffer.hpp"
+
+class coadder
+{
+public:
+  coadder ();
+  // groups of frames spectra of pixels each.  With clip > 0, a pixel
+  // value which is more than clip standard deviations from the mean of
+  // the other frames of its group is left out of the average; groups of
+  // less than three frames are not clipped.  Clipping needs the whole
+  // group in memory; without it, only the sums are kept.
+  void setup (unsigned frames, unsigned pixels, float clip);
+  unsigned frames () const { return m_frames; }
+  // number of frames in the current group
+  unsigned pending () const { return m_count; }
+  // where the next spectrum must be written, before calling add
+  short *next ();
+  // add the spectrum at next () to the group.  Returns true when the
+  // group is complete; result must then be called.
+  bool add ();
+  // write the average of the current group (which may be incomplete) to
+  // target, and start a new one
+  void result (short *target);
+  // start a new group without a result
+  void clear ();
+private:
+  unsigned m_frames, m_pixels, m_count;
+  float m_clip;
+  // int32_t sum per pixel
+  aligned_buffer m_sum;
+  // the spectra of the group when clipping, else room for one
+  aligned_buffer m_group;
+  // per pixel scratch for the clipping: mean, sum of squares, kept sum
+  // and count
+  aligned_buffer m_scratch;
+  void l_clip (short *target);
+};
+
+#endif // defined AVASPEC_COADD_HH
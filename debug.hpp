@@ -26,10 +26,12 @@
 #include <iomanip>
 #include <string>
 #include <ctype.h>
+#include "trace.hpp"
 
 #define startfunc \
 do { if (DEBUG_STARTFUNC) std::cerr << "Debug: entering " \
-  << __PRETTY_FUNCTION__ << '\n'; } while (0)
+  << __PRETTY_FUNCTION__ << '\n'; \
+  if (trace::calls ()) trace::add (__PRETTY_FUNCTION__, 0, 0); } while (0)
 #ifndef DEBUG_STARTFUNC
 #define DEBUG_STARTFUNC false
 #endif
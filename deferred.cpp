@@ -0,0 +1,128 @@
+/*
+ *  deferred.cpp
+ *  avaspec
+ *
+ *  The queue of deferred warnings and the thread which writes them.
+ *
+ */
+
+#include "deferred.hpp"
+#include "trace.hpp"
+#include <atomic>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h> // usleep
+
+namespace
+{
+  // a bounded queue for many producers and one consumer: every slot has
+  // a sequence number which says whether it may be written (seq == the
+  // position) or read (seq == position + 1)
+  enum { SLOTS = 256, INTERVAL_US = 20000 };
+  struct slot
+  {
+    std::atomic <uint64_t> seq;
+    char const *format;
+    long long a, b;
+  };
+  slot slots[SLOTS];
+  std::atomic <uint64_t> tail (0);
+  uint64_t head = 0; // only touched with reader held
+  std::atomic <unsigned long long> dropped (0);
+  pthread_mutex_t reader = PTHREAD_MUTEX_INITIALIZER;
+
+  // The thread which writes the queue.  It is a static object, so it is
+  // stopped and joined when the library is unloaded or the program
+  // exits, and what is still queued is written then.
+  class writer
+  {
+  public:
+    writer ()
+      : m_stop (false)
+    {
+      for (unsigned i = 0; i < SLOTS; ++i)
+	slots[i].seq.store (i, std::memory_order_relaxed);
+      m_running = pthread_create (&m_thread, 0, l_thread, this) == 0;
+    }
+    ~writer ()
+    {
+      m_stop.store (true, std::memory_order_relaxed);
+      if (m_running)
+	pthread_join (m_thread, 0);
+      deferred::flush ();
+    }
+    // start the thread when the first warning is queued
+    static void start ()
+    {
+      static writer instance;
+    }
+  private:
+    pthread_t m_thread;
+    bool m_running;
+    std::atomic <bool> m_stop;
+    static void *l_thread (void *self)
+    {
+      writer *w = reinterpret_cast <writer *> (self);
+      while (!w->m_stop.load (std::memory_order_relaxed) )
+	{
+	  ::usleep (INTERVAL_US);
+	  deferred::flush ();
+	}
+      return 0;
+    }
+  };
+}
+
+void deferred::warning (char const *format, long long a, long long b)
+{
+  trace_event (format, a, b);
+  writer::start ();
+  uint64_t pos = tail.load (std::memory_order_relaxed);
+  while (true)
+    {
+      slot &s = slots[pos % SLOTS];
+      uint64_t seq = s.seq.load (std::memory_order_acquire);
+      if (seq == pos)
+	{
+	  if (tail.compare_exchange_weak (pos, pos + 1,
+					  std::memory_order_relaxed) )
+	    {
+	      s.format = format;
+	      s.a = a;
+	      s.b = b;
+	      s.seq.store (pos + 1, std::memory_order_release);
+	      return;
+	    }
+	  // pos has been updated by the failed exchange
+	}
+      else if (seq < pos)
+	{
+	  // the slot still holds a warning from SLOTS ago: full
+	  dropped.fetch_add (1, std::memory_order_relaxed);
+	  return;
+	}
+      else
+	pos = tail.load (std::memory_order_relaxed);
+    }
+}
+
+void deferred::flush ()
+{
+  pthread_mutex_lock (&reader);
+  while (true)
+    {
+      slot &s = slots[head % SLOTS];
+      if (s.seq.load (std::memory_order_acquire) != head + 1)
+	break;
+      ::fputs ("Warning: ", stderr);
+      ::fprintf (stderr, s.format, s.a, s.b);
+      ::fputc ('\n', stderr);
+      s.seq.store (head + SLOTS, std::memory_order_release);
+      ++head;
+    }
+  unsigned long long lost = dropped.exchange (0, std::memory_order_relaxed);
+  if (lost)
+    ::fprintf (stderr, "Warning: %llu more warnings were dropped\n", lost);
+  pthread_mutex_unlock (&reader);
+}
@@ -0,0 +1,26 @@
+/*
+ *  deferred.hpp
+ *  avaspec
+ *
+ *  Warnings from the acquisition path.  shevek_warning formats its
+ *  message and writes it to std::cerr before it returns; for a bad frame
+ *  that is too slow.  These warnings are queued without locks and
+ *  written by a background thread instead.  They are also recorded in
+ *  the trace.
+ *
+ */
+
+#ifndef AVASPEC_DEFERRED_HH
+#define AVASPEC_DEFERRED_HH
+
+namespace deferred
+{
+  // queue a warning.  format is a printf format with static storage
+  // duration, for the two numbers (use %lld).  If warnings come faster
+  // than they are written, the excess is dropped and counted.
+  void warning (char const *format, long long a = 0, long long b = 0);
+  // write all queued warnings now
+  void flush ();
+}
+
+#endif // defined AVASPEC_DEFERRED_HH
@@ -0,0 +1,167 @@
+/*
+ *  dle.cpp
+ *  avaspec
+ *
+ *  DLE framing of the serial protocol.
+ *
+ */
+
+#include "dle.hpp"
+#include "debug.hpp"   // startfunc, dbg
+#include "kernels.hpp" // find_byte
+#include <string.h>    // memcpy
+
+dle_deframer::dle_deframer (unsigned max_frame)
+  : m_ring (RING), m_head (0), m_tail (0), m_state (HUNT),
+    m_frame (max_frame), m_size (0), m_max (max_frame), m_too_long (false)
+{
+  startfunc;
+}
+
+char *dle_deframer::space (unsigned &size)
+{
+  unsigned offset = m_tail % RING;
+  size = RING - (m_tail - m_head);
+  if (size > RING - offset)
+    size = RING - offset;
+  return m_ring.data () + offset;
+}
+
+void dle_deframer::commit (unsigned size)
+{
+  m_tail += size;
+}
+
+void dle_deframer::reset ()
+{
+  startfunc;
+  m_head = m_tail = 0;
+  m_state = HUNT;
+  m_size = 0;
+  m_too_long = false;
+}
+
+void dle_deframer::l_append (char const *data, unsigned size)
+{
+  if (m_too_long || m_size + size > m_max)
+    {
+      // keep parsing until the end of the frame, but drop it then
+      m_too_long = true;
+      return;
+    }
+  ::memcpy (m_frame.data () + m_size, data, size);
+  m_size += size;
+}
+
+dle_deframer::result dle_deframer::next ()
+{
+  while (m_head != m_tail)
+    {
+      // the bytes up to the end of the ring or of the data
+      unsigned offset = m_head % RING;
+      unsigned size = m_tail - m_head;
+      if (size > RING - offset)
+	size = RING - offset;
+      char const *p = m_ring.data () + offset;
+      switch (m_state)
+	{
+	case HUNT:
+	  {
+	    unsigned skip = kernels::find_byte (p, size, DLE);
+	    if (skip < size)
+	      {
+		dbg ("skipped " << skip << " bytes before frame");
+		m_state = START;
+		++skip;
+	      }
+	    m_head += skip;
+	    break;
+	  }
+	case START:
+	  ++m_head;
+	  if (*p == STX)
+	    {
+	      m_state = BODY;
+	      m_size = 0;
+	      m_too_long = false;
+	    }
+	  else if (*p != DLE)
+	    {
+	      dbg ("not a frame head, looking for the next one");
+	      m_state = HUNT;
+	    }
+	  break;
+	case BODY:
+	  {
+	    // everything up to the next DLE is data
+	    unsigned run = kernels::find_byte (p, size, DLE);
+	    l_append (p, run);
+	    m_head += run;
+	    if (run < size)
+	      {
+		++m_head;
+		m_state = ESCAPE;
+	      }
+	    break;
+	  }
+	case ESCAPE:
+	  ++m_head;
+	  switch (*p)
+	    {
+	    case DLE: // escaped 0x10, insert only one in data
+	      l_append (p, 1);
+	      m_state = BODY;
+	      break;
+	    case ETX:
+	      m_state = HUNT;
+	      return m_too_long ? TOO_LONG : FRAME;
+	    case STX: // a new frame starts; the old one is lost
+	      dbg ("unterminated frame");
+	      m_size = 0;
+	      m_too_long = false;
+	      m_state = BODY;
+	      break;
+	    default:
+	      dbg ("invalid escape in frame, looking for the next one");
+	      m_state = HUNT;
+	      break;
+	    }
+	  break;
+	}
+    }
+  return MORE;
+}
+
+namespace
+{
+  // copy data to target with every DLE doubled; returns the new end
+  char *escape (char const *data, unsigned size, char *target)
+  {
+    while (size)
+      {
+	unsigned run = kernels::find_byte (data, size, dle_deframer::DLE);
+	::memcpy (target, data, run);
+	target += run;
+	if (run == size)
+	  break;
+	*target++ = dle_deframer::DLE;
+	*target++ = dle_deframer::DLE;
+	data += run + 1;
+	size -= run + 1;
+      }
+    return target;
+  }
+}
+
+unsigned dle_encode (char const *head, unsigned head_size, char const *body,
+		     unsigned size, char *target)
+{
+  char *p = target;
+  *p++ = dle_deframer::DLE;
+  *p++ = dle_deframer::STX;
+  p = escape (head, head_size, p);
+  p = escape (body, size, p);
+  *p++ = dle_deframer::DLE;
+  *p++ = dle_deframer::ETX;
+  return p - target;
+}
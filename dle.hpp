@@ -0,0 +1,57 @@
+/*
+ *  dle.hpp
+ *  avaspec
+ *
+ *  DLE framing of the serial protocol.  A frame is 0x10 0x02, the body
+ *  with every 0x10 doubled, and 0x10 0x03.  The deframer reads raw bytes
+ *  into a ring and remembers where it was, so every byte is looked at once
+ *  no matter how the frames are split over reads.
+ *
+ */
+
+#ifndef AVASPEC_DLE_HH
+#define AVASPEC_DLE_HH
+
+#include "buffer.hpp"
+
+class dle_deframer
+{
+public:
+  enum { DLE = 0x10, STX = 0x02, ETX = 0x03 };
+  enum result { MORE, FRAME, TOO_LONG };
+  // frames with a body of more than max_frame bytes are dropped
+  explicit dle_deframer (unsigned max_frame);
+  // contiguous free space in the ring.  After reading into it, tell how
+  // much was stored with commit.  size is 0 if the ring is full.
+  char *space (unsigned &size);
+  void commit (unsigned size);
+  // parse the buffered bytes until a frame is complete (FRAME), a frame
+  // was dropped for being too long (TOO_LONG), or all bytes are used
+  // (MORE).  After FRAME, the unescaped body is in frame () until the
+  // next call.
+  result next ();
+  char const *frame () const { return m_frame.data (); }
+  unsigned frame_size () const { return m_size; }
+  // forget all buffered bytes and any partial frame
+  void reset ();
+private:
+  enum { RING = 1 << 15 };
+  enum state { HUNT, START, BODY, ESCAPE };
+  aligned_buffer m_ring;
+  // buffered bytes are m_ring[m_head, m_tail), modulo RING
+  unsigned m_head, m_tail;
+  state m_state;
+  aligned_buffer m_frame;
+  unsigned m_size, m_max;
+  bool m_too_long;
+  void l_append (char const *data, unsigned size);
+};
+
+// Frame head and body (which are escaped the same way) into target, which
+// must have room for dle_max_frame (head_size + size) bytes.  Returns the
+// number of bytes stored.
+unsigned dle_encode (char const *head, unsigned head_size, char const *body,
+		     unsigned size, char *target);
+inline unsigned dle_max_frame (unsigned size) { return 2 * size + 4; }
+
+#endif // defined AVASPEC_DLE_HH
@@ -0,0 +1,341 @@
+/*
+ *  emulation.cpp
+ *  avaspec
+ *
+ *  Emulated device with the timing and the spectra of a real one.
+ *
+ */
+
+#include "emulation.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include "error.hpp"
+#include "deferred.hpp"
+#include <fstream>
+#include <stdio.h>  // sscanf
+#include <string.h> // memcpy, memset
+#include <atomic>
+
+namespace
+{
+  // the made-up spectrum: a few lines on a weak continuum, in counts for
+  // the template integration time
+  struct line
+  {
+    float pixel, width, height;
+  } const LINES[] = {
+    { 310, 2.5, 4000 }, { 655, 3, 12000 }, { 1020, 2, 2500 },
+    { 1380, 3.5, 8000 }, { 1725, 2.5, 6000 }
+  };
+  float const CONTINUUM = 200, DARK = 600;
+  // variance of the read noise, in counts squared
+  float const READ_NOISE = 4;
+  // every emulated device gets its own noise
+  std::atomic <unsigned> instances (0);
+}
+
+avaspec::emulation::emulation (source const &where)
+  : m_source (where), m_external (false), m_time_ms (~0u), m_average (0),
+    m_gain (0), m_floor (0), m_integrated (0), m_bus (0),
+    m_epoch (monotonic::now () ), m_head (0), m_tail (0)
+{
+  startfunc;
+  for (unsigned c = 0; c < CHANNELS; ++c)
+    {
+      m_min[c] = 0;
+      m_max[c] = PIXELS - EXTRA;
+    }
+  uint32_t seed = 0x9e3779b9u * (++instances);
+  for (unsigned i = 0; i < kernels::NOISE_LANES; ++i)
+    {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      m_noise[i] = seed ? seed : 1;
+    }
+  if (m_source.spectrum.empty () || !l_load (m_source.spectrum) )
+    l_make_up ();
+}
+
+avaspec::emulation::~emulation ()
+{
+  startfunc;
+}
+
+bool avaspec::emulation::l_load (std::string const &file)
+{
+  startfunc;
+  std::ifstream in (file.c_str () );
+  if (!in)
+    {
+      shevek_warning ("unable to open emulation spectrum " << file
+		      << ", making one up");
+      return false;
+    }
+  // the dark pixels are on the line after "Dark pixels:", then there is
+  // a line with wavelength, value, dark corrected value for every pixel
+  float scale = m_source.template_ms > 0 ? 1 / m_source.template_ms : 0;
+  unsigned dark = 0, pixel = EXTRA;
+  float level = 0;
+  bool dark_next = false;
+  std::string text;
+  while (std::getline (in, text) )
+    {
+      if (dark_next)
+	{
+	  char const *p = text.c_str ();
+	  int used;
+	  float value;
+	  while (dark < EXTRA
+		 && ::sscanf (p, " %f ,%n", &value, &used) == 1)
+	    {
+	      m_dark[dark++] = value;
+	      level += value;
+	      p += used;
+	    }
+	  dark_next = false;
+	  continue;
+	}
+      if (text.compare (0, 12, "Dark pixels:") == 0)
+	{
+	  dark_next = true;
+	  continue;
+	}
+      float wavelength, value;
+      if (pixel < PIXELS
+	  && ::sscanf (text.c_str (), "%f , %f", &wavelength, &value) == 2)
+	m_signal[pixel++] = value > 0 ? value * scale : 0;
+    }
+  if (pixel == EXTRA)
+    {
+      shevek_warning ("no spectrum in " << file << ", making one up");
+      return false;
+    }
+  level = dark ? level / dark : DARK;
+  for (unsigned i = dark; i < EXTRA; ++i)
+    m_dark[i] = level;
+  for (unsigned i = 0; i < EXTRA; ++i)
+    m_signal[i] = 0;
+  for (unsigned i = pixel; i < PIXELS; ++i)
+    m_signal[i] = 0;
+  // the data pixels get the level of the dark pixels, with a fixed
+  // pattern of a few percent
+  uint32_t s = 12345;
+  for (unsigned i = EXTRA; i < PIXELS; ++i)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      m_dark[i] = level * (0.97f + 0.06f * (s >> 8) / (1 << 24) );
+    }
+  return true;
+}
+
+void avaspec::emulation::l_make_up ()
+{
+  startfunc;
+  float scale = m_source.template_ms > 0 ? 1 / m_source.template_ms : 0;
+  uint32_t s = 12345;
+  for (unsigned i = 0; i < PIXELS; ++i)
+    {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      m_dark[i] = DARK * (0.97f + 0.06f * (s >> 8) / (1 << 24) );
+      if (i < EXTRA)
+	{
+	  m_signal[i] = 0;
+	  continue;
+	}
+      float value = CONTINUUM;
+      for (unsigned l = 0; l < sizeof (LINES) / sizeof (*LINES); ++l)
+	{
+	  float d = (float (i - EXTRA) - LINES[l].pixel) / LINES[l].width;
+	  // a lorentzian is cheaper than a gaussian and looks as good
+	  value += LINES[l].height / (1 + d * d);
+	}
+      m_signal[i] = value * scale;
+    }
+}
+
+void avaspec::emulation::l_expect (unsigned time_ms, unsigned average)
+{
+  startfunc;
+  if (time_ms != m_time_ms)
+    {
+      for (unsigned i = 0; i < PIXELS; ++i)
+	m_mean[i] = m_dark[i] + m_signal[i] * time_ms;
+      m_time_ms = time_ms;
+    }
+  // averaging reduces the noise, not the signal
+  m_average = average;
+  m_gain = m_source.noise / average;
+  m_floor = m_source.noise * READ_NOISE / average;
+}
+
+void avaspec::emulation::l_queue (unsigned channel, monotonic::ns request)
+{
+  startfunc;
+  if (m_tail - m_head == QUEUE)
+    {
+      deferred::warning ("emulated device: too many requests, dropping one");
+      return;
+    }
+  // the channels are read out one after the other, then their data goes
+  // over the bus in the order it was asked for
+  monotonic::ns available = m_integrated + monotonic::ns
+    ( (channel + 1) * m_source.readout_ms * monotonic::MS);
+  monotonic::ns start = request;
+  if (start < available)
+    start = available;
+  if (start < m_bus)
+    start = m_bus;
+  unsigned bytes = 6 + 2 * (EXTRA + m_max[channel] - m_min[channel]);
+  m_bus = start + (m_source.rate > 0
+		   ? monotonic::ns (bytes * 1e9 / m_source.rate) : 0);
+  reply &r = m_queue[m_tail++ % QUEUE];
+  r.channel = channel;
+  r.ready = m_bus;
+}
+
+void avaspec::emulation::write_message (char const *message, unsigned size)
+{
+  startfunc;
+  monotonic::ns now = monotonic::now ();
+  if (size == 5 && message[0] == 0x03)
+    {
+      // start measurement: with external trigger, wait for the next one
+      unsigned time_ms = (message[1] & 0xff) + ( (message[2] & 0xff) << 8);
+      unsigned average = (message[3] & 0xff) + ( (message[4] & 0xff) << 8);
+      if (!average)
+	average = 1;
+      monotonic::ns start = now;
+      if (m_external && m_source.trigger_hz > 0)
+	{
+	  monotonic::ns period = monotonic::ns (1e9 / m_source.trigger_hz);
+	  start = m_epoch + ( (now - m_epoch) / period + 1) * period;
+	}
+      m_integrated = start + monotonic::ns (time_ms) * monotonic::MS
+	* average;
+      // a new measurement aborts the old one
+      m_head = m_tail;
+      l_expect (time_ms, average);
+      l_queue (0, now);
+    }
+  else if (size == 2 && message[0] == 0x04)
+    {
+      unsigned channel = message[1] & 0xff;
+      if (channel < CHANNELS)
+	l_queue (channel, now);
+    }
+  else if (size == 6 && message[0] == 0x08)
+    {
+      unsigned channel = message[1] & 0xff;
+      if (channel < CHANNELS)
+	{
+	  m_min[channel] = (message[2] & 0xff)
+	    + ( (message[3] & 0xff) << 8);
+	  m_max[channel] = (message[4] & 0xff)
+	    + ( (message[5] & 0xff) << 8) + 1;
+	}
+    }
+  else if (size == 2 && message[0] == 0x09)
+    m_external = message[1] != 0;
+}
+
+unsigned avaspec::emulation::l_data (char *buffer, unsigned capacity)
+{
+  startfunc;
+  unsigned channel = m_queue[m_head++ % QUEUE].channel;
+  unsigned min = m_min[channel], max = m_max[channel];
+  unsigned size = 6 + 2 * (EXTRA + max - min);
+  if (size > capacity)
+    {
+      shevek_error ("emulated reply does not fit in buffer ("
+		    << size << " > " << capacity << ")");
+      return 0;
+    }
+  buffer[0] = 0x83;
+  buffer[1] = 0;
+  buffer[2] = min & 0xff;
+  buffer[3] = (min >> 8) & 0xff;
+  buffer[4] = (max - 1) & 0xff;
+  buffer[5] = ( (max - 1) >> 8) & 0xff;
+  // the dark pixels, then the requested range
+  kernels::synthesize (m_mean, EXTRA, m_gain, m_floor, SATURATION, m_noise,
+		       buffer + 6);
+  kernels::synthesize (m_mean + EXTRA + min, max - min, m_gain, m_floor,
+		       SATURATION, m_noise, buffer + 6 + 2 * EXTRA);
+  return size;
+}
+
+unsigned avaspec::emulation::try_read_message (char *buffer,
+					       unsigned capacity,
+					       unsigned replysize, char reply)
+{
+  startfunc;
+  if ( (reply & 0xff) == 0x83
+      && (m_head == m_tail
+	  || monotonic::now () < m_queue[m_head % QUEUE].ready) )
+    return 0;
+  return read_message (buffer, capacity, 0, replysize, reply);
+}
+
+unsigned avaspec::emulation::read_message (char *buffer, unsigned capacity,
+					   unsigned timeout,
+					   unsigned replysize, char reply)
+{
+  startfunc;
+  if ( (reply & 0xff) == 0x83)
+    {
+      // wait for the data, like the device would
+      monotonic::ns deadline = monotonic::now ()
+	+ timeout * monotonic::ns (monotonic::MS);
+      monotonic::ns ready = m_head == m_tail ? deadline
+	: m_queue[m_head % QUEUE].ready;
+      monotonic::sleep_until (ready < deadline ? ready : deadline);
+      if (m_head == m_tail || monotonic::now () < ready)
+	return 0;
+      return l_data (buffer, capacity);
+    }
+  unsigned size = replysize;
+  if ( (reply & 0xff) == 0x81 && replysize != 327)
+    {
+      shevek_error ("unable to return status: "
+		    "incorrect reply length (bug)");
+      return 0;
+    }
+  if (size > capacity)
+    {
+      shevek_error ("emulated reply does not fit in buffer ("
+		    << size << " > " << capacity << ")");
+      return 0;
+    }
+  if ( (reply & 0xff) == 0x81)
+    {
+      static char const status[] = "\201" // reply
+	"emulation device                "
+	"                                " // 0x40B version
+	"\000\000" //0x02B device id
+	"\002" //0x01B number of channels in this device
+	"\000\010" //0x02B number of pixels per channel
+	"\000"; //0x01B sensor (?)
+      static char const channel[] = "\001\000\000\000" // calibration
+	"\000\000\000\000" // calibration
+	"\000\000\000\000" // calibration
+	"\000\000\000\000" // calibration
+	"\000\000\000\000" // calibration
+	"\000\000\000\000" // calibration (gain)
+	"\000\000\000\000" // calibration (offset)
+	"\000\000" //0x02 bytes start pixel
+	"\361\007"; //0x02 bytes stop pixel+1(incl. endpoint)
+      ::memcpy (buffer, status, 0x47);
+      for (unsigned i = 0; i < 8; ++i)
+	::memcpy (buffer + 0x47 + i * 0x20, channel, 0x20);
+    }
+  else
+    {
+      ::memset (buffer, 0, size);
+      buffer[0] = reply;
+    }
+  return size;
+}
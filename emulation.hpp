@@ -0,0 +1,70 @@
+/*
+ *  emulation.hpp
+ *  avaspec
+ *
+ *  Emulated device, for testing and benchmarking without hardware.  It
+ *  takes as long as a device would: the integration time and averages,
+ *  then the readout of each channel, then the transfer of its data.  The
+ *  spectra are made from a template, with a dark level and shot noise,
+ *  and saturate like the real sensor.  Only included by the files which
+ *  implement the driver.
+ *
+ */
+
+#ifndef AVASPEC_EMULATION_HH
+#define AVASPEC_EMULATION_HH
+
+#include "avaspec.hpp"
+#include "kernels.hpp" // NOISE_LANES
+#include <stdint.h>
+
+class avaspec::emulation : public avaspec::hardware
+{
+public:
+  explicit emulation (source const &where);
+  virtual ~emulation ();
+  virtual void write_message (char const *message, unsigned size);
+  virtual unsigned read_message (char *buffer, unsigned capacity,
+				 unsigned timeout, unsigned replysize,
+				 char reply);
+  virtual unsigned try_read_message (char *buffer, unsigned capacity,
+				     unsigned replysize, char reply);
+  virtual bool polls () const { return true; }
+  virtual unsigned queue_depth () const { return QUEUE; }
+private:
+  // the emulated sensor: PIXELS pixels, of which the first EXTRA are dark
+  // pixels, sent before the data.  Values are 14 bit.
+  enum { CHANNELS = 2, PIXELS = 0x800, EXTRA = 14, SATURATION = 16383 };
+  // number of data replies which can be on their way
+  enum { QUEUE = 8 };
+  source m_source;
+  // range of each channel, as set with "\010"
+  unsigned m_min[CHANNELS], m_max[CHANNELS];
+  bool m_external;
+  // counts per ms of integration, and dark level, of every pixel
+  float m_signal[PIXELS], m_dark[PIXELS];
+  // expected value of every pixel for m_time_ms, and the noise for
+  // m_average
+  float m_mean[PIXELS];
+  unsigned m_time_ms, m_average;
+  float m_gain, m_floor;
+  uint32_t m_noise[kernels::NOISE_LANES];
+  // when the running integration ends, and when the bus is free again,
+  // on the monotonic clock.  Triggers come at m_epoch + n / trigger_hz.
+  monotonic::ns m_integrated, m_bus, m_epoch;
+  // data replies which were requested, oldest first:
+  // m_queue[m_head, m_tail), modulo QUEUE
+  struct reply
+  {
+    unsigned channel;
+    monotonic::ns ready;
+  } m_queue[QUEUE];
+  unsigned m_head, m_tail;
+  bool l_load (std::string const &file);
+  void l_make_up ();
+  void l_expect (unsigned time_ms, unsigned average);
+  void l_queue (unsigned channel, monotonic::ns request);
+  unsigned l_data (char *buffer, unsigned capacity);
+};
+
+#endif // defined AVASPEC_EMULATION_HH
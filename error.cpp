@@ -20,6 +20,7 @@
  */
 
 #include "error.hpp"
+#include "trace.hpp"
 //#include <glibmm.h>
 #include <iostream>
 #include <stdexcept>
@@ -31,6 +32,8 @@ namespace shevek
   void _error_impl (std::string const &message, bool is_error)
   {
     std::cerr << (is_error ? "Error: " : "Warning: ") << message << '\n';
+    if (is_error)
+      trace::error ();
     if (is_error && _break_on_error)
       {
 		 throw std::runtime_error(message);
@@ -0,0 +1,654 @@
+/*
+ *  kernels.cpp
+ *  avaspec
+ *
+ *  Vectorized per-pixel kernels with runtime dispatch.
+ *
+ */
+
+#include "kernels.hpp"
+#include <string.h>
+#include <stdlib.h> // getenv
+#include <math.h> // sqrtf, lrintf, lrint
+
+#if defined (__x86_64__) || defined (__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+#else
+#define KERNELS_X86 0
+#endif
+
+namespace kernels
+{
+  namespace
+  {
+    // all implementations of one instruction set
+    struct table
+    {
+      char const *name;
+      bool (*decode_pixels) (char const *, unsigned short *, unsigned);
+      unsigned (*find_byte) (char const *, unsigned, char);
+      void (*synthesize) (float const *, unsigned, float, float, float,
+			  uint32_t *, char *);
+      void (*polynomial) (double const *, unsigned, unsigned, float *);
+      unsigned (*subtract_dark) (unsigned short const *, unsigned,
+				 unsigned short const *, short, short,
+				 short *);
+      void (*flat_field) (short const *, float const *, unsigned, float,
+			  float *);
+      void (*accumulate) (short const *, unsigned, int32_t *);
+    };
+
+    // scalar versions, also used for the tails of the vector versions
+
+    unsigned decode_scalar (char const *src, unsigned short *dst,
+			    unsigned count)
+    {
+      unsigned bad = 0;
+      for (unsigned i = 0; i < count; ++i)
+	{
+	  unsigned value = (src[2 * i] & 0xff)
+	    + ( (src[2 * i + 1] & 0xff) << 8);
+	  bad |= value;
+	  dst[i] = value >> 2;
+	}
+      return bad & 3;
+    }
+
+    bool decode_pixels_scalar (char const *src, unsigned short *dst,
+			       unsigned count)
+    {
+      return decode_scalar (src, dst, count) == 0;
+    }
+
+    unsigned find_byte_scalar (char const *data, unsigned size, char c)
+    {
+      void const *p = ::memchr (data, c, size);
+      return p ? static_cast <char const *> (p) - data : size;
+    }
+
+    // The noise is the sum of four uniform numbers, which is close enough
+    // to a gaussian for an emulated spectrum and needs no transcendental
+    // functions.  sqrt (3) scales it to unit variance.
+    float const SQRT3 = 1.7320508f;
+    float const TO_UNIT = 1.f / (1 << 24);
+
+    inline uint32_t xorshift (uint32_t x)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      return x;
+    }
+
+    void synthesize_scalar (float const *mean, unsigned count, float gain,
+			    float floor, float max, uint32_t *state,
+			    char *dst)
+    {
+      for (unsigned i = 0; i < count; ++i)
+	{
+	  uint32_t &s = state[i % NOISE_LANES];
+	  float u = 0;
+	  for (unsigned j = 0; j < 4; ++j)
+	    {
+	      s = xorshift (s);
+	      u += float (s >> 8) * TO_UNIT;
+	    }
+	  float value = mean[i]
+	    + ::sqrtf (gain * mean[i] + floor) * ( (u - 2) * SQRT3);
+	  value = value < 0 ? 0 : value > max ? max : value;
+	  unsigned raw = unsigned (::lrintf (value) ) << 2;
+	  dst[2 * i] = raw & 0xff;
+	  dst[2 * i + 1] = (raw >> 8) & 0xff;
+	}
+    }
+
+    // Horner's method with a separate multiply and add, also in the vector
+    // versions: with a fused multiply-add the axes would differ in the last
+    // bit between instruction sets
+    inline double horner (double const *coef, unsigned terms, double x)
+    {
+      double y = coef[terms - 1];
+      for (unsigned k = terms - 1; k > 0; --k)
+	y = y * x + coef[k - 1];
+      return y;
+    }
+
+    void polynomial_from (double const *coef, unsigned terms,
+			  unsigned first, unsigned count, float *dst)
+    {
+      for (unsigned i = first; i < count; ++i)
+	dst[i] = terms ? float (horner (coef, terms, double (i) ) ) : 0;
+    }
+
+    void polynomial_scalar (double const *coef, unsigned terms,
+			    unsigned count, float *dst)
+    {
+      polynomial_from (coef, terms, 0, count, dst);
+    }
+
+    inline unsigned short linear (unsigned short const *table,
+				  unsigned short value)
+    {
+      return table ? table[value & (LINEAR_SIZE - 1)] : value;
+    }
+
+    unsigned subtract_dark_scalar (unsigned short const *src, unsigned count,
+				   unsigned short const *table, short dark,
+				   short saturated, short *dst)
+    {
+      unsigned hits = 0;
+      for (unsigned i = 0; i < count; ++i)
+	{
+	  short value = src[i];
+	  bool full = value >= saturated;
+	  hits += full;
+	  dst[i] = full ? value : short (linear (table, src[i]) - dark);
+	}
+      return hits;
+    }
+
+    // the same order of operations in all versions, so they agree to the
+    // last bit
+    void flat_field_scalar (short const *src, float const *gain,
+			    unsigned count, float scale, float *dst)
+    {
+      for (unsigned i = 0; i < count; ++i)
+	dst[i] = float (src[i]) * gain[i] * scale;
+    }
+
+    void accumulate_scalar (short const *src, unsigned count, int32_t *sum)
+    {
+      for (unsigned i = 0; i < count; ++i)
+	sum[i] += src[i];
+    }
+
+#if KERNELS_X86
+    // x86 is little endian, so the raw words can be loaded directly.
+    bool decode_pixels_sse2 (char const *src, unsigned short *dst,
+			     unsigned count)
+    {
+      __m128i bad = _mm_setzero_si128 ();
+      unsigned i = 0;
+      for (; i + 8 <= count; i += 8)
+	{
+	  __m128i v = _mm_loadu_si128
+	    (reinterpret_cast <__m128i const *> (src + 2 * i) );
+	  bad = _mm_or_si128 (bad, v);
+	  _mm_storeu_si128 (reinterpret_cast <__m128i *> (dst + i),
+			    _mm_srli_epi16 (v, 2) );
+	}
+      bad = _mm_and_si128 (bad, _mm_set1_epi16 (3) );
+      unsigned tail = decode_scalar (src + 2 * i, dst + i, count - i);
+      return tail == 0 && _mm_movemask_epi8 (_mm_cmpeq_epi8
+					     (bad, _mm_setzero_si128 () ) )
+	== 0xffff;
+    }
+
+    TARGET_AVX2
+    bool decode_pixels_avx2 (char const *src, unsigned short *dst,
+			     unsigned count)
+    {
+      __m256i bad = _mm256_setzero_si256 ();
+      unsigned i = 0;
+      for (; i + 16 <= count; i += 16)
+	{
+	  __m256i v = _mm256_loadu_si256
+	    (reinterpret_cast <__m256i const *> (src + 2 * i) );
+	  bad = _mm256_or_si256 (bad, v);
+	  _mm256_storeu_si256 (reinterpret_cast <__m256i *> (dst + i),
+			       _mm256_srli_epi16 (v, 2) );
+	}
+      bad = _mm256_and_si256 (bad, _mm256_set1_epi16 (3) );
+      unsigned tail = decode_scalar (src + 2 * i, dst + i, count - i);
+      return tail == 0 && _mm256_testz_si256 (bad, bad);
+    }
+
+    unsigned find_byte_sse2 (char const *data, unsigned size, char c)
+    {
+      __m128i needle = _mm_set1_epi8 (c);
+      unsigned i = 0;
+      for (; i + 16 <= size; i += 16)
+	{
+	  unsigned mask = _mm_movemask_epi8 (_mm_cmpeq_epi8
+					     (_mm_loadu_si128
+					      (reinterpret_cast <__m128i const *>
+					       (data + i) ), needle) );
+	  if (mask)
+	    return i + __builtin_ctz (mask);
+	}
+      return i + find_byte_scalar (data + i, size - i, c);
+    }
+
+    TARGET_AVX2
+    unsigned find_byte_avx2 (char const *data, unsigned size, char c)
+    {
+      __m256i needle = _mm256_set1_epi8 (c);
+      unsigned i = 0;
+      for (; i + 32 <= size; i += 32)
+	{
+	  unsigned mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8
+						(_mm256_loadu_si256
+						 (reinterpret_cast
+						  <__m256i const *> (data + i) ),
+						 needle) );
+	  if (mask)
+	    return i + __builtin_ctz (mask);
+	}
+      return i + find_byte_sse2 (data + i, size - i, c);
+    }
+
+    // one lane per generator, so the results match the scalar version.
+    // Both vector versions do NOISE_LANES pixels per step.
+    inline __m128i xorshift_sse2 (__m128i x)
+    {
+      x = _mm_xor_si128 (x, _mm_slli_epi32 (x, 13) );
+      x = _mm_xor_si128 (x, _mm_srli_epi32 (x, 17) );
+      return _mm_xor_si128 (x, _mm_slli_epi32 (x, 5) );
+    }
+
+    inline __m128i noise_sse2 (__m128i &s, __m128 m, __m128 gain,
+			       __m128 floor, __m128 max)
+    {
+      __m128 u = _mm_setzero_ps ();
+      for (unsigned j = 0; j < 4; ++j)
+	{
+	  s = xorshift_sse2 (s);
+	  u = _mm_add_ps (u, _mm_mul_ps (_mm_cvtepi32_ps
+					 (_mm_srli_epi32 (s, 8) ),
+					 _mm_set1_ps (TO_UNIT) ) );
+	}
+      __m128 n = _mm_mul_ps (_mm_sub_ps (u, _mm_set1_ps (2) ),
+			     _mm_set1_ps (SQRT3) );
+      __m128 v = _mm_add_ps (m, _mm_mul_ps (_mm_sqrt_ps
+					     (_mm_add_ps (_mm_mul_ps (gain, m),
+							  floor) ), n) );
+      v = _mm_min_ps (_mm_max_ps (v, _mm_setzero_ps () ), max);
+      return _mm_slli_epi32 (_mm_cvtps_epi32 (v), 2);
+    }
+
+    void synthesize_sse2 (float const *mean, unsigned count, float gain,
+			  float floor, float max, uint32_t *state, char *dst)
+    {
+      __m128i *lanes = reinterpret_cast <__m128i *> (state);
+      __m128i s0 = _mm_loadu_si128 (lanes), s1 = _mm_loadu_si128 (lanes + 1);
+      __m128 g = _mm_set1_ps (gain), f = _mm_set1_ps (floor),
+	top = _mm_set1_ps (max);
+      // there is no unsigned 32 to 16 bit pack in sse2: shift the range
+      // into the signed one and back
+      __m128i bias32 = _mm_set1_epi32 (0x8000),
+	bias16 = _mm_set1_epi16 (short (0x8000) );
+      unsigned i = 0;
+      for (; i + NOISE_LANES <= count; i += NOISE_LANES)
+	{
+	  __m128i lo = noise_sse2 (s0, _mm_loadu_ps (mean + i), g, f, top);
+	  __m128i hi = noise_sse2 (s1, _mm_loadu_ps (mean + i + 4), g, f, top);
+	  __m128i packed = _mm_xor_si128 (_mm_packs_epi32
+					  (_mm_sub_epi32 (lo, bias32),
+					   _mm_sub_epi32 (hi, bias32) ),
+					  bias16);
+	  _mm_storeu_si128 (reinterpret_cast <__m128i *> (dst + 2 * i),
+			    packed);
+	}
+      _mm_storeu_si128 (lanes, s0);
+      _mm_storeu_si128 (lanes + 1, s1);
+      synthesize_scalar (mean + i, count - i, gain, floor, max, state,
+			 dst + 2 * i);
+    }
+
+    TARGET_AVX2
+    void synthesize_avx2 (float const *mean, unsigned count, float gain,
+			  float floor, float max, uint32_t *state, char *dst)
+    {
+      __m256i *lanes = reinterpret_cast <__m256i *> (state);
+      __m256i s = _mm256_loadu_si256 (lanes);
+      __m256 g = _mm256_set1_ps (gain), f = _mm256_set1_ps (floor),
+	top = _mm256_set1_ps (max), unit = _mm256_set1_ps (TO_UNIT);
+      unsigned i = 0;
+      for (; i + NOISE_LANES <= count; i += NOISE_LANES)
+	{
+	  __m256 m = _mm256_loadu_ps (mean + i);
+	  __m256 u = _mm256_setzero_ps ();
+	  for (unsigned j = 0; j < 4; ++j)
+	    {
+	      s = _mm256_xor_si256 (s, _mm256_slli_epi32 (s, 13) );
+	      s = _mm256_xor_si256 (s, _mm256_srli_epi32 (s, 17) );
+	      s = _mm256_xor_si256 (s, _mm256_slli_epi32 (s, 5) );
+	      u = _mm256_add_ps (u, _mm256_mul_ps (_mm256_cvtepi32_ps
+						   (_mm256_srli_epi32 (s, 8) ),
+						   unit) );
+	    }
+	  __m256 n = _mm256_mul_ps (_mm256_sub_ps (u, _mm256_set1_ps (2) ),
+				    _mm256_set1_ps (SQRT3) );
+	  __m256 v = _mm256_add_ps (m, _mm256_mul_ps
+				    (_mm256_sqrt_ps (_mm256_add_ps
+						     (_mm256_mul_ps (g, m), f) ),
+				     n) );
+	  v = _mm256_min_ps (_mm256_max_ps (v, _mm256_setzero_ps () ), top);
+	  __m256i raw = _mm256_slli_epi32 (_mm256_cvtps_epi32 (v), 2);
+	  _mm_storeu_si128 (reinterpret_cast <__m128i *> (dst + 2 * i),
+			    _mm_packus_epi32 (_mm256_castsi256_si128 (raw),
+					      _mm256_extracti128_si256 (raw,
+									1) ) );
+	}
+      _mm256_storeu_si256 (lanes, s);
+      synthesize_scalar (mean + i, count - i, gain, floor, max, state,
+			 dst + 2 * i);
+    }
+
+    // x counts up in steps of the vector width; integers are exact in a
+    // double, so every lane sees the same x as the scalar version
+    void polynomial_sse2 (double const *coef, unsigned terms,
+			  unsigned count, float *dst)
+    {
+      unsigned i = 0;
+      if (terms)
+	{
+	  __m128d x = _mm_set_pd (1, 0), step = _mm_set1_pd (2);
+	  for (; i + 2 <= count; i += 2)
+	    {
+	      __m128d y = _mm_set1_pd (coef[terms - 1]);
+	      for (unsigned k = terms - 1; k > 0; --k)
+		y = _mm_add_pd (_mm_mul_pd (y, x), _mm_set1_pd (coef[k - 1]) );
+	      _mm_storel_pi (reinterpret_cast <__m64 *> (dst + i),
+			     _mm_cvtpd_ps (y) );
+	      x = _mm_add_pd (x, step);
+	    }
+	}
+      polynomial_from (coef, terms, i, count, dst);
+    }
+
+    TARGET_AVX2
+    void polynomial_avx2 (double const *coef, unsigned terms,
+			  unsigned count, float *dst)
+    {
+      unsigned i = 0;
+      if (terms)
+	{
+	  __m256d x = _mm256_set_pd (3, 2, 1, 0), step = _mm256_set1_pd (4);
+	  for (; i + 4 <= count; i += 4)
+	    {
+	      __m256d y = _mm256_set1_pd (coef[terms - 1]);
+	      for (unsigned k = terms - 1; k > 0; --k)
+		y = _mm256_add_pd (_mm256_mul_pd (y, x),
+				   _mm256_set1_pd (coef[k - 1]) );
+	      _mm_storeu_ps (dst + i, _mm256_cvtpd_ps (y) );
+	      x = _mm256_add_pd (x, step);
+	    }
+	}
+      polynomial_from (coef, terms, i, count, dst);
+    }
+
+    // the pixels are compared as signed, like in the scalar version.  sse2
+    // has no gather; the table lookups are done one by one.
+    unsigned subtract_dark_sse2 (unsigned short const *src, unsigned count,
+				 unsigned short const *table, short dark,
+				 short saturated, short *dst)
+    {
+      __m128i d = _mm_set1_epi16 (dark),
+	limit = _mm_set1_epi16 (short (saturated - 1) );
+      unsigned hits = 0, i = 0;
+      for (; i + 8 <= count; i += 8)
+	{
+	  __m128i v = _mm_loadu_si128
+	    (reinterpret_cast <__m128i const *> (src + i) );
+	  __m128i full = _mm_cmpgt_epi16 (v, limit);
+	  __m128i c = v;
+	  if (table)
+	    c = _mm_set_epi16 (linear (table, src[i + 7]),
+			       linear (table, src[i + 6]),
+			       linear (table, src[i + 5]),
+			       linear (table, src[i + 4]),
+			       linear (table, src[i + 3]),
+			       linear (table, src[i + 2]),
+			       linear (table, src[i + 1]),
+			       linear (table, src[i]) );
+	  // saturated pixels keep their raw value
+	  c = _mm_or_si128 (_mm_and_si128 (full, v),
+			    _mm_andnot_si128 (full, _mm_sub_epi16 (c, d) ) );
+	  _mm_storeu_si128 (reinterpret_cast <__m128i *> (dst + i), c);
+	  // two mask bits per pixel
+	  hits += __builtin_popcount (_mm_movemask_epi8 (full) ) / 2;
+	}
+      return hits + subtract_dark_scalar (src + i, count - i, table, dark,
+					  saturated, dst + i);
+    }
+
+    // the table is gathered as 32 bit words at 16 bit offsets, which is
+    // why it has a spare entry at the end; the upper halves are dropped
+    TARGET_AVX2
+    inline __m256i gather_avx2 (unsigned short const *table, __m256i v)
+    {
+      int const *base = reinterpret_cast <int const *> (table);
+      __m256i index = _mm256_and_si256 (v, _mm256_set1_epi16
+					(LINEAR_SIZE - 1) );
+      __m256i low16 = _mm256_set1_epi32 (0xffff);
+      __m256i lo = _mm256_and_si256 (_mm256_i32gather_epi32
+				     (base, _mm256_cvtepu16_epi32
+				      (_mm256_castsi256_si128 (index) ), 2),
+				     low16);
+      __m256i hi = _mm256_and_si256 (_mm256_i32gather_epi32
+				     (base, _mm256_cvtepu16_epi32
+				      (_mm256_extracti128_si256 (index, 1) ),
+				      2), low16);
+      // the pack works per 128 bit lane
+      return _mm256_permute4x64_epi64 (_mm256_packus_epi32 (lo, hi), 0xd8);
+    }
+
+    TARGET_AVX2
+    unsigned subtract_dark_avx2 (unsigned short const *src, unsigned count,
+				 unsigned short const *table, short dark,
+				 short saturated, short *dst)
+    {
+      __m256i d = _mm256_set1_epi16 (dark),
+	limit = _mm256_set1_epi16 (short (saturated - 1) );
+      unsigned hits = 0, i = 0;
+      for (; i + 16 <= count; i += 16)
+	{
+	  __m256i v = _mm256_loadu_si256
+	    (reinterpret_cast <__m256i const *> (src + i) );
+	  __m256i full = _mm256_cmpgt_epi16 (v, limit);
+	  __m256i c = table ? gather_avx2 (table, v) : v;
+	  _mm256_storeu_si256 (reinterpret_cast <__m256i *> (dst + i),
+			       _mm256_blendv_epi8 (_mm256_sub_epi16 (c, d), v,
+						   full) );
+	  hits += __builtin_popcount (_mm256_movemask_epi8 (full) ) / 2;
+	}
+      return hits + subtract_dark_sse2 (src + i, count - i, table, dark,
+					saturated, dst + i);
+    }
+
+    void flat_field_sse2 (short const *src, float const *gain,
+			  unsigned count, float scale, float *dst)
+    {
+      __m128 s = _mm_set1_ps (scale);
+      unsigned i = 0;
+      for (; i + 8 <= count; i += 8)
+	{
+	  __m128i v = _mm_loadu_si128
+	    (reinterpret_cast <__m128i const *> (src + i) );
+	  // sign extend by shifting the words into the upper halves
+	  __m128 lo = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16
+						       (v, v), 16) );
+	  __m128 hi = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16
+						       (v, v), 16) );
+	  _mm_storeu_ps (dst + i, _mm_mul_ps (_mm_mul_ps
+					       (lo, _mm_loadu_ps (gain + i) ),
+					       s) );
+	  _mm_storeu_ps (dst + i + 4, _mm_mul_ps (_mm_mul_ps
+						   (hi, _mm_loadu_ps
+						    (gain + i + 4) ), s) );
+	}
+      flat_field_scalar (src + i, gain + i, count - i, scale, dst + i);
+    }
+
+    TARGET_AVX2
+    void flat_field_avx2 (short const *src, float const *gain,
+			  unsigned count, float scale, float *dst)
+    {
+      __m256 s = _mm256_set1_ps (scale);
+      unsigned i = 0;
+      for (; i + 8 <= count; i += 8)
+	{
+	  __m256 v = _mm256_cvtepi32_ps (_mm256_cvtepi16_epi32
+					 (_mm_loadu_si128
+					  (reinterpret_cast <__m128i const *>
+					   (src + i) ) ) );
+	  _mm256_storeu_ps (dst + i, _mm256_mul_ps (_mm256_mul_ps
+						     (v, _mm256_loadu_ps
+						      (gain + i) ), s) );
+	}
+      flat_field_scalar (src + i, gain + i, count - i, scale, dst + i);
+    }
+
+    void accumulate_sse2 (short const *src, unsigned count, int32_t *sum)
+    {
+      unsigned i = 0;
+      for (; i + 8 <= count; i += 8)
+	{
+	  __m128i v = _mm_loadu_si128
+	    (reinterpret_cast <__m128i const *> (src + i) );
+	  __m128i *s = reinterpret_cast <__m128i *> (sum + i);
+	  // sign extend like in flat_field_sse2
+	  _mm_storeu_si128 (s, _mm_add_epi32 (_mm_loadu_si128 (s),
+					      _mm_srai_epi32 (_mm_unpacklo_epi16
+							      (v, v), 16) ) );
+	  _mm_storeu_si128 (s + 1, _mm_add_epi32 (_mm_loadu_si128 (s + 1),
+						  _mm_srai_epi32
+						  (_mm_unpackhi_epi16 (v, v),
+						   16) ) );
+	}
+      accumulate_scalar (src + i, count - i, sum + i);
+    }
+
+    TARGET_AVX2
+    void accumulate_avx2 (short const *src, unsigned count, int32_t *sum)
+    {
+      unsigned i = 0;
+      for (; i + 8 <= count; i += 8)
+	{
+	  __m256i *s = reinterpret_cast <__m256i *> (sum + i);
+	  _mm256_storeu_si256 (s, _mm256_add_epi32
+			       (_mm256_loadu_si256 (s), _mm256_cvtepi16_epi32
+				(_mm_loadu_si128
+				 (reinterpret_cast <__m128i const *>
+				  (src + i) ) ) ) );
+	}
+      accumulate_scalar (src + i, count - i, sum + i);
+    }
+#endif
+
+    table select ()
+    {
+      table t = { "scalar", decode_pixels_scalar, find_byte_scalar,
+		  synthesize_scalar, polynomial_scalar, subtract_dark_scalar,
+		  flat_field_scalar, accumulate_scalar };
+#if KERNELS_X86
+      // AVASPEC_ISA limits the choice, to compare the versions
+      char const *limit = ::getenv ("AVASPEC_ISA");
+      bool scalar = limit && !::strcmp (limit, "scalar");
+      bool sse2 = limit && !::strcmp (limit, "sse2");
+      __builtin_cpu_init ();
+      if (!scalar && __builtin_cpu_supports ("sse2") )
+	{
+	  t.name = "sse2";
+	  t.decode_pixels = decode_pixels_sse2;
+	  t.find_byte = find_byte_sse2;
+	  t.synthesize = synthesize_sse2;
+	  t.polynomial = polynomial_sse2;
+	  t.subtract_dark = subtract_dark_sse2;
+	  t.flat_field = flat_field_sse2;
+	  t.accumulate = accumulate_sse2;
+	}
+      if (!scalar && !sse2 && __builtin_cpu_supports ("avx2") )
+	{
+	  t.name = "avx2";
+	  t.decode_pixels = decode_pixels_avx2;
+	  t.find_byte = find_byte_avx2;
+	  t.synthesize = synthesize_avx2;
+	  t.polynomial = polynomial_avx2;
+	  t.subtract_dark = subtract_dark_avx2;
+	  t.flat_field = flat_field_avx2;
+	  t.accumulate = accumulate_avx2;
+	}
+#endif
+      return t;
+    }
+
+    table const &dispatch ()
+    {
+      static table const t = select ();
+      return t;
+    }
+  }
+
+  bool decode_pixels (char const *src, unsigned short *dst, unsigned count)
+  {
+    return dispatch ().decode_pixels (src, dst, count);
+  }
+
+  unsigned find_byte (char const *data, unsigned size, char c)
+  {
+    return dispatch ().find_byte (data, size, c);
+  }
+
+  void synthesize (float const *mean, unsigned count, float gain,
+		   float floor, float max, uint32_t *state, char *dst)
+  {
+    dispatch ().synthesize (mean, count, gain, floor, max, state, dst);
+  }
+
+  void polynomial (double const *coef, unsigned terms, unsigned count,
+		   float *dst)
+  {
+    dispatch ().polynomial (coef, terms, count, dst);
+  }
+
+  unsigned subtract_dark (unsigned short const *src, unsigned count,
+			  unsigned short const *extra, unsigned extra_count,
+			  unsigned short const *table, short saturated,
+			  short *dst)
+  {
+    // 14 bit pixels overflow a short after a few additions
+    int32_t sum = 0;
+    for (unsigned i = 0; i < extra_count; ++i)
+      sum += linear (table, extra[i]);
+    short dark = extra_count ? short (sum / int32_t (extra_count) ) : 0;
+    return dispatch ().subtract_dark (src, count, table, dark, saturated,
+				      dst);
+  }
+
+  void linear_table (double const *coef, unsigned terms,
+		     unsigned short *table)
+  {
+    // the correction factor for every count, computed like the
+    // wavelengths
+    float factor[LINEAR_SIZE];
+    polynomial (coef, terms, LINEAR_SIZE, factor);
+    for (unsigned i = 0; i < LINEAR_SIZE; ++i)
+      {
+	double value = factor[i] > 0 ? i / double (factor[i]) : i;
+	// keep it a positive short
+	table[i] = value < 0 ? 0 : value > 0x7fff ? 0x7fff
+	  : (unsigned short) (::lrint (value) );
+      }
+    table[LINEAR_SIZE] = table[LINEAR_SIZE - 1];
+  }
+
+  void flat_field (short const *src, float const *gain, unsigned count,
+		   float scale, float *dst)
+  {
+    dispatch ().flat_field (src, gain, count, scale, dst);
+  }
+
+  void accumulate (short const *src, unsigned count, int32_t *sum)
+  {
+    dispatch ().accumulate (src, count, sum);
+  }
+
+  char const *isa ()
+  {
+    return dispatch ().name;
+  }
+}
@@ -0,0 +1,73 @@
+/*
+ *  kernels.hpp
+ *  avaspec
+ *
+ *  Vectorized per-pixel kernels.  Every kernel has a scalar version and,
+ *  on x86, SSE2 and AVX2 versions which are selected at runtime from what
+ *  the cpu supports.
+ *
+ */
+
+#ifndef AVASPEC_KERNELS_HH
+#define AVASPEC_KERNELS_HH
+
+#include <stdint.h>
+
+namespace kernels
+{
+  // Convert count raw pixels (little endian 16 bit words, as sent by the
+  // device) at src to counts in dst.  The device sends all values
+  // multiplied by 4; they are divided here.  Returns false if any of the
+  // raw values was not a multiple of 4.  dst is written completely in
+  // either case.  src need not be aligned.
+  bool decode_pixels (char const *src, unsigned short *dst, unsigned count);
+  // Index of the first byte in data[0, size) which equals c, or size if
+  // there is none.
+  unsigned find_byte (char const *data, unsigned size, char c);
+  // Make count raw pixels at dst (encoded like the device does, see
+  // decode_pixels) from the expected counts at mean, with gaussian noise
+  // of variance gain * mean + floor, clipped to [0, max].  The noise comes
+  // from NOISE_LANES xorshift generators in state, which must not be 0;
+  // pixel i uses generator i % NOISE_LANES, so the result does not
+  // depend on the instruction set.  Used by the emulation.
+  enum { NOISE_LANES = 8 };
+  void synthesize (float const *mean, unsigned count, float gain,
+		   float floor, float max, uint32_t *state, char *dst);
+  // dst[i] = coef[0] + coef[1] * i + ... + coef[terms - 1] * i^(terms - 1)
+  // for i in [0, count), evaluated in double precision and rounded to
+  // float.  The result does not depend on the instruction set.
+  void polynomial (double const *coef, unsigned terms, unsigned count,
+		   float *dst);
+  // The dynamic dark correction of a spectrum: the dark level is the mean
+  // of the extra_count pixels at extra (0 if there are none), and dst[i]
+  // is src[i] minus that level.  Pixels at or above saturated are copied
+  // unchanged instead, because their true value is unknown.  If table is
+  // not 0, it is a nonlinearity table (see linear_table) which is applied
+  // to all pixels, including the extra ones, before the dark level is
+  // subtracted.  Returns the number of saturated pixels.
+  unsigned subtract_dark (unsigned short const *src, unsigned count,
+			  unsigned short const *extra, unsigned extra_count,
+			  unsigned short const *table, short saturated,
+			  short *dst);
+  // Fill table, which must have room for LINEAR_SIZE + 1 entries, with the
+  // nonlinearity correction of every 14 bit count: count / f (count),
+  // where f is the polynomial with terms coefficients at coef (lowest
+  // order first).  Where f is not positive the count is kept.
+  enum { LINEAR_SIZE = 1 << 14 };
+  void linear_table (double const *coef, unsigned terms,
+		     unsigned short *table);
+  // The flat field correction of a spectrum: dst[i] = src[i] * gain[i] *
+  // scale.  gain is the reciprocal of the detector response per pixel,
+  // scale the ratio of the integration times of the response and the
+  // spectrum.
+  void flat_field (short const *src, float const *gain, unsigned count,
+		   float scale, float *dst);
+  // sum[i] += src[i], for co-adding spectra
+  void accumulate (short const *src, unsigned count, int32_t *sum);
+  // name of the instruction set which was selected ("scalar", "sse2",
+  // "avx2").  The environment variable AVASPEC_ISA set to "scalar" or
+  // "sse2" keeps the selection from going beyond that.
+  char const *isa ();
+}
+
+#endif // defined AVASPEC_KERNELS_HH
@@ -9,96 +9,136 @@
 
 //#include "libavaspec.h"
 
-#include "avaspec.hpp"
+#include "multispec.hpp"
+#include "kernels.hpp"
+#include "error.hpp"
 #include <pthread.h>
 #include <math.h>
+#include <string.h>
 #include <vector>
+#include <algorithm>
 #include <map>
+#include <string>
 #include <iostream>
 //#include <boost/array.hpp>
 
 // export these functions
 #include "libavaspec.h"
 
-class multispec : public avaspec {
-public:
-    pthread_t m_multispec_thread;
-    bool      m_multispec_cancel;
-    bool      m_dynamic_dark;
-    bool      m_cancelled;
-    unsigned int m_max_spectra;
-    pthread_t m_dacq_thread;
-    bool      m_dacq_thread_running;
-        
-    std::vector< short > m_dark;
-    
-    std::vector< std::vector< short > >   m_spectra;
-
-    static const unsigned kProduct = 0x0471;
-    static const unsigned kVendor  = 0x0666;
-
-    multispec(int skip, float integration_time, int average, int dynamic_dark, size_t max_spectra);
-    multispec(int skip, float integration_time, int average, int dynamic_dark, size_t spectra, int raw);
-    
-    ~multispec(void);
-    
-    std::vector<float>   get_wavelengths(unsigned chan);
-    std::vector<short>   get_spectrum(unsigned chan);
-    bool            run_dacq(void);
-    std::vector< std::vector< short > > run_dacq_no_trig(void);
-
-    bool            stop_dacq(void);
-
-};
+std::vector<float> const &multispec::get_wavelengths(unsigned chan) const
+{
+    // computed by avaspec when the calibration changes
+    return (*this)[chan].wavelengths();
+}
 
+std::vector<short> multispec::get_spectrum(unsigned chan)
+{
+    std::vector<short> y(num_pixels());
+    get_spectrum(chan, &y[0]);
+    return y;
+}
 
+// write the spectrum to y, which has room for num_pixels() values
+unsigned multispec::get_spectrum(unsigned chan, short *y)
+{
+    avaspec::channel const &c = (*this)[chan];
+    
+    // only the pixels in the range were measured
+    unsigned first = std::min(c.get_range_min(), num_pixels());
+    unsigned last = std::max(first, std::min(c.get_range_max(), num_pixels()));
+    std::fill(y, y + first, 0);
+    std::fill(y + last, y + num_pixels(), 0);
+    
+    unsigned extra = m_dynamic_dark ? extra_pixels() : 0;
+    unsigned short const *table = m_nonlinear ? c.linear_table() : 0;
+    unsigned full_scale = kernels::subtract_dark(c.data(), last - first,
+                                                 c.extra_data(), extra, table,
+                                                 kSaturated, y + first);
+    // the kernel counts them on the way, for the stats
+    saturated(full_scale);
+    return full_scale;
+}
 
-std::vector<float> multispec::get_wavelengths(unsigned chan)
+void multispec::take_spectrum(short *target)
 {
-    std::vector<float> cal;	
-    
-    for (int i=0; i<5 ;i++) cal.push_back(get_calibration(chan,i));
-    
-    std::vector<float> x(num_pixels());
-    
-    for (unsigned i = 0; i != num_pixels(); ++i) {
-        unsigned i2 = i*i;
-        x[i]=cal[0]+cal[1]*i+cal[2]*(i2)+(cal[3]*i)*(i2)+(cal[4]*i2)*i2;	
+    if (m_roi.identity()) {
+        get_spectrum(0, target);
+    } else {
+        get_spectrum(0, &m_full[0]);
+        m_roi.apply(&m_full[0], target);
     }
-    
-    return x;
 }
 
-std::vector<short> multispec::get_spectrum(unsigned chan)
+bool multispec::flat_field(unsigned chan, short const *y, float *target) const
 {
-    short dd = 0;
+    if (chan != 0 || !m_gain.size()) return false;
+    avaspec::channel const &c = (*this)[chan];
+    float const *gain = reinterpret_cast<float const *>(m_gain.data());
     
-    if ((m_dynamic_dark) && (extra_pixels()!=0)) {
-        for (unsigned i = 0; i != extra_pixels(); ++i) dd += (*this)[chan].extra(i);
-        dd /= extra_pixels();
-    }
+    // without a time for the response, only its shape is corrected
+    double scale = 1;
+    monotonic::ns ijk = monotonic::from(c.ijktime());
+    monotonic::ns now = monotonic::from(get_integration_time());
+    if (ijk > 0 && now > 0) scale = double(ijk) / now;
     
-    std::vector<short> y(num_pixels());
-    
-    for (unsigned i = 0; i != num_pixels(); ++i) {
-        short val=(*this)[chan][i];
-        y[i]=(val < (1 << 14)) ? val-dd : val;
-    }
-    
-    return y;
+    kernels::flat_field(y, gain, m_roi.size(), float(scale), target);
+    return true;
 }
 
 static void * StartDacqThread(void *vp)
 {
     multispec *sp = reinterpret_cast<multispec *>(vp);
     
-    sp->run_dacq();
+    // an exception must not leave the thread.  Only errors which end the
+    // acquisition throw; bad frames are counted and skipped.
+    try {
+        sp->run_dacq();
+    } catch (...) {
+        sp->m_cancelled = true;
+    }
     
     return NULL;
 }
 
-multispec::multispec(int skip, float integration_time, int average, int dynamic_dark, size_t max_spectra) :
-     avaspec("",kProduct,kVendor,skip) 
+// fill in the usb ids if the device is on usb
+avaspec::source multispec::locate(int skip, avaspec::source where)
+{
+    if (where.type == avaspec::source::USB) {
+        // same order as the usb constructor was always called with
+        where.vendor = kProduct;
+        where.product = kVendor;
+        where.skip = skip;
+    }
+    return where;
+}
+
+// the regions of interest of channel 0, the one which is stored
+static region_map make_roi(init_options const &options, avaspec const &device)
+{
+    region_map roi;
+    region_map::ranges keep;
+    roi_options const &o = options.roi;
+    if (!o.ranges.empty()) {
+        if (o.wavelengths)
+            keep = region_map::from_wavelengths(o.ranges,
+                                                device[0].wavelengths());
+        else
+            keep = region_map::from_pixels(o.ranges, device.num_pixels());
+        if (keep.empty())
+            shevek_warning("no pixels in the regions of interest, storing all");
+    }
+    roi.setup(keep, o.bin, device.num_pixels());
+    return roi;
+}
+
+multispec::multispec(int skip, float integration_time, int average, int corrections, size_t max_spectra,
+                     init_options const &options) :
+     avaspec("",locate(skip, options.where)),
+     m_roi(make_roi(options, *this)),
+     m_spectra(max_spectra, m_roi.size(), options.huge_pages,
+               options.spool.empty() ? 0 : options.spool.c_str(),
+               options.spill),
+     m_counted(~0u)
 {
     
     // change the settings
@@ -114,18 +154,60 @@ multispec::multispec(int skip, float integration_time, int average, int dynamic_
     m_cancel_read = false;
     m_cancelled = false;
     m_max_spectra = max_spectra;
+    m_dynamic_dark = (corrections & CORRECT_DYNAMIC_DARK) != 0;
+    m_nonlinear = (corrections & CORRECT_NONLINEAR) != 0;
+    m_pipelined = options.pipelined;
+    m_dacq_thread_running = false;
+    m_in_reactor = false;
+    m_state = DONE;
+    m_frame = 0;
+    m_dropped_reset = 0;
+    m_coadd.setup(options.coadd, m_roi.size(), options.clip);
+    m_full.resize(num_pixels());
+    float const *gain = (*this)[0].flat_field();
+    if (gain) {
+        // Only the mean of the pixels of a bin is stored, so it is divided
+        // by the mean of their responses.  That is exact where the
+        // spectrum follows the response within the bin, as for the light
+        // the response was measured with; the mean of the gains is not.
+        std::vector<float> response(num_pixels());
+        for (unsigned i = 0; i < response.size(); ++i)
+            response[i] = gain[i] != 0 ? 1 / gain[i] : 0;
+        m_gain.reserve(m_roi.size() * sizeof(float));
+        m_gain.resize(m_roi.size() * sizeof(float));
+        float *g = reinterpret_cast<float *>(m_gain.data());
+        m_roi.apply(&response[0], g);
+        for (unsigned i = 0; i < m_roi.size(); ++i)
+            g[i] = g[i] != 0 ? 1 / g[i] : 0;
+    }
     
+    // the device only sends the range which holds all stored pixels,
+    // which shortens the readout
     avaspec::channel *cp = &(*this)[0];
-    cp->set_range (cp->get_range_min (), cp->get_range_max ());
-    
-    if (0 == pthread_create(&m_dacq_thread,NULL,StartDacqThread,reinterpret_cast<void *>(this))) {
+    if (m_roi.identity())
+        cp->set_range (cp->get_range_min (), cp->get_range_max ());
+    else
+        cp->set_range (m_roi.first (), m_roi.last ());
+    
+    if (options.event_loop && !polls())
+        shevek_warning("device can't be polled, it gets its own thread");
+    if (options.event_loop && polls()) {
+        // the same steps as run_dacq, starting with the background
+        external_trigger(false);
+        start_read();
+        m_state = DARK;
+        m_in_reactor = true;
+        reactor::shared().add(this);
+    } else if (0 == pthread_create(&m_dacq_thread,NULL,StartDacqThread,reinterpret_cast<void *>(this))) {
         m_dacq_thread_running = true;
     }
 }
 
-multispec::multispec(int skip, float integration_time, int average, int dynamic_dark, 
+multispec::multispec(int skip, float integration_time, int average, int corrections, 
                      size_t max_spectra, int raw):
-avaspec("",kProduct,kVendor,skip) 
+avaspec("",kProduct,kVendor,skip),
+m_spectra(0, 0),
+m_counted(~0u)
 {
     
     // change the settings
@@ -141,6 +223,15 @@ avaspec("",kProduct,kVendor,skip)
     m_cancel_read = false;
     m_cancelled = false;
     m_max_spectra = max_spectra;
+    m_dynamic_dark = (corrections & CORRECT_DYNAMIC_DARK) != 0;
+    m_nonlinear = (corrections & CORRECT_NONLINEAR) != 0;
+    m_pipelined = false;
+    m_dacq_thread_running = false;
+    m_in_reactor = false;
+    m_state = DONE;
+    m_frame = 0;
+    m_dropped_reset = 0;
+    m_roi.setup(region_map::ranges(), 1, num_pixels());
     
     avaspec::channel *cp = &(*this)[0];
     cp->set_range (cp->get_range_min (), cp->get_range_max ());
@@ -152,6 +243,7 @@ avaspec("",kProduct,kVendor,skip)
 
 multispec::~multispec(void)
 {
+    if (m_in_reactor) reactor::shared().remove(this);
     if (m_dacq_thread_running) {
         void *result;
         pthread_cancel(m_dacq_thread);
@@ -163,8 +255,21 @@ multispec::~multispec(void)
 bool multispec::stop_dacq(void)
 {
     void * result;
+    if (m_in_reactor) {
+        reactor::shared().remove(this);
+        m_in_reactor = false;
+        // nobody polls the measurement which was running any more
+        abandon_read();
+        if (m_state != DONE) {
+            // like run_dacq when it is cancelled
+            if (m_state == DATA) flush_coadd(m_frame);
+            m_state = DONE;
+            m_cancelled = true;
+        }
+        return !m_cancelled;
+    }
     if (!m_dacq_thread_running) return false;
-    m_cancel_read = true;
+    cancel_read();
     
     pthread_join(m_dacq_thread, &result);
     
@@ -195,7 +300,8 @@ bool multispec::run_dacq(void)
     start_read();
     end_read();
     
-    m_dark = get_spectrum(0);
+    m_dark.resize(m_roi.size());
+    take_spectrum(&m_dark[0]);
     
 //  now do the data spectra
     
@@ -203,23 +309,190 @@ bool multispec::run_dacq(void)
     
     for (unsigned i=0;i<m_max_spectra;i++) {
 //        std::cout<<"taking spectrum."<<std::endl;
-        start_read();
-        if (run_read_async()) {
-            m_spectra.push_back(get_spectrum(0));
-        } else {
+        // when pipelined, run_read_async arms the next frame as soon as
+        // this one is read out, so the device integrates (or waits for
+        // the next trigger) while we process this one.
+        if (i == 0 || !m_pipelined) start_read();
+        bool rearm = m_pipelined && (i + 1 < m_max_spectra);
+        if (!run_read_async(rearm)) {
+            // a shot usually ends like this, with Stop
+            flush_coadd(i);
             m_cancelled = true;
             return false;
         }
+        // counted in the stats, nothing to store
+        if (!frame_ok()) continue;
+        store_frame(i);
     }
+    flush_coadd(m_max_spectra);
     return true;
 }
 
+void multispec::store_frame(unsigned frame)
+{
+    if (m_coadd.frames() > 1) {
+        take_spectrum(m_coadd.next());
+        if (!m_coadd.add()) return;
+    }
+    publish_spectrum(frame);
+}
+
+void multispec::flush_coadd(unsigned frame)
+{
+    if (m_coadd.pending()) publish_spectrum(frame);
+}
+
+void multispec::publish_spectrum(unsigned frame)
+{
+    // if the reader is too slow, the spectrum is dropped; the
+    // acquisition never waits for it
+    short *slot = m_spectra.claim();
+    if (slot) {
+        if (m_coadd.frames() > 1) m_coadd.result(slot);
+        else take_spectrum(slot);
+        m_spectra.publish();
+        published();
+    } else {
+        m_coadd.clear();
+        trace_event("dropped", frame, 0);
+    }
+}
+
+unsigned multispec::fds(struct pollfd *fds, unsigned max)
+{
+    return poll_fds(fds, max);
+}
+
+monotonic::ns multispec::deadline(void)
+{
+    return read_deadline();
+}
+
+// one step of run_dacq, for the reactor: it is called when data may have
+// arrived, and returns false when the acquisition is over.  Nothing in
+// here waits for the device, so one slow device doesn't hold up the
+// others: replies are only taken by poll_read when they are there.
+bool multispec::step(void)
+{
+    try {
+        if (!poll_read()) return true;
+        if (m_state == DARK) {
+            m_dark.resize(m_roi.size());
+            take_spectrum(&m_dark[0]);
+            send_external_trigger(true);
+            m_state = TRIGGER;
+            return true;
+        }
+        if (m_state == TRIGGER) {
+            m_state = DATA;
+            m_frame = 0;
+            if (m_max_spectra == 0) {
+                m_state = DONE;
+                return false;
+            }
+            start_read();
+            return true;
+        }
+        bool more = ++m_frame < m_max_spectra;
+        // like run_read_async's rearm
+        if (more && m_pipelined) start_read();
+        // a bad frame is counted in the stats, there is nothing to store
+        if (frame_ok()) store_frame(m_frame - 1);
+        if (!more) {
+            flush_coadd(m_frame);
+            m_state = DONE;
+            return false;
+        }
+        if (!m_pipelined) start_read();
+        return true;
+    } catch (...) {
+        m_cancelled = true;
+        m_state = DONE;
+        return false;
+    }
+}
+
 static std::map< int , multispec * > gSpects;
+static std::map< int , init_options > gOptions;
+
+void Pipeline(int spect, int enable)
+{
+    gOptions[spect].pipelined = (enable != 0);
+}
+
+void EventLoop(int spect, int enable)
+{
+    gOptions[spect].event_loop = (enable != 0);
+}
+
+int Source(int spect, char const *descr)
+{
+    avaspec::source where;
+    if (!where.parse(descr ? descr : "usb"))
+        return -1;
+    where.record = gOptions[spect].where.record;
+    gOptions[spect].where = where;
+    return 0;
+}
+
+void Record(int spect, char const *path)
+{
+    gOptions[spect].where.record = path ? path : "";
+}
+
+void CoAdd(int spect, unsigned frames, float clip_sigma)
+{
+    gOptions[spect].coadd = frames ? frames : 1;
+    gOptions[spect].clip = clip_sigma;
+}
+
+int Roi(int spect, int chan, float const *ranges, int count,
+        int in_wavelengths, int bin)
+{
+    // only channel 0 is stored
+    if (chan != 0 || count < 0 || (count > 0 && !ranges) || bin < 1)
+        return -1;
+    roi_options &o = gOptions[spect].roi;
+    o.ranges.assign(ranges, ranges + 2 * count);
+    o.wavelengths = (in_wavelengths != 0);
+    o.bin = bin;
+    return 0;
+}
+
+void HugePages(int spect, int enable)
+{
+    gOptions[spect].huge_pages = (enable != 0);
+}
+
+void Corrections(int spect, int corrections)
+{
+    gOptions[spect].corrections = corrections;
+}
+
+void Spool(int spect, char const *path, unsigned spill_mb)
+{
+    gOptions[spect].spool = path ? path : "";
+    gOptions[spect].spill = size_t(spill_mb) << 20;
+}
+
+int RecoverSpool(char const *path, short int *data, int max_spectra, int *pixels)
+{
+    unsigned p = 0;
+    int n = read_spool(path, data, max_spectra < 0 ? 0 : max_spectra, &p);
+    if (pixels) *pixels = p;
+    return n;
+}
 
 int Init(int spect, float integration_time, char *trig_event, int *triggers, int average, int dynamic_dark, unsigned max_spectra)
 {
     multispec *sp;
-    sp = new multispec(spect, integration_time, average, dynamic_dark, max_spectra);
+    int corrections = gOptions[spect].corrections;
+    if (dynamic_dark) corrections |= CORRECT_DYNAMIC_DARK;
+    // the spool of a crashed run is not overwritten
+    if (!gOptions[spect].spool.empty())
+        set_aside_spool(gOptions[spect].spool.c_str());
+    sp = new multispec(spect, integration_time, average, corrections, max_spectra,
+                       gOptions[spect]);
     if (sp == NULL) return -1;
     gSpects[spect] = sp;
     return spect;
@@ -247,22 +520,125 @@ int    NumChannels(int spect)
 int    NumSpectra(int spect)
 {
     multispec *sp  = gSpects[spect];
-    return  sp->m_spectra.size();
+    sp->m_counted = sp->m_spectra.available();
+    return  sp->m_counted;
+}
+
+double multispec::frame_rate(void) const
+{
+    // readout_latency is learned from the frames with the current range
+    double cycle = monotonic::from(get_integration_time())
+        * std::max(get_average(), 1u)
+        + monotonic::from(readout_latency());
+    return cycle > 0 ? 1e9 / cycle : 0;
+}
+
+double FrameRate(int spect)
+{
+    multispec *sp =  gSpects[spect];
+    return sp->frame_rate();
 }
 
 int    NumWavelengths(int spect)
 {
     multispec *sp =  gSpects[spect];
-    return  sp->num_pixels();
+    return  sp->m_roi.size();
 }
 
 void   ReadSpectra(int spect, int chan, short int *data)
 {
     multispec *sp =  gSpects[spect];
     
-    for (size_t i=0; i != sp->m_spectra.size(); ++i)
-        for (size_t j=0; j != sp->num_pixels(); j++)
-            *data++ = sp->m_spectra[i][j];
+    // the caller made room for what NumSpectra said; more may have
+    // arrived since
+    ReadSpectraN(spect, chan, data, sp->m_counted);
+}
+
+int    ReadSpectraN(int spect, int chan, short int *data, int max_spectra)
+{
+    multispec *sp =  gSpects[spect];
+    
+    // only the spectra which were there when we started; more may arrive
+    // while copying.  What doesn't fit stays in the ring.
+    unsigned n = sp->m_spectra.available();
+    if (max_spectra >= 0 && n > unsigned(max_spectra)) n = max_spectra;
+    sp->m_spectra.copy_out(data, n);
+    return n;
+}
+
+int    ReadFlatSpectra(int spect, int chan, float *data, int max_spectra)
+{
+    multispec *sp =  gSpects[spect];
+    
+    // as ReadSpectraN
+    unsigned n = sp->m_spectra.available();
+    if (max_spectra >= 0 && n > unsigned(max_spectra)) n = max_spectra;
+    for (unsigned i = 0; i != n; ++i) {
+        if (!sp->flat_field(chan, sp->m_spectra.peek(i),
+                            data + size_t(i) * sp->m_spectra.pixels()))
+            return -1;
+    }
+    return n;
+}
+
+int    DrainSpectra(int spect, int chan, short int *data, int max_spectra)
+{
+    multispec *sp =  gSpects[spect];
+    
+    unsigned n = sp->m_spectra.available();
+    if (max_spectra >= 0 && n > unsigned(max_spectra)) n = max_spectra;
+    sp->m_spectra.copy_out(data, n);
+    // the slots may be reused now
+    sp->m_spectra.consume(n);
+    return n;
+}
+
+int    GetStats(int spect, double *stats, int max)
+{
+    multispec *sp =  gSpects[spect];
+    acquisition_stats const &s = sp->stats();
+    
+    double values[STATS_SIZE];
+    values[STATS_FRAMES] = s.frames.load();
+    values[STATS_TIMEOUTS] = s.timeouts.load();
+    values[STATS_RETRIES] = s.retries.load();
+    values[STATS_CANCELS] = s.cancels.load();
+    values[STATS_DROPPED] = sp->m_spectra.dropped() - sp->m_dropped_reset;
+    values[STATS_BAD_FRAMES] = s.bad_frames.load();
+    values[STATS_SATURATED_FRAMES] = s.saturated_frames.load();
+    values[STATS_SATURATED_PIXELS] = s.saturated_pixels.load();
+    for (unsigned i = 0; i < acquisition_stats::STAGES; ++i) {
+        latency_histogram const &h = s.latency[i];
+        double *v = &values[STATS_ISSUE + 4 * i];
+        v[0] = h.count();
+        v[1] = h.percentile(0.5) * 1e-3;
+        v[2] = h.percentile(0.99) * 1e-3;
+        v[3] = h.max() * 1e-3;
+    }
+    
+    int n = max < STATS_SIZE ? max : STATS_SIZE;
+    for (int i = 0; i < n; ++i)
+        stats[i] = values[i];
+    return n < 0 ? 0 : n;
+}
+
+void   ResetStats(int spect)
+{
+    multispec *sp =  gSpects[spect];
+    sp->reset_stats();
+    sp->m_dropped_reset = sp->m_spectra.dropped();
+}
+
+void   Trace(int level, char const *error_dump)
+{
+    trace::set_level(level <= 0 ? trace::OFF
+                     : level == 1 ? trace::EVENTS : trace::CALLS);
+    trace::dump_on_error(error_dump ? error_dump : "");
+}
+
+int    DumpTrace(char const *path)
+{
+    return trace::dump(path) ? 0 : -1;
 }
 
 void   ReadDark(int spect, int chan, short int *data)
@@ -278,19 +654,19 @@ void   ReadWavelengths(int spect, int chan, float *wavel)
 {
     multispec *sp =  gSpects[spect];
 
-    std::vector<float> waves;
-    
-    waves = sp->get_wavelengths(chan);
+    std::vector<float> const &waves = sp->get_wavelengths(chan);
 
-    for (size_t i=0; i != waves.size(); ++i)
-        *wavel++ = waves[i];
+    // the wavelengths of the stored pixels; a bin gets their mean
+    if (!waves.empty())
+        sp->m_roi.apply(&waves[0], wavel);
 }
 
 void RunRaw(float integration_time, int average, int dynamic_dark, int num_spectra)
 {
     
     multispec *sp;
-    sp = new multispec(0, integration_time, average, dynamic_dark, num_spectra, 1);
+    sp = new multispec(0, integration_time, average,
+                       dynamic_dark ? CORRECT_DYNAMIC_DARK : 0, num_spectra, 1);
     if (sp == NULL) return ;
 
     std::vector<float> waves = sp->get_wavelengths(0);
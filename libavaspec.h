@@ -10,16 +10,126 @@
 #if __cplusplus
 extern "C" {
 #endif
+    /* corrections for Corrections, or-ed together */
+    enum {
+        CORRECT_DYNAMIC_DARK = 1, /* subtract the mean of the dark pixels */
+        CORRECT_NONLINEAR = 2     /* the detector's nonlinearity, from the
+                                     coefficients in the config file */
+    };
+    /* dynamic_dark nonzero turns on CORRECT_DYNAMIC_DARK, on top of what
+       Corrections set */
     int Init(int spec, float int_time, char *trig_event, int *triggers,
 	     int average, int dynamic_dark, unsigned max_spectra);
     int    Stop(int spec);
     int    NumChannels(int spec);
     int    NumSpectra(int spec);
     int    NumWavelengths(int spec);
+    /* data has room for as many spectra as the last NumSpectra
+       returned; spectra which arrived since are not copied */
     void   ReadSpectra(int spec, int chan, short int *data);
+    /* copy the spectra to data, oldest first, without removing them:
+       at most max_spectra, data has room for max_spectra times
+       NumWavelengths values.  Returns the number of spectra written. */
+    int    ReadSpectraN(int spec, int chan, short int *data, int max_spectra);
+    /* like ReadSpectraN, but flat field corrected: every spectrum is
+       divided by the detector response from the ijking file and scaled
+       by the integration time of the response over that of the spectra.
+       With binning (see Roi), a bin is divided by the mean response of
+       its pixels, which is only exact where the spectrum has the shape of
+       the response within the bin.  Returns the number of spectra, or -1
+       if chan has no ijking file. */
+    int    ReadFlatSpectra(int spec, int chan, float *data, int max_spectra);
+    /* like ReadSpectraN, but the spectra are removed.  May be called
+       while the acquisition runs. */
+    int    DrainSpectra(int spec, int chan, short int *data, int max_spectra);
     void   ReadDark(int spec, int chan, short int *data);
     void   ReadWavelengths(int spec, int chan, float *wave);
     void   Destroy(int spec);
+    /* settings for the next Init of spec; call them before Init */
+    void   Pipeline(int spec, int enable); /* default off */
+    void   HugePages(int spec, int enable); /* default off */
+    void   Corrections(int spec, int corrections); /* default none */
+    /* store one averaged spectrum per frames frames (default 1, every
+       frame).  Unlike the device's averaging, every frame is still read
+       out.  With clip_sigma > 0, a pixel value further than clip_sigma
+       standard deviations from the mean of the other frames of its
+       group is left out.  The last group of a shot may have fewer
+       frames. */
+    void   CoAdd(int spec, unsigned frames, float clip_sigma);
+    /* store only regions of interest of channel chan: count regions,
+       as pairs first, last in ranges.  They are the pixels [first,
+       last), or with in_wavelengths the wavelengths [first, last] as
+       ReadWavelengths gives them, with the calibration at Init.  Every
+       bin pixels of a region are averaged into one.  NumWavelengths,
+       ReadWavelengths, ReadDark and the spectra then cover only these
+       pixels, in the order of the regions.  count 0 (the default)
+       stores all pixels.  Only channel 0 is acquired, so chan must be 0.
+       Returns -1 for invalid arguments. */
+    int    Roi(int spec, int chan, float const *ranges, int count,
+               int in_wavelengths, int bin);
+    /* the number of frames per second spec can take: the integration
+       time times the averaging, plus the readout time.  Only the range
+       which holds the regions of interest is read out, so it is faster
+       with narrow regions.  The readout time is learned from the frames
+       taken so far; before the first one, it is a guess, scaled to the
+       size of the range.  With CoAdd, fewer spectra are stored. */
+    double FrameRate(int spec);
+    /* let one shared thread drive all devices which have this on,
+       instead of a thread per device.  Default off.  Usb devices need
+       the asynchronous libusb-1.0 backend for this; with libusb-0.1
+       they get their own thread anyway. */
+    void   EventLoop(int spec, int enable);
+    /* where the device is: "usb" (the default), "serial:<device file>",
+       "emulation", or a capture made with Record: "replay:<file>" with
+       the recorded timing, "replay-fast:<file>" without waiting.  The
+       emulation takes options, as in
+       "emulation:spectrum=glow.csv,trigger_hz=50"; see avaspec::source for
+       the keys.  Returns -1 if descr is not understood. */
+    int    Source(int spec, char const *descr);
+    /* record all traffic with the device to a capture file, for replay.
+       path NULL turns it off (the default). */
+    void   Record(int spec, char const *path);
+    /* write the spectra to a file while they are taken, so they survive a
+       crash.  At most spill_mb megabytes of it stay in memory (0: no
+       limit).  path NULL turns it off (the default).  Destroy removes the
+       file.  If Init finds a spool file with spectra at path, it is
+       renamed to path.1 (or the next free number) first; Init fails if
+       path is another file. */
+    void   Spool(int spec, char const *path, unsigned spill_mb);
+    /* read the spectra from a spool file after a crash, oldest first, at
+       most max_spectra.  With data NULL they are only counted.  Returns
+       the number of spectra, or -1 if the file is not a spool file. */
+    int    RecoverSpool(char const *path, short int *data, int max_spectra,
+                        int *pixels);
+    /* statistics of the acquisition of spec since Init or ResetStats, for
+       monitoring.  At most max of the values below are written to stats;
+       the number written is returned.  For every stage of a measurement
+       there are the number of samples and the median, 99th percentile
+       and maximum latency in microseconds; see stats.hpp for the
+       stages. */
+    enum {
+        STATS_FRAMES, STATS_TIMEOUTS, STATS_RETRIES, STATS_CANCELS,
+        STATS_DROPPED,
+        /* count, p50, p99, max */
+        STATS_ISSUE = 5, STATS_WAIT = 9, STATS_TRANSFER = 13,
+        STATS_DECODE = 17, STATS_PUBLISH = 21, STATS_TOTAL = 25,
+        /* measurements with bad data, which were skipped */
+        STATS_BAD_FRAMES = 29,
+        /* spectra (the dark one included) with pixels at full scale, and
+           the number of those pixels in the range which is read out */
+        STATS_SATURATED_FRAMES = 30, STATS_SATURATED_PIXELS = 31,
+        STATS_SIZE = 32
+    };
+    int    GetStats(int spec, double *stats, int max);
+    void   ResetStats(int spec);
+    /* binary trace of what the driver does, cheap enough to leave on:
+       level 0 is off (the default), 1 records events, 2 also every
+       function call.  If error_dump is not NULL, the trace is written
+       to that file whenever an error occurs. */
+    void   Trace(int level, char const *error_dump);
+    /* write the trace to path now, for avaspec_trace to print.  Returns
+       0, or -1 if the file could not be written. */
+    int    DumpTrace(char const *path);
     void RunRaw(float integration_time, int average, int dynamic_dark, int num_spectra);
 #if __cplusplus
 };
@@ -17,17 +17,7 @@ using namespace std;
 
 vector<float> frequencies(const avaspec &s, int chan)
 {
-	vector<float> cal;	
-	for (int i=0; i<7 ;i++) cal.push_back(s.get_calibration(chan,i));
-
-	vector<float> x(s.num_pixels());
-	
-	for (unsigned i = 0; i != s.num_pixels(); ++i) {
-		unsigned i2 = i*i;
-		x[i]=cal[0]+cal[1]*i+cal[2]*(i2)+(cal[3]*i)*(i2)+(cal[4]*i2)*i2;	
-	}
-	
-	return x;
+	return s[chan].wavelengths();
 }
 
 vector<short> get_dynamic_spectrum(const avaspec &s, int chan)
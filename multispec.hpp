@@ -0,0 +1,138 @@
+/*
+ *  multispec.hpp
+ *  avaspec
+ *
+ *  The device class behind the C api of libavaspec.h: an avaspec which
+ *  runs the acquisition of a shot and keeps the spectra.  Only for the
+ *  library and its benchmarks; programs use libavaspec.h.
+ *
+ */
+
+#ifndef AVASPEC_MULTISPEC_HH
+#define AVASPEC_MULTISPEC_HH
+
+#include "avaspec.hpp"
+#include "ring.hpp"
+#include "reactor.hpp"
+#include "coadd.hpp"
+#include "roi.hpp"
+#include <pthread.h>
+#include <vector>
+#include <string>
+
+// the regions of interest of channel 0, see Roi in libavaspec.h
+struct roi_options {
+    std::vector<float> ranges;  // pairs first, last
+    bool wavelengths;           // ranges are wavelengths, not pixels
+    unsigned bin;
+    
+    roi_options(void) : wavelengths(false), bin(1) {}
+};
+
+// settings which have to be known before Init creates the device, because
+// the acquisition starts right away.
+struct init_options {
+    bool pipelined;     // arm the next frame before processing this one
+    bool huge_pages;    // back the spectrum storage with huge pages
+    std::string spool;  // keep the spectra in this file, if not empty
+    size_t spill;       // bytes of the spool file to keep in memory
+    bool event_loop;    // let the shared reactor drive it, not a thread
+    unsigned coadd;     // store the average of this many frames
+    float clip;         // sigma clipping of the co-added frames (0: off)
+    int corrections;    // CORRECT_* besides Init's dynamic_dark
+    roi_options roi;
+    avaspec::source where;  // usb by default
+    
+    init_options(void) : pipelined(false), huge_pages(false), spill(0),
+                         event_loop(false), coadd(1), clip(0),
+                         corrections(0),
+                         where(avaspec::source::USB) {}
+};
+
+class multispec : public avaspec, public reactor::client {
+public:
+    pthread_t m_multispec_thread;
+    bool      m_multispec_cancel;
+    bool      m_dynamic_dark;
+    bool      m_nonlinear;
+    bool      m_pipelined;
+    bool      m_cancelled;
+    unsigned int m_max_spectra;
+    pthread_t m_dacq_thread;
+    bool      m_dacq_thread_running;
+    
+    // state of the acquisition when the reactor drives it.  In TRIGGER,
+    // the reply to turning on the external trigger is awaited.
+    enum dacq_state { DARK, TRIGGER, DATA, DONE };
+    bool       m_in_reactor;
+    dacq_state m_state;
+    unsigned   m_frame;
+        
+    // the pixels of channel 0 which are stored; everything below is as
+    // wide as m_roi.size ()
+    region_map m_roi;
+    
+    std::vector< short > m_dark;
+    
+    // filled by the dacq thread, read by the library calls
+    spectrum_ring   m_spectra;
+    // what NumSpectra returned last: ReadSpectra copies no more than
+    // that, which is what the caller has room for
+    unsigned        m_counted;
+    // m_spectra.dropped () at the last ResetStats
+    uint64_t   m_dropped_reset;
+    // the group of frames which is being co-added, if co-adding
+    coadder    m_coadd;
+    // the whole spectrum, before m_roi is applied
+    std::vector< short > m_full;
+    // 1 / response of the stored pixels, for flat_field
+    aligned_buffer m_gain;
+
+    static const unsigned kProduct = 0x0471;
+    static const unsigned kVendor  = 0x0666;
+    // full scale of the 14 bit pixels
+    static const short kSaturated = (1 << 14) - 1;
+
+    multispec(int skip, float integration_time, int average, int corrections, size_t max_spectra,
+              init_options const &options);
+    multispec(int skip, float integration_time, int average, int corrections, size_t spectra, int raw);
+    
+    ~multispec(void);
+    
+    std::vector<float> const &get_wavelengths(unsigned chan) const;
+    std::vector<short>   get_spectrum(unsigned chan);
+    // the dark corrected spectrum of the last frame; returns the number of
+    // saturated pixels, which are not corrected.  They are counted in the
+    // stats.
+    unsigned        get_spectrum(unsigned chan, short *y);
+    // frames per second which the device can deliver with the current
+    // integration time, averaging and range
+    double          frame_rate(void) const;
+    // the spectrum of channel 0 as it is stored, with only the pixels of
+    // m_roi
+    void            take_spectrum(short *target);
+    // y (a stored spectrum) divided by the detector response and scaled
+    // to the integration time of the response.  Returns false, and leaves
+    // target alone, if the channel has no ijking file.  Only channel 0 is
+    // stored.
+    bool            flat_field(unsigned chan, short const *y, float *target) const;
+    bool            run_dacq(void);
+    // put the spectrum of the last frame in m_spectra, or add it to the
+    // co-added group; the group is stored when it is complete, or by
+    // flush_coadd when the acquisition ends
+    void            store_frame(unsigned frame);
+    void            flush_coadd(unsigned frame);
+    void            publish_spectrum(unsigned frame);
+    std::vector< std::vector< short > > run_dacq_no_trig(void);
+
+    bool            stop_dacq(void);
+    
+    // reactor::client
+    unsigned        fds(struct pollfd *fds, unsigned max);
+    monotonic::ns   deadline(void);
+    bool            step(void);
+    
+    static avaspec::source locate(int skip, avaspec::source where);
+};
+
+#endif // defined AVASPEC_MULTISPEC_HH
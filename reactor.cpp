@@ -0,0 +1,266 @@
+/*
+ *  reactor.cpp
+ *  avaspec
+ *
+ *  One thread which drives many devices.
+ *
+ */
+
+#include "reactor.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include "error.hpp"
+#include <unistd.h> // pipe, read, write, close
+#include <fcntl.h>  // fcntl
+#include <stdint.h> // uint64_t
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#endif
+
+monotonic::ns const reactor::NEVER = ~0ull >> 1;
+
+namespace
+{
+  // epoll data of the reactor's own file descriptors
+  char wake_tag, timer_tag;
+}
+
+reactor::reactor ()
+  : m_stop (false), m_epoll (-1), m_timer (-1)
+{
+  startfunc;
+#ifdef __linux__
+  m_epoll = ::epoll_create1 (EPOLL_CLOEXEC);
+  m_timer = ::timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  m_wake[0] = m_wake[1] = ::eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_epoll < 0 || m_timer < 0 || m_wake[0] < 0)
+    {
+      shevek_error_errno ("unable to set up event loop");
+      return;
+    }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &wake_tag;
+  ::epoll_ctl (m_epoll, EPOLL_CTL_ADD, m_wake[0], &ev);
+  ev.data.ptr = &timer_tag;
+  ::epoll_ctl (m_epoll, EPOLL_CTL_ADD, m_timer, &ev);
+#else
+  if (::pipe (m_wake) < 0)
+    {
+      shevek_error_errno ("unable to set up event loop");
+      return;
+    }
+  ::fcntl (m_wake[0], F_SETFL, O_NONBLOCK);
+  ::fcntl (m_wake[1], F_SETFL, O_NONBLOCK);
+#endif
+  pthread_mutex_init (&m_lock, 0);
+  if (pthread_create (&m_thread, 0, l_thread, this) != 0)
+    shevek_error ("unable to start event loop thread");
+}
+
+reactor::~reactor ()
+{
+  startfunc;
+  pthread_mutex_lock (&m_lock);
+  m_stop = true;
+  pthread_mutex_unlock (&m_lock);
+  l_wake ();
+  pthread_join (m_thread, 0);
+  pthread_mutex_destroy (&m_lock);
+  ::close (m_wake[0]);
+  if (m_wake[1] != m_wake[0])
+    ::close (m_wake[1]);
+#ifdef __linux__
+  ::close (m_timer);
+  ::close (m_epoll);
+#endif
+}
+
+reactor &reactor::shared ()
+{
+  static reactor instance;
+  return instance;
+}
+
+void reactor::l_wake ()
+{
+#ifdef __linux__
+  uint64_t one = 1;
+  if (::write (m_wake[1], &one, sizeof (one) ) < 0 && errno != EAGAIN)
+#else
+  char c = 0;
+  if (::write (m_wake[1], &c, 1) < 0 && errno != EAGAIN)
+#endif
+    shevek_warning_errno ("unable to wake up event loop");
+}
+
+void reactor::l_watch (entry &e, bool add)
+{
+#ifdef __linux__
+  for (unsigned i = 0; i < e.num_fds; ++i)
+    {
+      struct epoll_event ev;
+      ev.events = ( (e.fds[i].events & POLLIN) ? uint32_t (EPOLLIN) : 0)
+	| ( (e.fds[i].events & POLLOUT) ? uint32_t (EPOLLOUT) : 0);
+      ev.data.ptr = e.c;
+      if (::epoll_ctl (m_epoll, add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+		       e.fds[i].fd, &ev) < 0)
+	shevek_warning_errno ("unable to " << (add ? "watch" : "unwatch")
+			      << " file descriptor " << e.fds[i].fd);
+    }
+#endif
+}
+
+void reactor::add (client *c)
+{
+  startfunc;
+  entry e;
+  e.c = c;
+  e.num_fds = c->fds (e.fds, MAX_FDS);
+  if (e.num_fds > MAX_FDS)
+    {
+      shevek_error ("too many file descriptors for event loop ("
+		    << e.num_fds << " > " << MAX_FDS << ")");
+      return;
+    }
+  // let it look at the device once, in case data is there already
+  e.ready = true;
+  pthread_mutex_lock (&m_lock);
+  l_watch (e, true);
+  m_entries.push_back (e);
+  pthread_mutex_unlock (&m_lock);
+  l_wake ();
+}
+
+void reactor::remove (client *c)
+{
+  startfunc;
+  // the thread holds the lock while clients run, so c is not running
+  // once we have it
+  pthread_mutex_lock (&m_lock);
+  for (unsigned i = 0; i < m_entries.size (); ++i)
+    if (m_entries[i].c == c)
+      {
+	l_watch (m_entries[i], false);
+	m_entries.erase (m_entries.begin () + i);
+	break;
+      }
+  pthread_mutex_unlock (&m_lock);
+  l_wake ();
+}
+
+unsigned reactor::size ()
+{
+  startfunc;
+  pthread_mutex_lock (&m_lock);
+  unsigned num = m_entries.size ();
+  pthread_mutex_unlock (&m_lock);
+  return num;
+}
+
+void *reactor::l_thread (void *self)
+{
+  static_cast <reactor *> (self)->l_run ();
+  return 0;
+}
+
+void reactor::l_run ()
+{
+  startfunc;
+  enum { MAX_EVENTS = 64 };
+  pthread_mutex_lock (&m_lock);
+  while (!m_stop)
+    {
+      // run every client which has something to do, and find out when
+      // the next one will
+      monotonic::ns now = monotonic::now (), deadline = NEVER;
+      for (unsigned i = 0; i < m_entries.size (); ++i)
+	{
+	  entry &e = m_entries[i];
+	  if (e.ready || e.c->deadline () <= now)
+	    {
+	      e.ready = false;
+	      bool more;
+	      try
+		{
+		  more = e.c->step ();
+		}
+	      catch (...)
+		{
+		  // the client reports its own errors; this one is lost
+		  shevek_warning ("device in event loop failed, removing it");
+		  more = false;
+		}
+	      if (!more)
+		{
+		  l_watch (e, false);
+		  m_entries.erase (m_entries.begin () + i--);
+		  continue;
+		}
+	    }
+	  monotonic::ns d = e.c->deadline ();
+	  if (d < deadline)
+	    deadline = d;
+	}
+#ifdef __linux__
+      pthread_mutex_unlock (&m_lock);
+      struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+      if (deadline != NEVER)
+	{
+	  // an all-zero value would disarm the timer
+	  if (deadline <= 0)
+	    deadline = 1;
+	  its.it_value.tv_sec = deadline / 1000000000;
+	  its.it_value.tv_nsec = deadline % 1000000000;
+	}
+      ::timerfd_settime (m_timer, TFD_TIMER_ABSTIME, &its, 0);
+      struct epoll_event ev[MAX_EVENTS];
+      int num = ::epoll_wait (m_epoll, ev, MAX_EVENTS, -1);
+      if (num < 0 && errno != EINTR)
+	shevek_warning_errno ("epoll_wait failed");
+      pthread_mutex_lock (&m_lock);
+      for (int i = 0; i < num; ++i)
+	{
+	  uint64_t buffer;
+	  if (ev[i].data.ptr == &wake_tag)
+	    while (::read (m_wake[0], &buffer, sizeof (buffer) ) > 0) {}
+	  else if (ev[i].data.ptr == &timer_tag)
+	    while (::read (m_timer, &buffer, sizeof (buffer) ) > 0) {}
+	  else
+	    for (unsigned e = 0; e < m_entries.size (); ++e)
+	      if (m_entries[e].c == ev[i].data.ptr)
+		m_entries[e].ready = true;
+	}
+#else
+      // collect the fds while the entries can't change
+      std::vector <struct pollfd> fds (1);
+      std::vector <client *> owner (1, static_cast <client *> (0) );
+      fds[0].fd = m_wake[0];
+      fds[0].events = POLLIN;
+      for (unsigned i = 0; i < m_entries.size (); ++i)
+	for (unsigned f = 0; f < m_entries[i].num_fds; ++f)
+	  {
+	    fds.push_back (m_entries[i].fds[f]);
+	    owner.push_back (m_entries[i].c);
+	  }
+      pthread_mutex_unlock (&m_lock);
+      int timeout = deadline == NEVER ? -1
+	: monotonic::now () >= deadline ? 0
+	: int (monotonic::ms_until (deadline, ~0u >> 1) );
+      int num = ::poll (&fds[0], fds.size (), timeout);
+      if (num < 0 && errno != EINTR)
+	shevek_warning_errno ("poll failed");
+      pthread_mutex_lock (&m_lock);
+      char buffer[16];
+      if (num > 0 && fds[0].revents)
+	while (::read (m_wake[0], buffer, sizeof (buffer) ) > 0) {}
+      for (unsigned i = 1; num > 0 && i < fds.size (); ++i)
+	if (fds[i].revents)
+	  for (unsigned e = 0; e < m_entries.size (); ++e)
+	    if (m_entries[e].c == owner[i])
+	      m_entries[e].ready = true;
+#endif
+    }
+  pthread_mutex_unlock (&m_lock);
+}
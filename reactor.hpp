@@ -0,0 +1,79 @@
+/*
+ *  reactor.hpp
+ *  avaspec
+ *
+ *  One thread which drives many devices.  Each device is a client with
+ *  its state in its own members; the reactor waits until one of the
+ *  clients' file descriptors is ready or its deadline has passed, and then
+ *  lets that client do what it can without blocking.  On Linux it waits
+ *  with epoll and a timerfd, elsewhere with poll.
+ *
+ */
+
+#ifndef AVASPEC_REACTOR_HH
+#define AVASPEC_REACTOR_HH
+
+#include "clock.hpp"
+#include <vector>
+#include <pthread.h>
+#include <poll.h>
+
+class reactor
+{
+public:
+  class client
+  {
+  public:
+    virtual ~client () {}
+    // file descriptors to wait for; at most max are stored in fds, the
+    // number is returned.  They must not change while the client is
+    // registered.
+    virtual unsigned fds (struct pollfd *fds, unsigned max) = 0;
+    // monotonic time when step must be called if no fd became ready, or
+    // reactor::NEVER
+    virtual monotonic::ns deadline () = 0;
+    // do what can be done without blocking.  Returns false when the
+    // client is done; it is then removed.
+    virtual bool step () = 0;
+  };
+  static monotonic::ns const NEVER;
+  enum { MAX_FDS = 16 };
+  reactor ();
+  ~reactor ();
+  // these may be called from any thread.  When remove returns, step of c
+  // is not running and will not be called again.
+  void add (client *c);
+  void remove (client *c);
+  // number of registered clients
+  unsigned size ();
+  // the reactor which is shared by all devices of the process.  Its
+  // thread is started when it is first used.
+  static reactor &shared ();
+private:
+  // not copyable
+  reactor (reactor const &);
+  void operator= (reactor const &);
+  struct entry
+  {
+    client *c;
+    struct pollfd fds[MAX_FDS];
+    unsigned num_fds;
+    bool ready;
+  };
+  std::vector <entry> m_entries;
+  // held while m_entries is changed or clients are running
+  pthread_mutex_t m_lock;
+  pthread_t m_thread;
+  bool m_stop;
+  // m_wake[0] is watched by the thread; writing to m_wake[1] (or the
+  // eventfd, if m_wake[0] == m_wake[1]) makes it look at m_entries again
+  int m_wake[2];
+  int m_epoll, m_timer;
+  void l_wake ();
+  void l_wait (monotonic::ns deadline);
+  void l_watch (entry &e, bool add);
+  void l_run ();
+  static void *l_thread (void *self);
+};
+
+#endif // defined AVASPEC_REACTOR_HH
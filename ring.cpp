@@ -0,0 +1,67 @@
+/*
+ *  ring.cpp
+ *  avaspec
+ *
+ *  Setup of the spectrum ring, and the parts of it which are not used for
+ *  every spectrum.
+ *
+ */
+
+#include "ring.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include <new> // placement new
+#include <unistd.h> // unlink
+
+spectrum_ring::spectrum_ring (unsigned capacity, unsigned pixels, bool huge,
+			      char const *spool, size_t spill)
+  : m_capacity (capacity ? capacity : 1), m_pixels (pixels),
+    m_arena ( (spool ? size_t (spool_header::SIZE) : 0)
+	     + size_t (m_capacity) * pixels * sizeof (short), huge, spool),
+    m_header (0), m_data (reinterpret_cast <short *> (m_arena.data () ) ),
+    m_spill (0), m_spilled (0),
+    m_write (0), m_read_cache (0), m_dropped (0), m_read (0)
+{
+  startfunc;
+  if (!spool)
+    {
+      m_arena.prefault ();
+      return;
+    }
+  m_path = spool;
+  size_t slot = size_t (pixels) * sizeof (short);
+  if (spill && slot)
+    m_spill = (spill + slot - 1) / slot;
+  // only the slots which stay in memory are faulted in; the others would
+  // have to be written to the file and released again
+  if (m_spill && m_spill < m_capacity)
+    m_arena.prefault (0, spool_header::SIZE + m_spill * slot);
+  else
+    m_arena.prefault ();
+  m_header = new (m_arena.data () ) spool_header;
+  m_header->init (pixels, m_capacity);
+  m_data = reinterpret_cast <short *> (m_arena.data () + spool_header::SIZE);
+}
+
+spectrum_ring::~spectrum_ring ()
+{
+  startfunc;
+  // the spectra were not lost in a crash; the next spool may use the name
+  if (!m_path.empty () )
+    ::unlink (m_path.c_str () );
+}
+
+void spectrum_ring::l_spill (uint64_t idx)
+{
+  startfunc;
+  // the slots may wrap around the end of the ring
+  size_t slot = size_t (m_pixels) * sizeof (short);
+  while (m_spilled < idx)
+    {
+      size_t first = m_spilled % m_capacity;
+      uint64_t count = idx - m_spilled;
+      if (count > m_capacity - first)
+	count = m_capacity - first;
+      m_arena.release (spool_header::SIZE + first * slot, count * slot);
+      m_spilled += count;
+    }
+}
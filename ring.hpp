@@ -0,0 +1,131 @@
+/*
+ *  ring.hpp
+ *  avaspec
+ *
+ *  Fixed capacity ring of spectrum slots, passed from one producer thread
+ *  (the acquisition) to one consumer thread (whoever reads the spectra)
+ *  without locks.  All slots are in one arena, allocated and faulted in
+ *  by the constructor.  The arena can be a spool file, see spool.hpp.
+ *
+ */
+
+#ifndef AVASPEC_RING_HH
+#define AVASPEC_RING_HH
+
+#include "arena.hpp"
+#include "spool.hpp"
+#include <atomic>
+#include <stdint.h>
+#include <string.h> // memcpy
+#include <string>
+
+class spectrum_ring
+{
+public:
+  // if huge, the arena is backed by huge pages when possible.  If spool
+  // is given, the ring is kept in that file instead, and at most about
+  // spill bytes of it are kept in memory (0 means no limit).
+  spectrum_ring (unsigned capacity, unsigned pixels, bool huge = false,
+		 char const *spool = 0, size_t spill = 0);
+  // a spool file is removed
+  ~spectrum_ring ();
+  unsigned capacity () const { return m_capacity; }
+  unsigned pixels () const { return m_pixels; }
+
+  // producer side.  claim returns the slot for the next spectrum, or 0 if
+  // the ring is full; the spectrum is then counted as dropped.  The
+  // spectrum becomes visible to the consumer with publish.
+  short *claim ()
+  {
+    uint64_t w = m_write.load (std::memory_order_relaxed);
+    if (w - m_read_cache == m_capacity)
+      {
+	m_read_cache = m_read.load (std::memory_order_acquire);
+	if (w - m_read_cache == m_capacity)
+	  {
+	    m_dropped.fetch_add (1, std::memory_order_relaxed);
+	    if (m_header)
+	      m_header->dropped.fetch_add (1, std::memory_order_relaxed);
+	    return 0;
+	  }
+      }
+    return l_slot (w);
+  }
+  void publish ()
+  {
+    uint64_t w = m_write.load (std::memory_order_relaxed) + 1;
+    m_write.store (w, std::memory_order_release);
+    if (m_header)
+      {
+	m_header->committed.store (w, std::memory_order_release);
+	// the next spectrum is written after the count, see spool_header
+	std::atomic_thread_fence (std::memory_order_release);
+	if (m_spill && w - m_spilled >= 2 * m_spill)
+	  l_spill (w - m_spill);
+      }
+  }
+  // number of spectra which didn't fit
+  uint64_t dropped () const
+  { return m_dropped.load (std::memory_order_relaxed); }
+
+  // consumer side.  available is the number of published spectra which
+  // were not consumed yet; peek (0) is the oldest of them.
+  unsigned available () const
+  {
+    return unsigned (m_write.load (std::memory_order_acquire)
+		     - m_read.load (std::memory_order_relaxed) );
+  }
+  short const *peek (unsigned idx) const
+  { return l_slot (m_read.load (std::memory_order_relaxed) + idx); }
+  // copy the oldest count spectra to target, without consuming them.
+  // The slots are contiguous, so this is one copy, or two if the range
+  // wraps around the end of the ring.
+  void copy_out (short *target, unsigned count) const
+  {
+    size_t first = m_read.load (std::memory_order_relaxed) % m_capacity;
+    size_t part = count < m_capacity - first ? count : m_capacity - first;
+    ::memcpy (target, &m_data[first * m_pixels],
+	      part * m_pixels * sizeof (short) );
+    if (part < count)
+      ::memcpy (target + part * m_pixels, m_data,
+		(count - part) * m_pixels * sizeof (short) );
+  }
+  // give the oldest count spectra back to the producer
+  void consume (unsigned count)
+  {
+    m_read.store (m_read.load (std::memory_order_relaxed) + count,
+		  std::memory_order_release);
+  }
+private:
+  // not copyable
+  spectrum_ring (spectrum_ring const &);
+  void operator= (spectrum_ring const &);
+  short *l_slot (uint64_t idx)
+  { return &m_data[size_t (idx % m_capacity) * m_pixels]; }
+  short const *l_slot (uint64_t idx) const
+  { return &m_data[size_t (idx % m_capacity) * m_pixels]; }
+  // let the slots before idx leave memory
+  void l_spill (uint64_t idx);
+  enum { CACHE_LINE = 64 };
+  unsigned const m_capacity, m_pixels;
+  arena m_arena;
+  // header and name of the spool file, or 0 and empty
+  spool_header *m_header;
+  std::string m_path;
+  short *m_data;
+  // number of slots to keep in memory when spooling, or 0; slots before
+  // m_spilled have been released
+  uint64_t m_spill, m_spilled;
+  // The indices count all spectra ever written and read.  Each index is
+  // on its own cache line, so the two sides don't slow each other down.
+  // The producer also keeps the last read index it saw.
+  char m_pad0[CACHE_LINE];
+  std::atomic <uint64_t> m_write;
+  uint64_t m_read_cache;
+  std::atomic <uint64_t> m_dropped;
+  char m_pad1[CACHE_LINE];
+  std::atomic <uint64_t> m_read;
+  char m_pad2[CACHE_LINE];
+};
+
+#endif // defined AVASPEC_RING_HH
@@ -0,0 +1,150 @@
+/*
+ *  roi.cpp
+ *  avaspec
+ *
+ *  Resolving regions of interest to pixels, and copying and binning them.
+ *
+ */
+
+#include "roi.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include <math.h> // lrint
+#include <string.h> // memcpy
+
+namespace
+{
+  // the mean of count values, rounded to the nearest count
+  inline short mean (int sum, unsigned count)
+  {
+    int half = count / 2;
+    return short (sum >= 0 ? (sum + half) / int (count)
+		  : -( (-sum + half) / int (count) ) );
+  }
+
+  inline float mean (float sum, unsigned count)
+  {
+    return sum / count;
+  }
+
+  template <typename T, typename S>
+  void copy (region_map::ranges const &keep, unsigned bin, T const *src,
+	     T *dst)
+  {
+    for (unsigned r = 0; r < keep.size (); ++r)
+      {
+	unsigned first = keep[r].first, last = keep[r].second;
+	if (bin == 1)
+	  {
+	    ::memcpy (dst, src + first, (last - first) * sizeof (T) );
+	    dst += last - first;
+	    continue;
+	  }
+	for (unsigned p = first; p < last; p += bin)
+	  {
+	    unsigned end = p + bin < last ? p + bin : last;
+	    S sum = 0;
+	    for (unsigned i = p; i < end; ++i)
+	      sum += src[i];
+	    *dst++ = mean (sum, end - p);
+	  }
+      }
+  }
+}
+
+region_map::region_map ()
+  : m_bin (1), m_pixels (0), m_size (0)
+{
+  startfunc;
+}
+
+void region_map::setup (ranges const &keep, unsigned bin, unsigned pixels)
+{
+  startfunc;
+  m_bin = bin ? bin : 1;
+  m_pixels = pixels;
+  m_keep.clear ();
+  for (unsigned r = 0; r < keep.size (); ++r)
+    {
+      unsigned first = keep[r].first < pixels ? keep[r].first : pixels;
+      unsigned last = keep[r].second < pixels ? keep[r].second : pixels;
+      if (first < last)
+	m_keep.push_back (std::make_pair (first, last) );
+    }
+  if (m_keep.empty () )
+    m_keep.push_back (std::make_pair (0u, pixels) );
+  m_size = 0;
+  for (unsigned r = 0; r < m_keep.size (); ++r)
+    m_size += (m_keep[r].second - m_keep[r].first + m_bin - 1) / m_bin;
+}
+
+region_map::ranges region_map::from_wavelengths
+(std::vector <float> const &bands, std::vector <float> const &axis)
+{
+  startfunc;
+  ranges result;
+  for (unsigned b = 0; b + 1 < bands.size (); b += 2)
+    {
+      // the axis need not be increasing; take every pixel in the band
+      unsigned first = axis.size (), last = 0;
+      for (unsigned i = 0; i < axis.size (); ++i)
+	if (axis[i] >= bands[b] && axis[i] <= bands[b + 1])
+	  {
+	    if (i < first)
+	      first = i;
+	    last = i + 1;
+	  }
+      if (first < last)
+	result.push_back (std::make_pair (first, last) );
+    }
+  return result;
+}
+
+region_map::ranges region_map::from_pixels (std::vector <float> const &bands,
+					    unsigned pixels)
+{
+  startfunc;
+  ranges result;
+  for (unsigned b = 0; b + 1 < bands.size (); b += 2)
+    {
+      long first = ::lrint (bands[b]), last = ::lrint (bands[b + 1]);
+      first = first < 0 ? 0 : first > long (pixels) ? pixels : first;
+      last = last < 0 ? 0 : last > long (pixels) ? pixels : last;
+      if (first < last)
+	result.push_back (std::make_pair (unsigned (first), unsigned (last) ) );
+    }
+  return result;
+}
+
+bool region_map::identity () const
+{
+  return m_bin == 1 && m_keep.size () == 1 && m_keep[0].first == 0
+    && m_keep[0].second == m_pixels;
+}
+
+unsigned region_map::first () const
+{
+  unsigned result = m_pixels;
+  for (unsigned r = 0; r < m_keep.size (); ++r)
+    if (m_keep[r].first < result)
+      result = m_keep[r].first;
+  return result;
+}
+
+unsigned region_map::last () const
+{
+  unsigned result = 0;
+  for (unsigned r = 0; r < m_keep.size (); ++r)
+    if (m_keep[r].second > result)
+      result = m_keep[r].second;
+  return result;
+}
+
+void region_map::apply (short const *src, short *dst) const
+{
+  copy <short, int> (m_keep, m_bin, src, dst);
+}
+
+void region_map::apply (float const *src, float *dst) const
+{
+  copy <float, float> (m_keep, m_bin, src, dst);
+}
@@ -0,0 +1,52 @@
+/*
+ *  roi.hpp
+ *  avaspec
+ *
+ *  Which pixels of a spectrum are stored: a list of regions of interest,
+ *  optionally binned.  Most diagnostics only look at a few bands, and
+ *  everything outside them costs memory, copies and tree space.
+ *
+ */
+
+#ifndef AVASPEC_ROI_HH
+#define AVASPEC_ROI_HH
+
+#include <vector>
+#include <utility>
+
+class region_map
+{
+public:
+  typedef std::vector <std::pair <unsigned, unsigned> > ranges;
+  region_map ();
+  // keep the pixels in [first, last) of every range, in the given order,
+  // of spectra of pixels pixels, and average every bin of them into one.
+  // A range which doesn't end on a bin boundary has a smaller last bin.
+  // Without (valid) ranges, all pixels are kept.
+  void setup (ranges const &keep, unsigned bin, unsigned pixels);
+  // the pixel ranges which cover the wavelengths in [lo, hi] for every
+  // pair lo, hi in bands, with axis the wavelength of every pixel
+  static ranges from_wavelengths (std::vector <float> const &bands,
+				  std::vector <float> const &axis);
+  // the pixel ranges [first, last) for every pair in bands, rounded and
+  // clipped to [0, pixels)
+  static ranges from_pixels (std::vector <float> const &bands,
+			     unsigned pixels);
+  // number of values after mapping
+  unsigned size () const { return m_size; }
+  // whether apply is a plain copy
+  bool identity () const;
+  // the smallest range of pixels [first (), last ()) which holds all
+  // kept pixels; only these have to be read from the device
+  unsigned first () const;
+  unsigned last () const;
+  // write the size () values of src to dst; src has the pixels which
+  // were given to setup
+  void apply (short const *src, short *dst) const;
+  void apply (float const *src, float *dst) const;
+private:
+  ranges m_keep;
+  unsigned m_bin, m_pixels, m_size;
+};
+
+#endif // defined AVASPEC_ROI_HH
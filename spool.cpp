@@ -0,0 +1,158 @@
+/*
+ *  spool.cpp
+ *  avaspec
+ *
+ *  Layout and recovery of spool files.
+ *
+ */
+
+#include "spool.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include "error.hpp"
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <fcntl.h>    // open
+#include <unistd.h>   // close, link, unlink
+#include <string.h>   // memcpy, memcmp
+#include <errno.h>
+#include <string>
+#include <sstream>
+
+namespace
+{
+  char const MAGIC[8] = { 'A', 'V', 'A', 'S', 'P', 'O', 'O', 'L' };
+
+  // The oldest spectrum which is intact when committed spectra are in a
+  // ring of capacity slots.  The writer fills spectrum committed in the
+  // slot of spectrum committed - capacity before it counts it.
+  inline uint64_t oldest (uint64_t committed, unsigned capacity)
+  {
+    return committed >= capacity ? committed - capacity + 1 : 0;
+  }
+}
+
+void spool_header::init (unsigned num_pixels, unsigned num_slots)
+{
+  startfunc;
+  ::memcpy (magic, MAGIC, sizeof (magic) );
+  version = VERSION;
+  header_size = SIZE;
+  pixels = num_pixels;
+  capacity = num_slots;
+  committed.store (0, std::memory_order_relaxed);
+  dropped.store (0, std::memory_order_relaxed);
+}
+
+bool spool_header::valid () const
+{
+  startfunc;
+  return !::memcmp (magic, MAGIC, sizeof (magic) ) && version == VERSION
+    && header_size >= sizeof (spool_header) && capacity > 0;
+}
+
+int read_spool (char const *path, short *data, unsigned max,
+		unsigned *pixels)
+{
+  startfunc;
+  int fd = ::open (path, O_RDONLY);
+  if (fd < 0)
+    {
+      shevek_warning_errno ("unable to open spool file " << path);
+      return -1;
+    }
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (::fstat (fd, &st) == 0 && size_t (st.st_size) >= spool_header::SIZE)
+    p = ::mmap (0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close (fd);
+  if (p == MAP_FAILED)
+    {
+      shevek_warning ("unable to map spool file " << path);
+      return -1;
+    }
+  spool_header const *header = static_cast <spool_header const *> (p);
+  size_t slot = size_t (header->pixels) * sizeof (short);
+  if (!header->valid ()
+      || header->header_size + header->capacity * slot > size_t (st.st_size) )
+    {
+      ::munmap (p, st.st_size);
+      shevek_warning ("invalid spool file " << path);
+      return -1;
+    }
+  *pixels = header->pixels;
+  uint64_t committed = header->committed.load (std::memory_order_acquire);
+  // after a wrap, only the last capacity spectra are left, and the
+  // oldest of them may be overwritten by the spectrum which is being
+  // written now
+  uint64_t first = oldest (committed, header->capacity);
+  if (data && committed - first > max)
+    first = committed - max;
+  char const *slots = static_cast <char const *> (p) + header->header_size;
+  if (data)
+    {
+      for (uint64_t i = first; i < committed; ++i)
+	::memcpy (data + (i - first) * header->pixels,
+		  slots + (i % header->capacity) * slot, slot);
+      // If the writer went on while we copied, the oldest slots may have
+      // been overwritten halfway.  Like a seqlock: look at the counter
+      // again, and drop what it may have reached.
+      std::atomic_thread_fence (std::memory_order_acquire);
+      uint64_t valid = oldest (header->committed.load
+				 (std::memory_order_relaxed),
+				 header->capacity);
+      if (valid > first)
+	{
+	  uint64_t torn = (valid < committed ? valid : committed) - first;
+	  ::memmove (data, data + torn * header->pixels,
+		     (committed - first - torn) * slot);
+	  first += torn;
+	}
+    }
+  ::munmap (p, st.st_size);
+  return int (committed - first);
+}
+
+void set_aside_spool (char const *path)
+{
+  startfunc;
+  int fd = ::open (path, O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (::fstat (fd, &st) == 0 && size_t (st.st_size) >= spool_header::SIZE)
+    p = ::mmap (0, spool_header::SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  ::close (fd);
+  if (p == MAP_FAILED)
+    return;
+  spool_header const *header = static_cast <spool_header const *> (p);
+  bool valid = header->valid ();
+  uint64_t committed = header->committed.load (std::memory_order_acquire);
+  ::munmap (p, spool_header::SIZE);
+  if (!valid)
+    return;
+  if (committed == 0)
+    {
+      ::unlink (path);
+      return;
+    }
+  // link fails instead of replacing a file which is there already
+  for (unsigned n = 1; ; ++n)
+    {
+      std::ostringstream aside;
+      aside << path << '.' << n;
+      if (::link (path, aside.str ().c_str () ) == 0)
+	{
+	  ::unlink (path);
+	  shevek_warning ("spool file " << path << " holds " << committed
+			  << " spectra, kept as " << aside.str () );
+	  return;
+	}
+      if (errno != EEXIST)
+	{
+	  shevek_warning_errno ("unable to keep spool file " << path
+				<< " as " << aside.str () );
+	  return;
+	}
+    }
+}
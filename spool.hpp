@@ -0,0 +1,55 @@
+/*
+ *  spool.hpp
+ *  avaspec
+ *
+ *  Layout of a spool file: a spectrum ring which lives in a file instead
+ *  of anonymous memory, so the spectra of a shot can be recovered after
+ *  the process died.
+ *
+ */
+
+#ifndef AVASPEC_SPOOL_HH
+#define AVASPEC_SPOOL_HH
+
+#include <atomic>
+#include <stdint.h>
+
+// The first SIZE bytes of a spool file.  The slots of the ring follow it,
+// capacity of them, each pixels shorts.  Everything except the counters
+// is written when the file is created.
+struct spool_header
+{
+  enum { VERSION = 1, SIZE = 4096 };
+  char magic[8]; // "AVASPOOL"
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t pixels;
+  uint32_t capacity;
+  // number of spectra written so far, including those which were
+  // overwritten when the ring wrapped.  It is only increased after the
+  // spectrum is complete, so everything it counts is valid, except for
+  // the slot which the next spectrum is written to.  The writer has a
+  // release fence after increasing it, so a reader which sees any of the
+  // next spectrum sees the new count (see read_spool).
+  std::atomic <uint64_t> committed;
+  std::atomic <uint64_t> dropped;
+  void init (unsigned pixels, unsigned capacity);
+  bool valid () const;
+};
+
+// Read the spectra which are still in a spool file, oldest first, to data,
+// which has room for max spectra.  The file may be written while it is
+// read; spectra which are overwritten during the copy are left out.  If
+// data is 0, nothing is copied and max is ignored.  The number of pixels
+// per spectrum is stored in pixels.  Returns the number of spectra which
+// were (or would be) copied, or -1 if the file is not a valid spool file.
+int read_spool (char const *path, short *data, unsigned max,
+		unsigned *pixels);
+
+// Make room for a new spool file at path.  A spool file which is left
+// there by a crash and holds spectra is renamed to path.1 (or the first
+// free number), so they can still be recovered; an empty one is removed.
+// Anything else is left alone, and creating the new file fails.
+void set_aside_spool (char const *path);
+
+#endif // defined AVASPEC_SPOOL_HH
@@ -0,0 +1,81 @@
+/*
+ *  stats.cpp
+ *  avaspec
+ *
+ *  The parts of the acquisition statistics which are only needed to read
+ *  them out.
+ *
+ */
+
+#include "stats.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include <math.h> // ceil
+
+unsigned latency_histogram::l_bucket (uint64_t v)
+{
+  if (v < SUB)
+    return unsigned (v);
+  unsigned bits = 63 - __builtin_clzll (v);
+  if (bits >= MAX_BITS)
+    return BUCKETS - 1;
+  // the SUB_BITS bits below the top one pick the bucket within the power
+  // of two
+  return (bits - SUB_BITS + 1) * SUB + unsigned (v >> (bits - SUB_BITS) )
+    - SUB;
+}
+
+uint64_t latency_histogram::l_top (unsigned idx)
+{
+  if (idx < SUB)
+    return idx;
+  unsigned bits = idx / SUB + SUB_BITS - 1;
+  uint64_t mantissa = idx % SUB + SUB;
+  return ( (mantissa + 1) << (bits - SUB_BITS) ) - 1;
+}
+
+monotonic::ns latency_histogram::percentile (double q) const
+{
+  startfunc;
+  uint64_t total = count ();
+  if (total == 0)
+    return 0;
+  uint64_t rank = uint64_t (ceil (q * total) );
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < BUCKETS; ++i)
+    {
+      seen += m_bucket[i].load (std::memory_order_relaxed);
+      if (seen >= rank)
+	{
+	  // the bucket may be wider than what is in it
+	  monotonic::ns top = monotonic::ns (l_top (i) );
+	  return top < max () ? top : max ();
+	}
+    }
+  // samples were recorded while we counted
+  return max ();
+}
+
+void latency_histogram::reset ()
+{
+  startfunc;
+  for (unsigned i = 0; i < BUCKETS; ++i)
+    m_bucket[i].store (0, std::memory_order_relaxed);
+  m_count.store (0, std::memory_order_relaxed);
+  m_max.store (0, std::memory_order_relaxed);
+}
+
+void acquisition_stats::reset ()
+{
+  startfunc;
+  for (unsigned s = 0; s < STAGES; ++s)
+    latency[s].reset ();
+  frames.store (0, std::memory_order_relaxed);
+  timeouts.store (0, std::memory_order_relaxed);
+  retries.store (0, std::memory_order_relaxed);
+  cancels.store (0, std::memory_order_relaxed);
+  bad_frames.store (0, std::memory_order_relaxed);
+  saturated_frames.store (0, std::memory_order_relaxed);
+  saturated_pixels.store (0, std::memory_order_relaxed);
+}
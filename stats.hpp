@@ -0,0 +1,94 @@
+/*
+ *  stats.hpp
+ *  avaspec
+ *
+ *  Where the time of a measurement goes: a latency histogram for every
+ *  stage of it, and counters of what went wrong.  The acquisition thread
+ *  records, any other thread may read or reset at the same time, without
+ *  locks.
+ *
+ */
+
+#ifndef AVASPEC_STATS_HH
+#define AVASPEC_STATS_HH
+
+#include "clock.hpp"
+#include <atomic>
+#include <stdint.h>
+
+// Histogram of durations in ns, with buckets like HdrHistogram's: values
+// below SUB have a bucket each, above that every power of two is split
+// into SUB buckets, so a value is known to within 1 / SUB.  Values from
+// 2 ** MAX_BITS ns (18 minutes) on all go in the last bucket.
+class latency_histogram
+{
+public:
+  enum { SUB_BITS = 4, SUB = 1 << SUB_BITS, MAX_BITS = 40,
+	 BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB };
+  latency_histogram () { reset (); }
+  // only one thread may record
+  void record (monotonic::ns value)
+  {
+    uint64_t v = value < 0 ? 0 : uint64_t (value);
+    m_bucket[l_bucket (v)].fetch_add (1, std::memory_order_relaxed);
+    m_count.fetch_add (1, std::memory_order_relaxed);
+    if (v > m_max.load (std::memory_order_relaxed) )
+      m_max.store (v, std::memory_order_relaxed);
+  }
+  uint64_t count () const { return m_count.load (std::memory_order_relaxed); }
+  monotonic::ns max () const
+  { return monotonic::ns (m_max.load (std::memory_order_relaxed) ); }
+  // value which fraction q of the samples doesn't exceed, rounded up to
+  // the end of its bucket; 0 without samples
+  monotonic::ns percentile (double q) const;
+  // a sample recorded during the reset may survive it
+  void reset ();
+private:
+  // not copyable
+  latency_histogram (latency_histogram const &);
+  void operator= (latency_histogram const &);
+  static unsigned l_bucket (uint64_t v);
+  // largest value which goes in bucket idx
+  static uint64_t l_top (unsigned idx);
+  std::atomic <uint64_t> m_bucket[BUCKETS];
+  std::atomic <uint64_t> m_count, m_max;
+};
+
+struct acquisition_stats
+{
+  // the stages of a measurement, each timed from the end of the one
+  // before it:
+  // ISSUE: start_read until the start command is sent
+  // WAIT: end of the integration until the first byte of data arrives;
+  //   with external trigger this includes the wait for the trigger.
+  //   Backends which don't report partial messages (see
+  //   avaspec::hardware::progress) only tell when a message is complete,
+  //   so for them this includes the transfer of the first channel.
+  // TRANSFER: first byte until the data of the last channel is in
+  // DECODE: until the last channel is decoded
+  // PUBLISH: until the owner of the data passed it on (avaspec::published)
+  // TOTAL: start_read until PUBLISH
+  enum stage { ISSUE, WAIT, TRANSFER, DECODE, PUBLISH, TOTAL, STAGES };
+  latency_histogram latency[STAGES];
+  // measurements completed, and which failed for lack of data or were
+  // cancelled.  Retries are messages which the backend had to receive
+  // again, or replies it threw away.  Bad frames are completed
+  // measurements with a message which was not valid data.
+  std::atomic <uint64_t> frames, timeouts, retries, cancels, bad_frames;
+  // spectra with pixels at full scale, and the number of those pixels,
+  // as the owner of the data counted them (avaspec::saturated)
+  std::atomic <uint64_t> saturated_frames, saturated_pixels;
+  acquisition_stats ()
+    : frames (0), timeouts (0), retries (0), cancels (0), bad_frames (0),
+      saturated_frames (0), saturated_pixels (0)
+  {}
+  void count (std::atomic <uint64_t> &counter)
+  { counter.fetch_add (1, std::memory_order_relaxed); }
+  void reset ();
+private:
+  // not copyable
+  acquisition_stats (acquisition_stats const &);
+  void operator= (acquisition_stats const &);
+};
+
+#endif // defined AVASPEC_STATS_HH
@@ -0,0 +1,139 @@
+/*
+ *  testcoadd.cpp
+ *  avaspec
+ *
+ *  Checks the co-adding of spectra against plain code: the rounded
+ *  averages of complete and incomplete groups, and the sigma clipping,
+ *  which must leave out the values which are more than clip standard
+ *  deviations from the mean of the other frames.  Prints the failures,
+ *  and returns 1 if there were any.
+ *
+ */
+
+#include "coadd.hpp"
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+static unsigned g_failures = 0;
+
+static void check(bool ok, char const *what, unsigned frames, float clip)
+{
+    if (ok) return;
+    printf("%s differs for groups of %u, clip %g\n", what, frames, clip);
+    ++g_failures;
+}
+
+// deterministic test data
+static uint32_t g_seed = 12345;
+
+static uint32_t next()
+{
+    g_seed = g_seed * 1664525u + 1013904223u;
+    return g_seed >> 8;
+}
+
+// the average of one pixel over the frames of a group, as documented.
+// coadder works in float, so a value within rounding of the clip limit
+// may go either way; sure is false then.
+static short expected(std::vector<short> const &values, float clip,
+                      bool &sure)
+{
+    sure = true;
+    unsigned n = values.size();
+    if (n == 0) return 0;
+    double sum = 0;
+    for (unsigned f = 0; f < n; ++f) sum += values[f];
+    if (clip <= 0 || n < 3) return short(lrint(sum / n));
+    double kept = 0;
+    unsigned used = 0;
+    for (unsigned f = 0; f < n; ++f) {
+        // mean and standard deviation of the other frames
+        double mean = (sum - values[f]) / (n - 1), squares = 0;
+        for (unsigned g = 0; g < n; ++g)
+            if (g != f) squares += (values[g] - mean) * (values[g] - mean);
+        double d = values[f] - mean;
+        double limit = double(clip) * clip * squares / (n - 1);
+        if (fabs(d * d - limit) <= 1e-3 * limit + 1e-3) sure = false;
+        if (d * d <= limit) {
+            kept += values[f];
+            ++used;
+        }
+    }
+    return short(lrint(used ? kept / used : sum / n));
+}
+
+// spectra around a level per pixel, with some noise and, if outliers,
+// a few values far away
+static void make_frame(short *target, std::vector<short> const &level,
+                       bool outliers)
+{
+    for (unsigned i = 0; i < level.size(); ++i) {
+        target[i] = level[i] + short(next() % 21) - 10;
+        if (outliers && next() % 16 == 0)
+            target[i] += next() % 2 ? 3000 : -3000;
+    }
+}
+
+static void test_groups(unsigned frames, unsigned pixels, float clip)
+{
+    coadder c;
+    c.setup(frames, pixels, clip);
+    check(c.frames() == (frames ? frames : 1), "frames", frames, clip);
+    frames = c.frames();
+    std::vector<short> level(pixels);
+    for (unsigned i = 0; i < pixels; ++i)
+        level[i] = short(next() % 30000) - 10000;
+    std::vector<std::vector<short> > values(pixels);
+    std::vector<short> got(pixels), want(pixels);
+    unsigned checked = 0;
+    // two complete groups, then an incomplete one
+    for (unsigned group = 0; group < 3; ++group) {
+        unsigned count = group < 2 ? frames : frames / 2;
+        for (unsigned i = 0; i < pixels; ++i) values[i].clear();
+        bool complete = false;
+        for (unsigned f = 0; f < count; ++f) {
+            short *frame = c.next();
+            make_frame(frame, level, clip > 0);
+            for (unsigned i = 0; i < pixels; ++i)
+                values[i].push_back(frame[i]);
+            complete = c.add();
+            check(c.pending() == f + 1, "pending", frames, clip);
+        }
+        check(complete == (count == frames), "add", frames, clip);
+        c.result(&got[0]);
+        check(c.pending() == 0, "pending after result", frames, clip);
+        for (unsigned i = 0; i < pixels; ++i) {
+            bool sure;
+            want[i] = expected(values[i], clip, sure);
+            if (sure) ++checked;
+            else want[i] = got[i];
+        }
+        check(got == want, "average", frames, clip);
+    }
+
+    // nearly all pixels must have been checked
+    check(checked >= 3 * pixels - pixels / 10, "number of checks", frames,
+          clip);
+
+    // clear drops the frames added so far
+    make_frame(c.next(), level, false);
+    c.add();
+    c.clear();
+    c.result(&got[0]);
+    check(got == std::vector<short>(pixels, 0), "clear", frames, clip);
+}
+
+int main()
+{
+    unsigned const frames[] = { 0, 1, 2, 3, 4, 7, 16, 50 };
+    // limits which are not small fractions, so few values are near them
+    float const clips[] = { 0, 2.24f, 3.47f };
+    for (unsigned f = 0; f < sizeof(frames) / sizeof(frames[0]); ++f)
+        for (unsigned c = 0; c < sizeof(clips) / sizeof(clips[0]); ++c)
+            test_groups(frames[f], 2051, clips[c]);
+    printf("%u failures\n", g_failures);
+    return g_failures ? 1 : 0;
+}
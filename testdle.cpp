@@ -0,0 +1,154 @@
+/*
+ *  testdle.cpp
+ *  avaspec
+ *
+ *  Round trips through the DLE framing: frames from dle_encode are fed
+ *  to a dle_deframer in pieces of every size, with noise between them,
+ *  and must come out as they went in.  Also checks the frames which are
+ *  dropped: too long, unterminated and badly escaped ones.  Prints the
+ *  failures, and returns 1 if there were any.
+ *
+ */
+
+#include "dle.hpp"
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+static unsigned g_failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    if (ok) return;
+    printf("%s failed\n", what);
+    ++g_failures;
+}
+
+// deterministic test data
+static uint32_t g_seed = 12345;
+
+static uint32_t next()
+{
+    g_seed = g_seed * 1664525u + 1013904223u;
+    return g_seed >> 8;
+}
+
+// bytes with many of the framing ones among them
+static std::string random_bytes(unsigned size)
+{
+    std::string s(size, '\0');
+    for (unsigned i = 0; i < size; ++i) {
+        uint32_t r = next();
+        s[i] = r % 4 == 0 ? char(dle_deframer::DLE)
+            : r % 4 == 1 ? char(dle_deframer::STX + (r >> 4) % 2)
+            : char(r >> 4);
+    }
+    return s;
+}
+
+static std::string encode(std::string const &head, std::string const &body)
+{
+    std::vector<char> frame(dle_max_frame(head.size() + body.size()));
+    unsigned size = dle_encode(head.data(), head.size(), body.data(),
+                               body.size(), &frame[0]);
+    check(size <= frame.size(), "dle_max_frame");
+    return std::string(&frame[0], size);
+}
+
+// feed stream to the deframer in pieces of at most piece bytes, and
+// collect what it returns
+static void deframe(dle_deframer &d, std::string const &stream,
+                    unsigned piece, std::vector<std::string> &frames,
+                    unsigned &too_long)
+{
+    unsigned done = 0;
+    while (done < stream.size()) {
+        unsigned size;
+        char *space = d.space(size);
+        if (size > piece) size = piece;
+        if (size > stream.size() - done) size = stream.size() - done;
+        memcpy(space, stream.data() + done, size);
+        d.commit(size);
+        done += size;
+        for (;;) {
+            dle_deframer::result r = d.next();
+            if (r == dle_deframer::MORE) break;
+            if (r == dle_deframer::TOO_LONG) ++too_long;
+            else frames.push_back(std::string(d.frame(), d.frame_size()));
+        }
+    }
+}
+
+static void test_round_trip(unsigned piece)
+{
+    unsigned const max = 5000;
+    dle_deframer d(max);
+    std::vector<std::string> sent;
+    std::string stream;
+    unsigned const sizes[] = { 0, 1, 2, 3, 16, 17, 100, 4095, max - 4 };
+    // enough frames to go round the ring a few times
+    for (unsigned n = 0; n < 40; ++n) {
+        std::string head = random_bytes(4);
+        std::string body = random_bytes(sizes[n % 9]);
+        sent.push_back(head + body);
+        // noise between frames, which must not hold a frame head
+        if (n % 3 == 0) stream += "noise";
+        stream += encode(head, body);
+    }
+    std::vector<std::string> got;
+    unsigned too_long = 0;
+    deframe(d, stream, piece, got, too_long);
+    check(got == sent && too_long == 0, "round trip");
+}
+
+static void test_too_long()
+{
+    dle_deframer d(100);
+    std::string fits = random_bytes(96);
+    std::string stream = encode("head", fits)
+        + encode("head", std::string(200, dle_deframer::DLE))
+        + encode("head", "after");
+    std::vector<std::string> got;
+    unsigned too_long = 0;
+    deframe(d, stream, 7, got, too_long);
+    check(got.size() == 2 && too_long == 1 && got[0] == "head" + fits
+          && got[1] == "headafter",
+          "too long frame");
+}
+
+static void test_broken()
+{
+    dle_deframer d(100);
+    std::string const dle(1, dle_deframer::DLE);
+    // a frame head inside a frame restarts it, a bad escape drops it
+    std::string stream = dle + "\002lost" + dle + "\002kept" + dle + "\003"
+        + dle + "\002bad" + dle + "x" + dle + "\003"
+        + dle + dle + "\002last" + dle + "\003";
+    std::vector<std::string> got;
+    unsigned too_long = 0;
+    deframe(d, stream, 1, got, too_long);
+    check(got.size() == 2 && got[0] == "kept" && got[1] == "last",
+          "broken frames");
+
+    // reset forgets a partial frame
+    d.reset();
+    got.clear();
+    deframe(d, dle + "\002partial", 100, got, too_long);
+    d.reset();
+    deframe(d, "rest" + dle + "\003" + encode("", "whole"), 100, got,
+            too_long);
+    check(got.size() == 1 && got[0] == "whole", "reset");
+}
+
+int main()
+{
+    unsigned const pieces[] = { 1, 2, 3, 7, 64, 1000, 1u << 16 };
+    for (unsigned p = 0; p < sizeof(pieces) / sizeof(pieces[0]); ++p)
+        test_round_trip(pieces[p]);
+    test_too_long();
+    test_broken();
+    printf("%u failures\n", g_failures);
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+/*
+ *  testkernels.cpp
+ *  avaspec
+ *
+ *  Checks that the per-pixel kernels give the same results as plain
+ *  scalar code, to the last bit, for the instruction set which is
+ *  selected.  Run it once per instruction set, with AVASPEC_ISA=scalar,
+ *  sse2 and unset (see kernels::isa).  The lengths include odd ones and
+ *  the sources are misaligned, so the tails of the vector loops are
+ *  covered too.  Prints the failures, and returns 1 if there were any.
+ *
+ */
+
+#include "kernels.hpp"
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+static unsigned g_failures = 0;
+
+static void check(bool ok, char const *kernel, unsigned count)
+{
+    if (ok) return;
+    printf("%s differs for %u pixels with %s\n", kernel, count, kernels::isa());
+    ++g_failures;
+}
+
+// deterministic test data
+static uint32_t g_seed = 12345;
+
+static uint32_t next()
+{
+    g_seed = g_seed * 1664525u + 1013904223u;
+    return g_seed >> 8;
+}
+
+static void test_decode(unsigned count, bool bad)
+{
+    std::vector<char> raw(2 * count + 1);
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned value = (next() & 0x3fff) << 2;
+        raw[1 + 2 * i] = value & 0xff;
+        raw[1 + 2 * i + 1] = value >> 8;
+    }
+    if (bad && count) raw[1 + 2 * (next() % count)] |= 1;
+    std::vector<unsigned short> got(count + 1), want(count + 1);
+    bool ok = kernels::decode_pixels(&raw[1], &got[0], count);
+    unsigned flags = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned value = (raw[1 + 2 * i] & 0xff)
+            + ((raw[1 + 2 * i + 1] & 0xff) << 8);
+        flags |= value;
+        want[i] = value >> 2;
+    }
+    check(ok == ((flags & 3) == 0) && got == want, "decode_pixels", count);
+}
+
+static void test_find_byte(unsigned count)
+{
+    std::vector<char> data(count + 1);
+    for (unsigned i = 0; i < count; ++i) data[1 + i] = 1 + next() % 200;
+    // no match, then one at every few places
+    check(kernels::find_byte(&data[1], count, 0) == count, "find_byte",
+          count);
+    for (unsigned at = 0; at < count; at += 1 + count / 7) {
+        char c = data[1 + at];
+        check(kernels::find_byte(&data[1], count, c)
+              == unsigned((char *)memchr(&data[1], c, count) - &data[1]),
+              "find_byte", count);
+    }
+}
+
+static void test_synthesize(unsigned count)
+{
+    std::vector<float> mean(count + 1);
+    for (unsigned i = 0; i < count; ++i) mean[i] = next() % 20000;
+    uint32_t got_state[kernels::NOISE_LANES], want_state[kernels::NOISE_LANES];
+    for (unsigned l = 0; l < kernels::NOISE_LANES; ++l)
+        got_state[l] = want_state[l] = 1 + next();
+    std::vector<char> got(2 * count + 1), want(2 * count + 1);
+    kernels::synthesize(&mean[0], count, 2.5f, 100.f, 16383.f, got_state,
+                        &got[0]);
+    // as the emulation documents it: four uniform numbers per pixel,
+    // scaled to unit variance
+    for (unsigned i = 0; i < count; ++i) {
+        uint32_t &s = want_state[i % kernels::NOISE_LANES];
+        float u = 0;
+        for (unsigned j = 0; j < 4; ++j) {
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            u += float(s >> 8) * (1.f / (1 << 24));
+        }
+        float value = mean[i]
+            + sqrtf(2.5f * mean[i] + 100.f) * ((u - 2) * 1.7320508f);
+        value = value < 0 ? 0 : value > 16383.f ? 16383.f : value;
+        unsigned raw = unsigned(lrintf(value)) << 2;
+        want[2 * i] = raw & 0xff;
+        want[2 * i + 1] = (raw >> 8) & 0xff;
+    }
+    check(got == want
+          && !memcmp(got_state, want_state, sizeof(got_state)),
+          "synthesize", count);
+}
+
+static void test_polynomial(unsigned count)
+{
+    double const coef[5] = { 335.85, 0.138515, -6.14672e-06, -7.41674e-10,
+                             1e-14 };
+    for (unsigned terms = 0; terms <= 5; ++terms) {
+        std::vector<float> got(count + 1), want(count + 1);
+        kernels::polynomial(coef, terms, count, &got[0]);
+        for (unsigned i = 0; i < count; ++i) {
+            // Horner's method, without fused multiply-add
+            double y = terms ? coef[terms - 1] : 0;
+            for (unsigned k = terms - 1; terms && k > 0; --k) {
+                volatile double product = y * i;
+                y = product + coef[k - 1];
+            }
+            want[i] = float(y);
+        }
+        check(got == want, "polynomial", count);
+    }
+}
+
+static void test_subtract_dark(unsigned count, bool nonlinear)
+{
+    std::vector<unsigned short> src(count + 1), extra(14);
+    for (unsigned i = 0; i < count; ++i) src[1 + i] = next() & 0x3fff;
+    for (unsigned i = 0; i < extra.size(); ++i)
+        extra[i] = 500 + next() % 100;
+    std::vector<unsigned short> table(kernels::LINEAR_SIZE + 1);
+    double const coef[2] = { 1, -1e-5 };
+    kernels::linear_table(coef, 2, &table[0]);
+    unsigned short const *t = nonlinear ? &table[0] : 0;
+    short const saturated = 16000;
+    std::vector<short> got(count + 1), want(count + 1);
+    unsigned got_hits = kernels::subtract_dark(&src[1], count, &extra[0],
+                                               extra.size(), t, saturated,
+                                               &got[0]);
+    int32_t sum = 0;
+    for (unsigned i = 0; i < extra.size(); ++i)
+        sum += t ? t[extra[i]] : extra[i];
+    short dark = short(sum / int32_t(extra.size()));
+    unsigned want_hits = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        short value = src[1 + i];
+        if (value >= saturated) {
+            ++want_hits;
+            want[i] = value;
+        } else {
+            want[i] = short((t ? t[src[1 + i]] : src[1 + i]) - dark);
+        }
+    }
+    check(got == want && got_hits == want_hits, "subtract_dark", count);
+}
+
+static void test_flat_field(unsigned count)
+{
+    std::vector<short> src(count + 1);
+    std::vector<float> gain(count + 1);
+    for (unsigned i = 0; i < count; ++i) {
+        src[1 + i] = short(next() % 20000) - 1000;
+        gain[1 + i] = 1.f / (1 + next() % 5000);
+    }
+    std::vector<float> got(count + 1), want(count + 1);
+    kernels::flat_field(&src[1], &gain[1], count, 0.37f, &got[0]);
+    for (unsigned i = 0; i < count; ++i) {
+        volatile float product = float(src[1 + i]) * gain[1 + i];
+        want[i] = product * 0.37f;
+    }
+    check(got == want, "flat_field", count);
+}
+
+static void test_accumulate(unsigned count)
+{
+    std::vector<short> src(count + 1);
+    std::vector<int32_t> got(count + 1), want(count + 1);
+    for (unsigned i = 0; i < count; ++i) {
+        src[1 + i] = short(next());
+        got[i] = want[i] = int32_t(next()) - (1 << 23);
+    }
+    kernels::accumulate(&src[1], count, &got[0]);
+    for (unsigned i = 0; i < count; ++i) want[i] += src[1 + i];
+    check(got == want, "accumulate", count);
+}
+
+int main()
+{
+    printf("instruction set: %s\n", kernels::isa());
+    unsigned const sizes[] = { 0, 1, 7, 8, 15, 16, 17, 31, 33, 63, 2048,
+                               2051 };
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        unsigned n = sizes[s];
+        test_decode(n, false);
+        test_decode(n, true);
+        test_find_byte(n);
+        test_synthesize(n);
+        test_polynomial(n);
+        test_subtract_dark(n, false);
+        test_subtract_dark(n, true);
+        test_flat_field(n);
+        test_accumulate(n);
+    }
+    printf("%u failures\n", g_failures);
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+/*
+ *  testroi.cpp
+ *  avaspec
+ *
+ *  Checks the regions of interest: resolving pixel and wavelength bands
+ *  to ranges, dropping the empty and invalid ones, and the values which
+ *  region_map::apply stores, binned and not.  Prints the failures, and
+ *  returns 1 if there were any.
+ *
+ */
+
+#include "roi.hpp"
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+static unsigned g_failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    if (ok) return;
+    printf("%s failed\n", what);
+    ++g_failures;
+}
+
+typedef region_map::ranges ranges;
+
+static ranges make(unsigned const *pairs, unsigned count)
+{
+    ranges result;
+    for (unsigned i = 0; i + 1 < count; i += 2)
+        result.push_back(std::make_pair(pairs[i], pairs[i + 1]));
+    return result;
+}
+
+static void test_from_pixels()
+{
+    // rounded, clipped to the spectrum, empty and reversed bands dropped,
+    // and an odd value at the end ignored
+    float const bands[] = { 10.4f, 20.6f, -5, 3, 2040, 3000, 7, 7, 9, 4,
+                            100 };
+    unsigned const want[] = { 10, 21, 0, 3, 2040, 2048 };
+    check(region_map::from_pixels(std::vector<float>(bands, bands + 11),
+                                  2048) == make(want, 6),
+          "from_pixels");
+    check(region_map::from_pixels(std::vector<float>(), 2048).empty(),
+          "from_pixels without bands");
+}
+
+static void test_from_wavelengths()
+{
+    // 200 nm to 1223 nm in 0.5 nm steps, and the same reversed
+    std::vector<float> up(2048), down(2048);
+    for (unsigned i = 0; i < 2048; ++i) {
+        up[i] = 200 + 0.5f * i;
+        down[2047 - i] = up[i];
+    }
+    // the ends are included; bands outside the axis are dropped
+    float const bands[] = { 300, 310, 100, 150, 1200.2f, 2000, 656.1f,
+                            656.4f };
+    std::vector<float> b(bands, bands + 8);
+    unsigned const want_up[] = { 200, 221, 2001, 2048 };
+    check(region_map::from_wavelengths(b, up) == make(want_up, 4),
+          "from_wavelengths, increasing");
+    unsigned const want_down[] = { 1827, 1848, 0, 47 };
+    check(region_map::from_wavelengths(b, down) == make(want_down, 4),
+          "from_wavelengths, decreasing");
+}
+
+// the values apply must store, computed directly
+template <typename T>
+static std::vector<T> expected(ranges const &keep, unsigned bin,
+                               std::vector<T> const &src)
+{
+    std::vector<T> result;
+    for (unsigned r = 0; r < keep.size(); ++r)
+        for (unsigned p = keep[r].first; p < keep[r].second; p += bin) {
+            unsigned end = p + bin < keep[r].second ? p + bin
+                : keep[r].second;
+            double sum = 0;
+            for (unsigned i = p; i < end; ++i) sum += src[i];
+            double mean = sum / (end - p);
+            // shorts round to the nearest, halves away from zero
+            result.push_back(T(T(0.5) == 0 ? (mean < 0 ? mean - 0.5
+                                                 : mean + 0.5)
+                               : mean));
+        }
+    return result;
+}
+
+template <typename T>
+static void test_apply(ranges const &keep, unsigned bin, unsigned pixels,
+                       char const *what)
+{
+    region_map m;
+    m.setup(keep, bin, pixels);
+    // the ranges setup keeps: clipped to the spectrum, non-empty, or all
+    ranges kept;
+    unsigned first = pixels, last = 0;
+    for (unsigned r = 0; r < keep.size(); ++r) {
+        unsigned f = keep[r].first < pixels ? keep[r].first : pixels;
+        unsigned l = keep[r].second < pixels ? keep[r].second : pixels;
+        if (f < l) kept.push_back(std::make_pair(f, l));
+    }
+    if (kept.empty()) kept.push_back(std::make_pair(0u, pixels));
+    for (unsigned r = 0; r < kept.size(); ++r) {
+        if (kept[r].first < first) first = kept[r].first;
+        if (kept[r].second > last) last = kept[r].second;
+    }
+    std::vector<T> src(pixels);
+    uint32_t seed = 12345;
+    for (unsigned i = 0; i < pixels; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        src[i] = T(int((seed >> 8) % 30001) - 10000);
+    }
+    std::vector<T> want = expected(kept, bin ? bin : 1, src);
+    std::vector<T> got(want.size() + 1, T(-1));
+    m.apply(&src[0], &got[0]);
+    check(m.size() == want.size() && got.back() == T(-1), what);
+    got.pop_back();
+    check(got == want, what);
+    check(m.first() == first && m.last() == last, what);
+    check(m.identity() == (bin <= 1 && kept.size() == 1 && first == 0
+                           && last == pixels),
+          what);
+}
+
+template <typename T>
+static void test_maps()
+{
+    unsigned const one[] = { 100, 200 };
+    unsigned const several[] = { 1500, 1523, 10, 17, 2000, 2100 };
+    unsigned const invalid[] = { 50, 50, 90, 80, 3000, 4000 };
+    unsigned const all[] = { 0, 2048 };
+    unsigned const bins[] = { 0, 1, 2, 3, 8, 64 };
+    for (unsigned b = 0; b < sizeof(bins) / sizeof(bins[0]); ++b) {
+        unsigned bin = bins[b];
+        test_apply<T>(make(one, 2), bin, 2048, "one range");
+        test_apply<T>(make(several, 6), bin, 2048, "several ranges");
+        test_apply<T>(make(invalid, 6), bin, 2048, "invalid ranges");
+        test_apply<T>(ranges(), bin, 2048, "no ranges");
+        test_apply<T>(make(all, 2), bin, 2048, "all pixels");
+    }
+}
+
+int main()
+{
+    test_from_pixels();
+    test_from_wavelengths();
+    test_maps<short>();
+    test_maps<float>();
+    printf("%u failures\n", g_failures);
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/*
+ *  trace.cpp
+ *  avaspec
+ *
+ *  The rings of the binary trace, and writing them to a file.  Nothing
+ *  here uses startfunc, because startfunc records into the trace.
+ *
+ */
+
+#include "trace.hpp"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h> // memcpy, strlen
+#include <vector>
+#include <set>
+
+std::atomic <unsigned> trace::current_level (trace::OFF);
+thread_local trace::ring *trace::current_ring = 0;
+
+namespace
+{
+  char const MAGIC[8] = { 'A', 'V', 'A', 'T', 'R', 'A', 'C', 'E' };
+  // all rings ever made, and where to dump on errors, guarded by lock
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  std::vector <trace::ring *> rings;
+  unsigned threads = 0;
+  std::string error_file;
+
+  // gives the ring back when its thread ends
+  struct releaser
+  {
+    ~releaser ()
+    {
+      if (!trace::current_ring)
+	return;
+      pthread_mutex_lock (&lock);
+      trace::current_ring->free = true;
+      trace::current_ring = 0;
+      pthread_mutex_unlock (&lock);
+    }
+  };
+
+  // the part of a ring which belongs to one thread
+  struct segment
+  {
+    unsigned thread;
+    std::vector <trace::record> records;
+  };
+
+  // copy the records of r which were complete, and not being
+  // overwritten while we copied them.  Every run of records of one
+  // thread becomes a segment.
+  void snapshot (trace::ring *r, std::vector <segment> &target)
+  {
+    uint64_t head = r->head.load (std::memory_order_acquire);
+    uint64_t first = head > trace::RECORDS ? head - trace::RECORDS : 0;
+    segment *current = 0;
+    for (uint64_t i = first; i < head; ++i)
+      {
+	trace::slot const &s = r->slots[i % trace::RECORDS];
+	if (s.seq.load (std::memory_order_acquire) != i + 1)
+	  continue;
+	trace::record rec = s.rec;
+	unsigned thread = s.thread;
+	// like a seqlock: if the writer started on the slot while we
+	// copied, seq has changed
+	std::atomic_thread_fence (std::memory_order_acquire);
+	if (s.seq.load (std::memory_order_relaxed) != i + 1)
+	  continue;
+	if (!current || current->thread != thread)
+	  {
+	    target.push_back (segment () );
+	    current = &target.back ();
+	    current->thread = thread;
+	  }
+	current->records.push_back (rec);
+      }
+  }
+}
+
+void trace::set_level (level_t level)
+{
+  current_level.store (level, std::memory_order_relaxed);
+}
+
+trace::ring *trace::attach ()
+{
+  static thread_local releaser release;
+  (void)&release;
+  pthread_mutex_lock (&lock);
+  ring *r = 0;
+  for (unsigned i = 0; i < rings.size (); ++i)
+    {
+      if (rings[i]->free)
+	{
+	  r = rings[i];
+	  break;
+	}
+    }
+  if (!r)
+    {
+      r = new ring;
+      r->head.store (0, std::memory_order_relaxed);
+      for (unsigned i = 0; i < RECORDS; ++i)
+	r->slots[i].seq.store (0, std::memory_order_relaxed);
+      rings.push_back (r);
+    }
+  r->thread = ++threads;
+  r->free = false;
+  pthread_mutex_unlock (&lock);
+  current_ring = r;
+  return r;
+}
+
+bool trace::dump (std::string const &file)
+{
+  pthread_mutex_lock (&lock);
+  std::vector <ring *> all (rings);
+  pthread_mutex_unlock (&lock);
+  std::vector <segment> segments;
+  for (unsigned i = 0; i < all.size (); ++i)
+    snapshot (all[i], segments);
+  std::set <char const *> strings;
+  for (unsigned s = 0; s < segments.size (); ++s)
+    for (unsigned i = 0; i < segments[s].records.size (); ++i)
+      strings.insert (segments[s].records[i].what);
+
+  FILE *f = ::fopen (file.c_str (), "wb");
+  if (!f)
+    return false;
+  file_header header;
+  ::memcpy (header.magic, MAGIC, sizeof (header.magic) );
+  header.version = file_header::VERSION;
+  header.rings = segments.size ();
+  header.strings = strings.size ();
+  header.reserved = 0;
+  bool ok = ::fwrite (&header, sizeof (header), 1, f) == 1;
+  for (unsigned s = 0; ok && s < segments.size (); ++s)
+    {
+      file_ring fr;
+      fr.thread = segments[s].thread;
+      fr.count = segments[s].records.size ();
+      ok = ::fwrite (&fr, sizeof (fr), 1, f) == 1;
+      for (unsigned i = 0; ok && i < fr.count; ++i)
+	{
+	  record const &r = segments[s].records[i];
+	  file_record out;
+	  out.time = r.time;
+	  out.what = uint64_t (uintptr_t (r.what) );
+	  out.a = r.a;
+	  out.b = r.b;
+	  ok = ::fwrite (&out, sizeof (out), 1, f) == 1;
+	}
+    }
+  for (std::set <char const *>::const_iterator i = strings.begin ();
+       ok && i != strings.end (); ++i)
+    {
+      file_string fs;
+      fs.what = uint64_t (uintptr_t (*i) );
+      fs.size = *i ? ::strlen (*i) : 0;
+      fs.reserved = 0;
+      ok = ::fwrite (&fs, sizeof (fs), 1, f) == 1
+	&& ::fwrite (*i, 1, fs.size, f) == fs.size;
+    }
+  if (::fclose (f) != 0)
+    ok = false;
+  return ok;
+}
+
+void trace::dump_on_error (std::string const &file)
+{
+  pthread_mutex_lock (&lock);
+  error_file = file;
+  pthread_mutex_unlock (&lock);
+}
+
+void trace::error ()
+{
+  if (!events () )
+    return;
+  add ("error", 0, 0);
+  pthread_mutex_lock (&lock);
+  std::string file = error_file;
+  pthread_mutex_unlock (&lock);
+  if (!file.empty () && !dump (file) )
+    ::fprintf (stderr, "Warning: unable to write trace to %s\n",
+	       file.c_str () );
+}
@@ -0,0 +1,133 @@
+/*
+ *  trace.hpp
+ *  avaspec
+ *
+ *  Binary trace of what the driver does, cheap enough to leave on during
+ *  shots.  Every thread writes fixed size records (time, what, two
+ *  numbers) to a ring of its own, so recording takes no locks and no
+ *  formatting; the oldest records are overwritten.  dump writes all rings
+ *  to a file, which avaspec_trace prints as a timeline.
+ *
+ *  Record events with trace_event; with level CALLS, startfunc records
+ *  every function entry as well.
+ *
+ */
+
+#ifndef AVASPEC_TRACE_HH
+#define AVASPEC_TRACE_HH
+
+#include "clock.hpp"
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+namespace trace
+{
+  // what is recorded: nothing, trace_event, or also startfunc
+  enum level_t { OFF = 0, EVENTS = 1, CALLS = 2 };
+  // records per thread
+  enum { RECORDS = 4096 };
+
+  struct record
+  {
+    monotonic::ns time;
+    // a string with static storage duration, usually a literal
+    char const *what;
+    int64_t a, b;
+  };
+
+  // A record in a ring, with the number of the thread which wrote it,
+  // because a ring is reused when its thread has ended.  seq is the
+  // number of the record plus one once it is complete, and 0 while it is
+  // written; dump only takes records for which it is right before and
+  // after the copy.
+  struct slot
+  {
+    std::atomic <uint64_t> seq;
+    unsigned thread;
+    record rec;
+  };
+
+  struct ring
+  {
+    // number of records ever written; the last RECORDS of them are in
+    // slots
+    std::atomic <uint64_t> head;
+    // number of the thread, in the order they started tracing
+    unsigned thread;
+    bool free;
+    slot slots[RECORDS];
+  };
+
+  extern std::atomic <unsigned> current_level;
+  extern thread_local ring *current_ring;
+
+  inline bool events ()
+  { return current_level.load (std::memory_order_relaxed) >= EVENTS; }
+  inline bool calls ()
+  { return current_level.load (std::memory_order_relaxed) >= CALLS; }
+  void set_level (level_t level);
+
+  // the ring of this thread, made on first use
+  ring *attach ();
+  inline void add (char const *what, int64_t a, int64_t b)
+  {
+    ring *r = current_ring;
+    if (!r)
+      r = attach ();
+    uint64_t head = r->head.load (std::memory_order_relaxed);
+    slot &s = r->slots[head % RECORDS];
+    // a dump which sees any of the new record also sees that the slot
+    // is being written
+    s.seq.store (0, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_release);
+    s.thread = r->thread;
+    s.rec.time = monotonic::now ();
+    s.rec.what = what;
+    s.rec.a = a;
+    s.rec.b = b;
+    s.seq.store (head + 1, std::memory_order_release);
+    r->head.store (head + 1, std::memory_order_release);
+  }
+
+  // write the rings of all threads to file.  This may be called from any
+  // thread while the others record.  Returns false if the file could not
+  // be written.
+  bool dump (std::string const &file);
+  // dump to file whenever an error is reported (see error.hpp); empty
+  // turns it off
+  void dump_on_error (std::string const &file);
+  // called by the error handler
+  void error ();
+
+  // the dump file: a file_header, then for every ring a file_ring
+  // followed by its records, then for every distinct what a file_string
+  // followed by its text
+  struct file_header
+  {
+    enum { VERSION = 1 };
+    char magic[8]; // "AVATRACE"
+    uint32_t version, rings, strings, reserved;
+  };
+  struct file_ring
+  {
+    uint32_t thread, count;
+  };
+  struct file_record
+  {
+    int64_t time;
+    // the address of what in the traced program, see file_string
+    uint64_t what;
+    int64_t a, b;
+  };
+  struct file_string
+  {
+    uint64_t what;
+    uint32_t size, reserved;
+  };
+}
+
+#define trace_event(what, a, b) \
+do { if (trace::events ()) trace::add (what, a, b); } while (0)
+
+#endif // defined AVASPEC_TRACE_HH
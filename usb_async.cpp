@@ -0,0 +1,436 @@
+/*
+ *  usb_async.cpp
+ *  avaspec
+ *
+ *  usb backend on the native libusb-1.0 api, with queued bulk transfers.
+ *
+ */
+
+#include "usb_async.hpp"
+#include "debug.hpp" // startfunc, dbg
+#include "error.hpp"
+#include "deferred.hpp"
+#include <string.h> // memcpy, memmove
+
+bool avaspec::usb_async::l_find_device (unsigned vendor, unsigned product,
+					unsigned skip)
+{
+  startfunc;
+  libusb_device **list;
+  ssize_t num = libusb_get_device_list (m_context, &list);
+  if (num < 0)
+    {
+      shevek_error ("unable to find usb devices: " << libusb_error_name (num) );
+      return false;
+    }
+  bool found = false;
+  unsigned skipped = 0;
+  for (ssize_t d = 0; d < num && !found; ++d)
+    {
+      libusb_device_descriptor desc;
+      if (libusb_get_device_descriptor (list[d], &desc) < 0
+	  || desc.idVendor != vendor || desc.idProduct != product)
+	continue;
+      if (skip > skipped++)
+	continue;
+      libusb_config_descriptor *config;
+      if (libusb_get_active_config_descriptor (list[d], &config) < 0)
+	continue;
+      libusb_interface_descriptor const *alt
+	= config->interface->altsetting;
+      m_interface = alt->bInterfaceNumber;
+      bool have_in = false, have_out = false, ok = true;
+      for (unsigned i = 0; i < alt->bNumEndpoints; ++i)
+	{
+	  libusb_endpoint_descriptor const *ep = &alt->endpoint[i];
+	  if ( (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+	       != LIBUSB_TRANSFER_TYPE_BULK)
+	    continue;
+	  bool &have = (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+	    ? have_in : have_out;
+	  if (have)
+	    ok = false;
+	  have = true;
+	  if (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+	    m_in_ep = ep->bEndpointAddress;
+	  else
+	    m_out_ep = ep->bEndpointAddress;
+	}
+      libusb_free_config_descriptor (config);
+      if (!ok)
+	{
+	  libusb_free_device_list (list, 1);
+	  shevek_error ("invalid device: more than one endpoint per direction");
+	  return false;
+	}
+      int err = libusb_open (list[d], &m_handle);
+      if (err < 0)
+	{
+	  libusb_free_device_list (list, 1);
+	  shevek_error ("unable to open usb device: "
+			<< libusb_error_name (err) );
+	  return false;
+	}
+      found = true;
+    }
+  libusb_free_device_list (list, 1);
+  return found;
+}
+
+avaspec::usb_async::usb_async (unsigned vendor, unsigned product,
+			       unsigned skip)
+  : m_context (0), m_handle (0), m_pending (0), m_closing (false),
+    m_error (LIBUSB_TRANSFER_COMPLETED), m_head (0), m_tail (0),
+    m_num_ends (0), m_expected (0), m_arrived (0), m_interrupted (false),
+    m_allow_interrupt (false)
+{
+  startfunc;
+  for (unsigned i = 0; i < TRANSFERS; ++i)
+    {
+      m_transfer[i] = 0;
+      m_busy[i] = false;
+    }
+  int err = libusb_init (&m_context);
+  if (err < 0)
+    {
+      shevek_error ("unable to initialize libusb: "
+		    << libusb_error_name (err) );
+      return;
+    }
+  if (!l_find_device (vendor, product, skip) )
+    {
+      libusb_exit (m_context);
+      shevek_error ("unable to find specified usb device 0x" << std::hex
+		    << vendor << "/0x" << product << ';' << std::dec << skip);
+      return;
+    }
+  err = libusb_reset_device (m_handle);
+  if (err == LIBUSB_ERROR_NOT_FOUND)
+    {
+      // the device reenumerated, find it again
+      libusb_close (m_handle);
+      m_handle = 0;
+      if (!l_find_device (vendor, product, skip) )
+	{
+	  libusb_exit (m_context);
+	  shevek_error ("usb device 0x" << std::hex << vendor << "/0x"
+			<< product << ';' << std::dec << skip
+			<< " disappeared after reset");
+	  return;
+	}
+    }
+  else if (err < 0)
+    shevek_warning ("unable to reset usb device: " << libusb_error_name (err) );
+  err = libusb_claim_interface (m_handle, m_interface);
+  if (err < 0)
+    {
+      libusb_close (m_handle);
+      libusb_exit (m_context);
+      shevek_error ("unable to claim usb interface: "
+		    << libusb_error_name (err) );
+      return;
+    }
+  m_stash.reserve (STASH);
+  m_transfer_data.reserve (TRANSFERS * TRANSFER_SIZE);
+  for (unsigned i = 0; i < TRANSFERS; ++i)
+    {
+      m_transfer[i] = libusb_alloc_transfer (0);
+      libusb_fill_bulk_transfer
+	(m_transfer[i], m_handle, m_in_ep,
+	 reinterpret_cast <unsigned char *> (m_transfer_data.data () )
+	 + i * TRANSFER_SIZE, TRANSFER_SIZE, l_callback, this, 0);
+      l_submit (i);
+    }
+}
+
+avaspec::usb_async::~usb_async ()
+{
+  startfunc;
+  m_closing = true;
+  for (unsigned i = 0; i < TRANSFERS; ++i)
+    if (m_busy[i])
+      libusb_cancel_transfer (m_transfer[i]);
+  // the transfers may only be freed after they came back
+  monotonic::ns deadline = monotonic::now () + 1000 * monotonic::MS;
+  while (m_pending && monotonic::now () < deadline)
+    {
+      struct timeval tv = { 0, 100000 };
+      libusb_handle_events_timeout_completed (m_context, &tv, 0);
+    }
+  for (unsigned i = 0; i < TRANSFERS; ++i)
+    if (!m_busy[i])
+      libusb_free_transfer (m_transfer[i]);
+  libusb_release_interface (m_handle, m_interface);
+  libusb_close (m_handle);
+  libusb_exit (m_context);
+}
+
+void avaspec::usb_async::l_submit (unsigned idx)
+{
+  startfunc;
+  int err = libusb_submit_transfer (m_transfer[idx]);
+  if (err < 0)
+    {
+      dbg ("unable to submit transfer: " << libusb_error_name (err) );
+      m_error = LIBUSB_TRANSFER_ERROR;
+      return;
+    }
+  m_busy[idx] = true;
+  ++m_pending;
+}
+
+void LIBUSB_CALL avaspec::usb_async::l_callback (libusb_transfer *transfer)
+{
+  static_cast <usb_async *> (transfer->user_data)->l_received (transfer);
+}
+
+void avaspec::usb_async::l_received (libusb_transfer *transfer)
+{
+  // This is called from inside libusb's event handling.  It must not
+  // throw, and it puts the transfer back in the queue as soon as possible.
+  unsigned idx = 0;
+  while (m_transfer[idx] != transfer)
+    ++idx;
+  m_busy[idx] = false;
+  --m_pending;
+  m_arrived = 1;
+  trace_event ("usb_transfer", transfer->status, transfer->actual_length);
+  switch (transfer->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+      // a short transfer ends the message
+      l_store (transfer->buffer, transfer->actual_length,
+	       transfer->actual_length < transfer->length);
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      return;
+    default:
+      // stalls and lost devices are handled in read_message
+      m_error = transfer->status;
+      return;
+    }
+  if (!m_closing)
+    l_submit (idx);
+}
+
+void avaspec::usb_async::l_store (unsigned char const *data, unsigned size,
+				  bool end)
+{
+  if (m_tail + size > m_stash.capacity () )
+    {
+      // move the unread data to the front
+      ::memmove (m_stash.data (), m_stash.data () + m_head, m_tail - m_head);
+      for (unsigned i = 0; i < m_num_ends; ++i)
+	m_ends[i] -= m_head;
+      m_tail -= m_head;
+      m_head = 0;
+      if (m_tail + size > m_stash.capacity () )
+	{
+	  deferred::warning ("usb receive buffer overflow, dropping data");
+	  m_head = m_tail = m_num_ends = 0;
+	}
+    }
+  ::memcpy (m_stash.data () + m_tail, data, size);
+  m_tail += size;
+  if (end && m_tail > m_head)
+    {
+      if (m_num_ends == MAX_ENDS)
+	{
+	  deferred::warning ("too many unread usb messages, dropping data");
+	  m_head = m_tail = m_num_ends = 0;
+	  return;
+	}
+      m_ends[m_num_ends++] = m_tail;
+    }
+}
+
+unsigned avaspec::usb_async::l_available () const
+{
+  if (m_num_ends)
+    return m_ends[0] - m_head;
+  return m_tail - m_head;
+}
+
+bool avaspec::usb_async::l_complete (unsigned &size) const
+{
+  unsigned available = l_available ();
+  if (m_expected && available >= m_expected)
+    {
+      // a reply which is a multiple of the packet size has no short packet
+      size = m_expected;
+      return true;
+    }
+  if (m_num_ends)
+    {
+      size = available;
+      return true;
+    }
+  return false;
+}
+
+void avaspec::usb_async::l_pop (unsigned size)
+{
+  m_head += size;
+  unsigned keep = 0;
+  for (unsigned i = 0; i < m_num_ends; ++i)
+    if (m_ends[i] > m_head)
+      m_ends[keep++] = m_ends[i];
+  m_num_ends = keep;
+  if (m_head == m_tail)
+    m_head = m_tail = 0;
+}
+
+void avaspec::usb_async::write_message (char const *message, unsigned size)
+{
+  startfunc;
+  unsigned done = 0;
+  while (done < size)
+    {
+      int l;
+      int err = libusb_bulk_transfer
+	(m_handle, m_out_ep,
+	 // the library wants a non-const pointer, but doesn't write to it
+	 reinterpret_cast <unsigned char *> (const_cast <char *> (message) )
+	 + done, size - done, &l, 1000);
+      if (err < 0 && err != LIBUSB_ERROR_TIMEOUT)
+	{
+	  shevek_error ("unable to write message to usb device: "
+			<< libusb_error_name (err) );
+	  return;
+	}
+      if (err == LIBUSB_ERROR_TIMEOUT && l == 0)
+	{
+	  shevek_error ("timeout writing message to usb device");
+	  return;
+	}
+      done += l;
+    }
+}
+
+unsigned avaspec::usb_async::read_message (char *buffer, unsigned capacity,
+					   unsigned timeout,
+					   unsigned replysize, char)
+{
+  startfunc;
+  m_expected = replysize;
+  monotonic::ns deadline = monotonic::now ()
+    + timeout * monotonic::ns (monotonic::MS);
+  unsigned reported = 0;
+  while (true)
+    {
+      unsigned size;
+      if (l_complete (size) )
+	{
+	  m_expected = 0;
+	  // keep what fits; the caller sees that the size is wrong
+	  unsigned keep = size;
+	  if (keep > capacity)
+	    {
+	      deferred::warning ("usb message too long for buffer "
+				 "(%lld > %lld)", size, capacity);
+	      keep = capacity;
+	    }
+	  ::memcpy (buffer, m_stash.data () + m_head, keep);
+	  l_pop (size);
+	  return keep;
+	}
+      if (m_error != LIBUSB_TRANSFER_COMPLETED)
+	{
+	  libusb_transfer_status error = m_error;
+	  m_error = LIBUSB_TRANSFER_COMPLETED;
+	  if (error == LIBUSB_TRANSFER_NO_DEVICE)
+	    {
+	      shevek_error ("usb device disappeared");
+	      return 0;
+	    }
+	  if (error == LIBUSB_TRANSFER_STALL)
+	    libusb_clear_halt (m_handle, m_in_ep);
+	  deferred::warning ("usb transfer failed (status %lld), requeueing",
+			     error);
+	  retried ();
+	  for (unsigned i = 0; i < TRANSFERS; ++i)
+	    if (!m_busy[i])
+	      l_submit (i);
+	}
+      // report the part of the message that has arrived
+      unsigned available = l_available ();
+      if (available > reported)
+	{
+	  progress (m_stash.data () + m_head, available);
+	  reported = available;
+	}
+      monotonic::ns left = deadline - monotonic::now ();
+      // the interrupt is left for clear_interrupt, so every read until
+      // then sees it
+      if (left <= 0
+	  || (m_allow_interrupt && m_interrupted.load () ) )
+	{
+	  m_expected = 0;
+	  return 0;
+	}
+      // this returns as soon as a transfer completes
+      struct timeval tv;
+      tv.tv_sec = left / 1000000000;
+      tv.tv_usec = (left % 1000000000) / 1000;
+      m_arrived = 0;
+      libusb_handle_events_timeout_completed (m_context, &tv, &m_arrived);
+    }
+}
+
+void avaspec::usb_async::interrupt ()
+{
+  startfunc;
+  m_interrupted = true;
+#if defined (LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  libusb_interrupt_event_handler (m_context);
+#endif
+}
+
+void avaspec::usb_async::clear_interrupt ()
+{
+  startfunc;
+  m_interrupted = false;
+}
+
+void avaspec::usb_async::allow_interrupt (bool allow)
+{
+  startfunc;
+  m_allow_interrupt = allow;
+}
+
+bool avaspec::usb_async::interruptible () const
+{
+  // libusb_interrupt_event_handler appeared in libusb 1.0.21
+#if defined (LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  return true;
+#else
+  return false;
+#endif
+}
+
+unsigned avaspec::usb_async::try_read_message (char *buffer, unsigned capacity,
+					       unsigned replysize, char reply)
+{
+  startfunc;
+  // handle whatever completed, then take a message if one is complete
+  struct timeval tv = { 0, 0 };
+  libusb_handle_events_timeout_completed (m_context, &tv, 0);
+  return read_message (buffer, capacity, 0, replysize, reply);
+}
+
+unsigned avaspec::usb_async::poll_fds (struct pollfd *fds, unsigned max) const
+{
+  startfunc;
+  libusb_pollfd const **list = libusb_get_pollfds (m_context);
+  if (!list)
+    return 0;
+  unsigned num = 0;
+  for (; list[num]; ++num)
+    if (num < max)
+      {
+	fds[num].fd = list[num]->fd;
+	fds[num].events = list[num]->events;
+      }
+  libusb_free_pollfds (list);
+  return num;
+}
@@ -0,0 +1,82 @@
+/*
+ *  usb_async.hpp
+ *  avaspec
+ *
+ *  usb backend on the native libusb-1.0 api.  Several bulk in transfers
+ *  are kept queued all the time, so the device never waits for the host to
+ *  post a read.  Replies are reassembled from the transfers as they
+ *  complete.  Only included by the files which implement the driver.
+ *
+ */
+
+#ifndef AVASPEC_USB_ASYNC_HH
+#define AVASPEC_USB_ASYNC_HH
+
+#include "avaspec.hpp"
+#include <libusb.h>
+#include <atomic>
+
+class avaspec::usb_async : public avaspec::hardware
+{
+public:
+  usb_async (unsigned vendor, unsigned product, unsigned skip);
+  virtual ~usb_async ();
+  virtual void write_message (char const *message, unsigned size);
+  virtual unsigned read_message (char *buffer, unsigned capacity,
+				 unsigned timeout, unsigned replysize,
+				 char reply);
+  virtual void interrupt ();
+  virtual void clear_interrupt ();
+  virtual void allow_interrupt (bool allow);
+  virtual bool interruptible () const;
+  virtual bool polls () const { return true; }
+  virtual unsigned try_read_message (char *buffer, unsigned capacity,
+				     unsigned replysize, char reply);
+  virtual unsigned poll_fds (struct pollfd *fds, unsigned max) const;
+  // the replies which are on their way must fit in the stash next to the
+  // one which is being read
+  virtual unsigned queue_depth () const
+  { return STASH / avaspec::MAX_MESSAGE - 1; }
+private:
+  // number of bulk in transfers kept queued, and the size of each.  A
+  // reply which does not fit in one transfer continues in the next one.
+  enum { TRANSFERS = 8, TRANSFER_SIZE = 1024 };
+  // room for received data which was not yet returned by read_message,
+  // and for the number of message boundaries in it
+  enum { STASH = 4 * avaspec::MAX_MESSAGE, MAX_ENDS = 32 };
+  libusb_context *m_context;
+  libusb_device_handle *m_handle;
+  int m_interface;
+  unsigned char m_in_ep, m_out_ep;
+  libusb_transfer *m_transfer[TRANSFERS];
+  bool m_busy[TRANSFERS];
+  aligned_buffer m_transfer_data;
+  // number of submitted transfers which did not come back yet
+  unsigned m_pending;
+  bool m_closing;
+  // status of the last failed transfer, or LIBUSB_TRANSFER_COMPLETED
+  libusb_transfer_status m_error;
+  // received data is m_stash[m_head, m_tail).  m_ends holds the offsets
+  // where a message ended with a short packet.
+  aligned_buffer m_stash;
+  unsigned m_head, m_tail;
+  unsigned m_ends[MAX_ENDS];
+  unsigned m_num_ends;
+  // expected size of the message which is being read, or 0
+  unsigned m_expected;
+  // set by the callback, to stop waiting for events
+  int m_arrived;
+  // set by interrupt, to make read_message return if m_allow_interrupt
+  std::atomic <bool> m_interrupted;
+  bool m_allow_interrupt;
+  bool l_find_device (unsigned vendor, unsigned product, unsigned skip);
+  void l_submit (unsigned idx);
+  bool l_complete (unsigned &size) const;
+  unsigned l_available () const;
+  void l_pop (unsigned size);
+  void l_store (unsigned char const *data, unsigned size, bool end);
+  void l_received (libusb_transfer *transfer);
+  static void LIBUSB_CALL l_callback (libusb_transfer *transfer);
+};
+
+#endif // defined AVASPEC_USB_ASYNC_HH